@@ -0,0 +1,9 @@
+#/bin/bash
+# A request line with an empty target is malformed: it gets a 400 and the
+# server stays up for the request after it.
+PORT=${1:-$(/labs/tsam15/my_port)}
+exec 3<>/dev/tcp/localhost/$PORT
+printf 'GET  / HTTP/1.1\r\nHost: localhost\r\n\r\n' >&3
+head -1 <&3
+exec 3<&-
+curl -s -o /dev/null -w "%{http_code}\n" localhost:$PORT/color
@@ -0,0 +1,796 @@
+/* A load generator for httpd.
+ *
+ * It keeps a number of connections busy with a mix of GET, POST and HEAD
+ * requests, pipelined up to a given depth, and records the latency of every
+ * response in a histogram with buckets of at most 1/128 of their value, so
+ * the percentiles it reports are within 1% of the real ones. Each thread runs
+ * its own edge-triggered epoll loop over its share of the connections; the
+ * histograms of the threads are merged at the end. With -r the requests are
+ * sent at a fixed rate and latency is measured from when a request should
+ * have been sent, so a server that stalls is not hidden by the generator
+ * waiting for it. With -o a JSON line describing the run is appended to a
+ * file, to compare builds over time. With -S it runs no load at all but
+ * microbenchmarks of the delimiter scanning kernels httpd parses with, on
+ * request heads of realistic sizes.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "client.h"
+#include "scan.h"
+
+/* Macros */
+#define MAX_PIPELINE 64
+#define MAX_EVENTS 256
+#define SCAN_BATCH 1000
+#define SCAN_TIME (NANOSECONDS / 5)
+#define RETRY_INTERVAL (NANOSECONDS / 100)
+
+/* The kinds of requests we send. */
+enum requestKind {
+    REQUEST_GET,
+    REQUEST_POST,
+    REQUEST_HEAD,
+    REQUEST_KINDS
+};
+
+/* A struct containing a request that has been sent, or is about to be, and
+ * is waiting for its response.
+ */
+struct pendingRequest {
+    enum requestKind kind;
+    long sentAt;
+};
+
+/* A struct containing one connection to the server. The pending requests form
+ * a ring; the last unsent of them have not been written completely, the first
+ * of those up to unsentOffset.
+ */
+struct benchConnection {
+    int fd;
+    int connecting;
+    struct pendingRequest pending[MAX_PIPELINE];
+    int first;
+    int count;
+    int unsent;
+    size_t unsentOffset;
+    struct responseReader reader;
+};
+
+/* A struct containing the settings of a run, shared read-only by the threads. */
+struct benchSettings {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    char *host;
+    char *port;
+    char *path;
+    int connections;
+    int threads;
+    int pipeline;
+    int keepAlive;
+    int weights[REQUEST_KINDS];
+    int totalWeight;
+    long payloadSize;
+    long rate;
+    long duration;
+    char *requests[REQUEST_KINDS];
+    size_t requestLengths[REQUEST_KINDS];
+};
+
+/* A struct containing a thread of the load generator with its connections
+ * and what it has measured.
+ */
+struct benchThread {
+    pthread_t thread;
+    struct benchSettings *settings;
+    int epfd;
+    struct benchConnection *connections;
+    int numberOfConnections;
+    int closed;
+    long retryAt;
+    int next;
+    long interval;
+    long nextDue;
+    long deadline;
+    unsigned long random;
+    unsigned long completed;
+    unsigned long errors;
+    unsigned long non2xx;
+    unsigned long reconnects;
+    unsigned long bytesRead;
+    struct histogram latency;
+};
+
+/* The request heads the scanning kernels are measured on: the one this
+ * program sends, one as a browser sends it and one with a long query and the
+ * cookies a site collects.
+ */
+static const char *scanSamples[][2] = {
+    { "bench", "GET / HTTP/1.1\r\nHost: 127.0.0.1:7398\r\n\r\n" },
+    { "browser", "GET /index.html HTTP/1.1\r\n"
+                 "Host: www.example.com\r\n"
+                 "Connection: keep-alive\r\n"
+                 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+                 "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                 "Accept-Encoding: gzip, deflate, br\r\n"
+                 "Accept-Language: en-US,en;q=0.9,is;q=0.8\r\n"
+                 "Upgrade-Insecure-Requests: 1\r\n"
+                 "Sec-Fetch-Dest: document\r\n"
+                 "Sec-Fetch-Mode: navigate\r\n\r\n" },
+    { "cookies", "GET /search?q=event+loops&lang=en&page=2&sort=date&bg=red HTTP/1.1\r\n"
+                 "Host: www.example.com\r\n"
+                 "Connection: keep-alive\r\n"
+                 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+                 "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                 "Accept-Encoding: gzip, deflate, br\r\n"
+                 "Accept-Language: en-US,en;q=0.9,is;q=0.8\r\n"
+                 "Referer: https://www.example.com/search?q=event+loops&lang=en&page=1\r\n"
+                 "Cookie: bg=red; session=6f1c9a0e4b7d2c85e3a9f0b1d4c7e2a8f5b3c9d1e6a0f4b8c2d7e1a9f3b5c0d8; "
+                 "_ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000; "
+                 "consent=necessary%2Cpreferences%2Cstatistics%2Cmarketing; theme=dark; lang=en; "
+                 "recent=%5B%22event%20loops%22%2C%22io_uring%22%2C%22sendfile%22%2C%22epoll%22%5D; "
+                 "csrftoken=Vh3kQ9zX2mL7pR4tY8wB1nC6sD0fG5jH3kL9zX2mL7pR4tY8wB1nC6sD0fG5jH\r\n"
+                 "Sec-Fetch-Dest: document\r\n"
+                 "Sec-Fetch-Mode: navigate\r\n"
+                 "Sec-Fetch-Site: same-origin\r\n\r\n" },
+};
+
+/* The delimiters httpd scans for, as in its parser. */
+enum scanRun {
+    SCAN_METHOD,
+    SCAN_TARGET,
+    SCAN_LINE,
+    SCAN_HEADER_NAME,
+    SCAN_LINE_BREAK,
+    SCAN_RUNS
+};
+
+/* A method that picks the kind of the next request from the mix (xorshift). */
+enum requestKind pickKind(struct benchThread *thread) {
+    struct benchSettings *settings = thread->settings;
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 7;
+    thread->random ^= thread->random << 17;
+    int pick = (int) (thread->random % (unsigned long) settings->totalWeight);
+    int kind;
+    for(kind = 0; kind < REQUEST_KINDS - 1; kind++) {
+        if(pick < settings->weights[kind]) {
+            break;
+        }
+        pick -= settings->weights[kind];
+    }
+    return (enum requestKind) kind;
+}
+
+/* A method that opens a connection to the server, without waiting for it to
+ * be established. Returns 0 on success and -1 on failure.
+ */
+int openConnection(struct benchThread *thread, struct benchConnection *conn) {
+    struct benchSettings *settings = thread->settings;
+    conn->fd = socket(settings->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd == -1) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(conn->fd, (struct sockaddr *) &settings->address, settings->addressLength) == -1 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    conn->connecting = 1;
+    conn->first = 0;
+    conn->count = 0;
+    conn->unsent = 0;
+    conn->unsentOffset = 0;
+    resetReader(&conn->reader);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if(epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* A method that closes a connection and opens a new one in its place. The
+ * requests that were still waiting on it are counted as errors.
+ */
+void reconnect(struct benchThread *thread, struct benchConnection *conn) {
+    thread->errors += (unsigned long) conn->count;
+    if(conn->fd != -1) {
+        close(conn->fd);
+    }
+    thread->reconnects++;
+    if(openConnection(thread, conn) == -1) {
+        thread->errors++;
+        thread->closed++;
+    }
+}
+
+/* A method that tries again to open the connections that could not be opened,
+ * at most once every RETRY_INTERVAL, so a run does not go on with fewer
+ * connections than it was asked for because the server turned some away for
+ * a moment.
+ */
+void reopenConnections(struct benchThread *thread) {
+    long time = now();
+    if(thread->closed == 0 || time < thread->retryAt) {
+        return;
+    }
+    thread->retryAt = time + RETRY_INTERVAL;
+    int i;
+    for(i = 0; i < thread->numberOfConnections; i++) {
+        if(thread->connections[i].fd == -1 && openConnection(thread, &thread->connections[i]) == 0) {
+            thread->closed--;
+        }
+    }
+}
+
+/* A method that writes as much of the unsent requests of a connection as the
+ * socket takes. The iovecs point into the prebuilt requests, so nothing is copied.
+ * Returns 0 on success and -1 if the connection failed.
+ */
+int flushRequests(struct benchThread *thread, struct benchConnection *conn) {
+    struct benchSettings *settings = thread->settings;
+    while(conn->unsent > 0 && !conn->connecting) {
+        struct iovec iov[MAX_PIPELINE];
+        int i;
+        for(i = 0; i < conn->unsent; i++) {
+            enum requestKind kind = conn->pending[(conn->first + conn->count - conn->unsent + i) % MAX_PIPELINE].kind;
+            iov[i].iov_base = settings->requests[kind];
+            iov[i].iov_len = settings->requestLengths[kind];
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + conn->unsentOffset;
+        iov[0].iov_len -= conn->unsentOffset;
+        ssize_t n = writev(conn->fd, iov, conn->unsent);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        for(i = 0; n > 0; i++) {
+            if((size_t) n < iov[i].iov_len) {
+                conn->unsentOffset += (size_t) n;
+                break;
+            }
+            n -= (ssize_t) iov[i].iov_len;
+            conn->unsentOffset = 0;
+            conn->unsent--;
+        }
+    }
+    return 0;
+}
+
+/* A method that adds a request to the pipeline of a connection. sentAt is the
+ * time the latency of its response is measured from.
+ */
+void queueRequest(struct benchThread *thread, struct benchConnection *conn, long sentAt) {
+    struct pendingRequest *request = &conn->pending[(conn->first + conn->count) % MAX_PIPELINE];
+    request->kind = pickKind(thread);
+    request->sentAt = sentAt;
+    conn->count++;
+    conn->unsent++;
+}
+
+/* A method that fills the pipeline of a connection as far as it may be filled.
+ * Without a rate every connection keeps its pipeline full; with a rate the
+ * requests that are due are handed out to the connections in turn (see
+ * scheduleRequests). A connection that is not kept alive gets one request.
+ */
+void fillPipeline(struct benchThread *thread, struct benchConnection *conn) {
+    struct benchSettings *settings = thread->settings;
+    int depth = settings->keepAlive ? settings->pipeline : 1;
+    if(settings->rate == 0 && !conn->reader.closeAfter) {
+        long time = now();
+        while(conn->count < depth) {
+            queueRequest(thread, conn, time);
+        }
+    }
+    if(flushRequests(thread, conn) == -1) {
+        reconnect(thread, conn);
+    }
+}
+
+/* A method that hands out the requests that are due when sending at a fixed
+ * rate. A request waits for a connection with room in its pipeline, but its
+ * latency still counts from when it was due.
+ */
+void scheduleRequests(struct benchThread *thread) {
+    struct benchSettings *settings = thread->settings;
+    int depth = settings->keepAlive ? settings->pipeline : 1;
+    long time = now();
+    while(thread->nextDue <= time && thread->nextDue < thread->deadline) {
+        int tried;
+        struct benchConnection *conn = NULL;
+        for(tried = 0; tried < thread->numberOfConnections; tried++) {
+            struct benchConnection *candidate = &thread->connections[thread->next];
+            thread->next = (thread->next + 1) % thread->numberOfConnections;
+            if(candidate->fd != -1 && candidate->count < depth && !candidate->reader.closeAfter) {
+                conn = candidate;
+                break;
+            }
+        }
+        if(conn == NULL) {
+            return;
+        }
+        queueRequest(thread, conn, thread->nextDue);
+        thread->nextDue += thread->interval;
+        if(flushRequests(thread, conn) == -1) {
+            reconnect(thread, conn);
+        }
+    }
+}
+
+/* A method that splits a request head the way the parser of httpd does,
+ * scanning for the delimiters of each part in turn: the method, the target
+ * with its query separators, the version and the name and value of each
+ * header line, up to the empty line.
+ * Returns the number of delimiters it found.
+ */
+size_t tokenizeHead(const char *data, size_t length, const struct delimiterSet *runs) {
+    size_t tokens = 0;
+    size_t i = scanDelimiters(data, length, &runs[SCAN_METHOD]) + 1;
+    while(i < length && data[i - 1] != '\r' && data[i - 1] != '\n') {
+        i += scanDelimiters(data + i, length - i, &runs[SCAN_TARGET]);
+        tokens++;
+        if(i < length && data[i] == ' ') {
+            i += scanDelimiters(data + i, length - i, &runs[SCAN_LINE]);
+        }
+        i++;
+    }
+    while(i < length) {
+        if(data[i] == '\n') {
+            i++;
+        }
+        if(i >= length || data[i] == '\r' || data[i] == '\n') {
+            break;
+        }
+        i += scanDelimiters(data + i, length - i, &runs[SCAN_HEADER_NAME]);
+        i += scanDelimiters(data + i, length - i, &runs[SCAN_LINE]) + 1;
+        tokens += 2;
+    }
+    return tokens;
+}
+
+/* A method that measures each scanning kernel this CPU can run on the sample
+ * request heads, splitting them as the parser does and finding their end, and
+ * prints the time per head and how much faster than the scalar kernel it is.
+ */
+void runScanBenchmarks(void) {
+    struct delimiterSet runs[SCAN_RUNS];
+    initDelimiterSet(&runs[SCAN_METHOD], " \r\n");
+    initDelimiterSet(&runs[SCAN_TARGET], " ?&=\r\n");
+    initDelimiterSet(&runs[SCAN_LINE], "\r\n");
+    initDelimiterSet(&runs[SCAN_HEADER_NAME], ":\r\n");
+    initDelimiterSet(&runs[SCAN_LINE_BREAK], "\n");
+    int count;
+    const struct scanKernel *kernels = scanKernels(&count);
+
+    printf("%-8s %-6s %6s", "head", "work", "bytes");
+    int k;
+    for(k = 0; k < count; k++) {
+        printf("  %16s", kernels[k].name);
+    }
+    printf("\n");
+    size_t sample;
+    for(sample = 0; sample < sizeof(scanSamples) / sizeof(scanSamples[0]); sample++) {
+        const char *data = scanSamples[sample][1];
+        size_t length = strlen(data);
+        int work;
+        for(work = 0; work < 2; work++) {
+            printf("%-8s %-6s %6zu", scanSamples[sample][0], work == 0 ? "split" : "end", length);
+            double scalar = 0.0;
+            for(k = 0; k < count; k++) {
+                if(!kernels[k].supported) {
+                    printf("  %16s", "-");
+                    continue;
+                }
+                scanKernel = kernels[k].scan;
+                /* The result is summed, so the compiler can not drop the work. */
+                volatile size_t sink = 0;
+                unsigned long heads = 0;
+                long start = now();
+                long elapsed;
+                do {
+                    int j;
+                    for(j = 0; j < SCAN_BATCH; j++) {
+                        sink += work == 0 ? tokenizeHead(data, length, runs) : findHeadEnd(data, length, &runs[SCAN_LINE_BREAK]);
+                    }
+                    heads += SCAN_BATCH;
+                    elapsed = now() - start;
+                } while(elapsed < SCAN_TIME);
+                double nanoseconds = (double) elapsed / (double) heads;
+                if(k == 0) {
+                    scalar = nanoseconds;
+                }
+                printf("  %7.1f ns %4.1fx", nanoseconds, scalar / nanoseconds);
+            }
+            printf("\n");
+        }
+    }
+}
+
+/* A method that is called when the whole response to the oldest pending
+ * request of a connection has been read.
+ */
+void completeResponse(struct benchThread *thread, struct benchConnection *conn) {
+    struct pendingRequest *request = &conn->pending[conn->first];
+    long time = now();
+    if(time <= thread->deadline) {
+        histogramRecord(&thread->latency, (unsigned long) (time - request->sentAt) / 1000);
+        thread->completed++;
+        if(conn->reader.status < 200 || conn->reader.status > 299) {
+            thread->non2xx++;
+        }
+    }
+    conn->first = (conn->first + 1) % MAX_PIPELINE;
+    conn->count--;
+}
+
+/* A method that reads the responses in the input of a connection.
+ * Returns 0 on success and -1 if a response is malformed or unasked for.
+ */
+int parseResponses(struct benchThread *thread, struct benchConnection *conn) {
+    for(;;) {
+        if(conn->count == 0) {
+            return hasUnreadInput(&conn->reader) ? -1 : 0;
+        }
+        int result = readResponse(&conn->reader, conn->pending[conn->first].kind == REQUEST_HEAD);
+        if(result <= 0) {
+            return result;
+        }
+        completeResponse(thread, conn);
+    }
+}
+
+/* A method that reads everything a connection has for us.
+ * Returns 0 on success and -1 if the connection has to be opened again.
+ */
+int readResponses(struct benchThread *thread, struct benchConnection *conn) {
+    for(;;) {
+        struct responseReader *reader = &conn->reader;
+        ssize_t n = read(conn->fd, reader->input + reader->inputLength, INPUT_LENGTH - reader->inputLength);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if(n == 0) {
+            return -1;
+        }
+        thread->bytesRead += (unsigned long) n;
+        reader->inputLength += (size_t) n;
+        if(parseResponses(thread, conn) == -1) {
+            return -1;
+        }
+        if(conn->count == 0 && conn->reader.closeAfter) {
+            return -1;
+        }
+    }
+}
+
+/* A method that runs the event loop of a thread until the run is over. */
+void *runThread(void *argument) {
+    struct benchThread *thread = argument;
+    struct benchSettings *settings = thread->settings;
+    struct epoll_event events[MAX_EVENTS];
+    int i;
+
+    thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+    for(i = 0; i < thread->numberOfConnections; i++) {
+        if(openConnection(thread, &thread->connections[i]) == -1) {
+            thread->errors++;
+            thread->closed++;
+        }
+    }
+    thread->nextDue = now();
+    thread->deadline = thread->nextDue + settings->duration * NANOSECONDS;
+
+    for(;;) {
+        long time = now();
+        if(time >= thread->deadline) {
+            break;
+        }
+        long wait = thread->deadline - time;
+        reopenConnections(thread);
+        if(thread->closed > 0 && thread->retryAt - time < wait) {
+            wait = thread->retryAt - time;
+        }
+        if(settings->rate > 0) {
+            scheduleRequests(thread);
+            if(thread->nextDue - now() < wait) {
+                wait = thread->nextDue - now();
+            }
+        }
+        int timeout = wait > 0 ? (int) ((wait + 999999) / 1000000) : 0;
+        int n = epoll_wait(thread->epfd, events, MAX_EVENTS, timeout);
+        for(i = 0; i < n; i++) {
+            struct benchConnection *conn = events[i].data.ptr;
+            if(events[i].events & EPOLLERR) {
+                reconnect(thread, conn);
+                continue;
+            }
+            if(conn->connecting && (events[i].events & EPOLLOUT)) {
+                conn->connecting = 0;
+            }
+            /* A hang up is only seen once the responses before it have been read. */
+            if((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && readResponses(thread, conn) == -1) {
+                reconnect(thread, conn);
+                continue;
+            }
+            fillPipeline(thread, conn);
+        }
+    }
+
+    for(i = 0; i < thread->numberOfConnections; i++) {
+        if(thread->connections[i].fd != -1) {
+            close(thread->connections[i].fd);
+        }
+    }
+    close(thread->epfd);
+    return NULL;
+}
+
+/* A method that builds the request of each kind once, so sending one is only a write.
+ * Returns 0 on success and -1 if a request head does not fit in its buffer,
+ * i.e. the path or the host is too long, or we are out of memory.
+ */
+int buildRequests(struct benchSettings *settings) {
+    static const char *methods[REQUEST_KINDS] = { "GET", "POST", "HEAD" };
+    const char *connection = settings->keepAlive ? "" : "Connection: close\r\n";
+    int kind;
+    for(kind = 0; kind < REQUEST_KINDS; kind++) {
+        long payload = kind == REQUEST_POST ? settings->payloadSize : 0;
+        char head[1024];
+        int n;
+        if(kind == REQUEST_POST) {
+            n = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s:%s\r\n%sContent-Type: text/plain\r\nContent-Length: %ld\r\n\r\n",
+                         methods[kind], settings->path, settings->host, settings->port, connection, payload);
+        }
+        else {
+            n = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n", methods[kind], settings->path, settings->host, settings->port, connection);
+        }
+        if(n < 0 || (size_t) n >= sizeof(head)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        settings->requests[kind] = malloc((size_t) n + (size_t) payload);
+        if(settings->requests[kind] == NULL) {
+            return -1;
+        }
+        memcpy(settings->requests[kind], head, (size_t) n);
+        memset(settings->requests[kind] + n, 'x', (size_t) payload);
+        settings->requestLengths[kind] = (size_t) n + (size_t) payload;
+    }
+    return 0;
+}
+
+/* A method that reads the request mix, i.e. "get=80,post=15,head=5".
+ * Returns 0 on success and -1 if it is not a mix.
+ */
+int parseMix(struct benchSettings *settings, char *mix) {
+    static const char *names[REQUEST_KINDS] = { "get", "post", "head" };
+    memset(settings->weights, 0, sizeof(settings->weights));
+    settings->totalWeight = 0;
+    char *save = NULL;
+    char *part;
+    for(part = strtok_r(mix, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(part, '=');
+        int kind;
+        for(kind = 0; kind < REQUEST_KINDS; kind++) {
+            if(equals != NULL && (size_t) (equals - part) == strlen(names[kind]) && strncasecmp(part, names[kind], strlen(names[kind])) == 0) {
+                break;
+            }
+        }
+        if(kind == REQUEST_KINDS || atoi(equals + 1) < 0) {
+            return -1;
+        }
+        settings->weights[kind] = atoi(equals + 1);
+        settings->totalWeight += settings->weights[kind];
+    }
+    return settings->totalWeight > 0 ? 0 : -1;
+}
+
+/* A method that prints how the load generator is meant to be started. */
+void usage(char *program) {
+    fprintf(stderr, "Usage: %s [-c connections] [-t threads] [-d seconds] [-p pipeline] [-k] [-m mix] [-s payload-size] [-r rate] [-u path] [-j] [-o file] host port\n", program);
+    fprintf(stderr, "  -c connections  number of connections (default 16)\n");
+    fprintf(stderr, "  -t threads      number of threads, the connections are divided among them (default 1)\n");
+    fprintf(stderr, "  -d seconds      how long to run (default 10)\n");
+    fprintf(stderr, "  -p pipeline     requests sent on a connection before waiting for responses (default 1, at most %d)\n", MAX_PIPELINE);
+    fprintf(stderr, "  -k              open a new connection for every request instead of keeping them alive\n");
+    fprintf(stderr, "  -m mix          weights of the request methods (default get=100), i.e. get=80,post=15,head=5\n");
+    fprintf(stderr, "  -s payload-size bytes of content in each POST (default 0)\n");
+    fprintf(stderr, "  -r rate         requests per second for all connections together (default 0, as fast as possible)\n");
+    fprintf(stderr, "  -u path         request target (default /)\n");
+    fprintf(stderr, "  -j              print the result as one JSON line\n");
+    fprintf(stderr, "  -o file         also append the result as one JSON line to the file\n");
+    fprintf(stderr, "       %s -S\n", program);
+    fprintf(stderr, "  -S              measure the delimiter scanning kernels of httpd instead\n");
+}
+
+/* A method that prints the result of a run as one JSON line. */
+void printJSON(FILE *out, struct benchSettings *settings, struct benchThread *total, double seconds, char *mix) {
+    struct histogram *latency = &total->latency;
+    fprintf(out, "{\"time\":%ld,\"host\":\"%s\",\"port\":\"%s\",\"path\":\"%s\",\"connections\":%d,\"threads\":%d,\"pipeline\":%d,"
+            "\"keepalive\":%s,\"mix\":\"%s\",\"payload\":%ld,\"rate\":%ld,\"seconds\":%.3f,"
+            "\"requests\":%lu,\"rps\":%.1f,\"bytes\":%lu,\"errors\":%lu,\"non2xx\":%lu,\"reconnects\":%lu,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+            (long) time(NULL), settings->host, settings->port, settings->path, settings->connections, settings->threads, settings->pipeline,
+            settings->keepAlive ? "true" : "false", mix, settings->payloadSize, settings->rate, seconds,
+            total->completed, (double) total->completed / seconds, total->bytesRead, total->errors, total->non2xx, total->reconnects,
+            latency->total > 0 ? (double) latency->sum / (double) latency->total : 0.0,
+            histogramPercentile(latency, 50.0), histogramPercentile(latency, 90.0), histogramPercentile(latency, 99.0),
+            histogramPercentile(latency, 99.9), latency->max);
+}
+
+int main(int argc, char **argv) {
+    struct benchSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.connections = 16;
+    settings.threads = 1;
+    settings.pipeline = 1;
+    settings.keepAlive = 1;
+    settings.duration = 10;
+    settings.path = "/";
+    settings.weights[REQUEST_GET] = 100;
+    settings.totalWeight = 100;
+    char mix[256] = "get=100";
+    int json = 0;
+    char *outputFile = NULL;
+
+    /* Parse the command line. */
+    int opt;
+    while((opt = getopt(argc, argv, "c:t:d:p:km:s:r:u:jo:S")) != -1) {
+        switch(opt) {
+            case 'c':
+                settings.connections = atoi(optarg);
+                break;
+            case 't':
+                settings.threads = atoi(optarg);
+                break;
+            case 'd':
+                settings.duration = atol(optarg);
+                break;
+            case 'p':
+                settings.pipeline = atoi(optarg);
+                break;
+            case 'k':
+                settings.keepAlive = 0;
+                break;
+            case 'm': {
+                snprintf(mix, sizeof(mix), "%s", optarg);
+                char copy[256];
+                snprintf(copy, sizeof(copy), "%s", optarg);
+                if(parseMix(&settings, copy) == -1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 's':
+                settings.payloadSize = atol(optarg);
+                break;
+            case 'r':
+                settings.rate = atol(optarg);
+                break;
+            case 'u':
+                settings.path = optarg;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'o':
+                outputFile = optarg;
+                break;
+            case 'S':
+                runScanBenchmarks();
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(argc - optind != 2 || settings.connections <= 0 || settings.threads <= 0 || settings.duration <= 0
+       || settings.pipeline <= 0 || settings.pipeline > MAX_PIPELINE || settings.payloadSize < 0 || settings.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    settings.host = argv[optind];
+    settings.port = argv[optind + 1];
+    if(settings.threads > settings.connections) {
+        settings.threads = settings.connections;
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(settings.host, settings.port, &hints, &result);
+    if(error != 0) {
+        fprintf(stderr, "%s: %s\n", settings.host, gai_strerror(error));
+        return 1;
+    }
+    memcpy(&settings.address, result->ai_addr, result->ai_addrlen);
+    settings.addressLength = result->ai_addrlen;
+    freeaddrinfo(result);
+    if(buildRequests(&settings) == -1) {
+        fprintf(stderr, "Can not build the requests: %s\n", strerror(errno));
+        return 1;
+    }
+    initScanning();
+
+    /* Start the threads, each with its share of the connections and of the rate. */
+    struct benchThread *threads = calloc((size_t) settings.threads, sizeof(struct benchThread));
+    int i;
+    int given = 0;
+    long start = now();
+    for(i = 0; i < settings.threads; i++) {
+        struct benchThread *thread = &threads[i];
+        thread->settings = &settings;
+        thread->numberOfConnections = settings.connections / settings.threads + (i < settings.connections % settings.threads ? 1 : 0);
+        thread->connections = calloc((size_t) thread->numberOfConnections, sizeof(struct benchConnection));
+        thread->random = 0x9e3779b97f4a7c15UL * (unsigned long) (i + 1);
+        if(settings.rate > 0) {
+            thread->interval = NANOSECONDS * settings.threads / settings.rate;
+        }
+        given += thread->numberOfConnections;
+        pthread_create(&thread->thread, NULL, runThread, thread);
+    }
+
+    struct benchThread total;
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < settings.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        total.completed += threads[i].completed;
+        total.errors += threads[i].errors;
+        total.non2xx += threads[i].non2xx;
+        total.reconnects += threads[i].reconnects;
+        total.bytesRead += threads[i].bytesRead;
+        histogramMerge(&total.latency, &threads[i].latency);
+    }
+    double seconds = (double) (now() - start) / NANOSECONDS;
+
+    if(json) {
+        printJSON(stdout, &settings, &total, seconds, mix);
+    }
+    else {
+        printf("%d connections on %d threads, pipeline %d, %s, mix %s, %ld byte payload, %.2f s\n",
+               given, settings.threads, settings.pipeline, settings.keepAlive ? "keep-alive" : "a new connection per request",
+               mix, settings.payloadSize, seconds);
+        printf("  requests   %lu (%.1f/s), %.2f MB read\n", total.completed, (double) total.completed / seconds, (double) total.bytesRead / 1e6);
+        printf("  errors     %lu, non-2xx %lu, reconnects %lu\n", total.errors, total.non2xx, total.reconnects);
+        printf("  latency    p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+               histogramPercentile(&total.latency, 50.0), histogramPercentile(&total.latency, 90.0),
+               histogramPercentile(&total.latency, 99.0), histogramPercentile(&total.latency, 99.9), total.latency.max);
+    }
+    if(outputFile != NULL) {
+        FILE *out = fopen(outputFile, "a");
+        if(out == NULL) {
+            perror(outputFile);
+            return 1;
+        }
+        printJSON(out, &settings, &total, seconds, mix);
+        fclose(out);
+    }
+    return total.completed > 0 ? 0 : 1;
+}
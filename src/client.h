@@ -0,0 +1,277 @@
+/* What the clients of httpd have in common: bench and replay both record the
+ * latency of every response in a histogram with buckets of at most 1/128 of
+ * their value, so the percentiles they report are within 1% of the real ones,
+ * and both read the responses of the server as they arrive, skipping bodies
+ * without keeping them.
+ *
+ * It is a header of static functions, like scan.h.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "scan.h"
+
+#define INPUT_LENGTH 65536
+#define HISTOGRAM_SUB_BITS 8
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_GROUPS 40
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT * (HISTOGRAM_GROUPS + 1))
+#define NANOSECONDS 1000000000L
+
+/* The states of reading a response: the head, a body with a Content-Length,
+ * and the parts of a chunked body.
+ */
+enum responseState {
+    RESPONSE_HEAD,
+    RESPONSE_BODY,
+    RESPONSE_CHUNK_SIZE,
+    RESPONSE_CHUNK_DATA,
+    RESPONSE_CHUNK_END,
+    RESPONSE_TRAILER
+};
+
+/* A struct containing a latency histogram in microseconds. Values below
+ * HISTOGRAM_SUB_COUNT have a bucket each; above that every power of two is
+ * split into HISTOGRAM_SUB_COUNT / 2 buckets.
+ */
+struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+    unsigned long sum;
+};
+
+/* A struct containing what has been read of the responses on a connection.
+ * The input up to used has been looked at; status and closeAfter describe the
+ * response whose head was read last.
+ */
+struct responseReader {
+    char input[INPUT_LENGTH];
+    size_t inputLength;
+    size_t used;
+    enum responseState state;
+    size_t bodyLeft;
+    int status;
+    int closeAfter;
+};
+
+/* A method that returns the monotonic time in nanoseconds. */
+static inline long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NANOSECONDS + ts.tv_nsec;
+}
+
+/* A method that finds the bucket of a value in a histogram. */
+static inline int histogramBucket(unsigned long value) {
+    if(value < HISTOGRAM_SUB_COUNT) {
+        return (int) value;
+    }
+    int group = 63 - __builtin_clzl(value) - HISTOGRAM_SUB_BITS + 1;
+    if(group > HISTOGRAM_GROUPS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return HISTOGRAM_SUB_COUNT + (group - 1) * (HISTOGRAM_SUB_COUNT / 2) + (int) ((value >> group) - HISTOGRAM_SUB_COUNT / 2);
+}
+
+/* A method that finds the highest value that falls in a bucket of a histogram. */
+static inline unsigned long histogramValue(int bucket) {
+    if(bucket < HISTOGRAM_SUB_COUNT) {
+        return (unsigned long) bucket;
+    }
+    int group = (bucket - HISTOGRAM_SUB_COUNT) / (HISTOGRAM_SUB_COUNT / 2) + 1;
+    unsigned long sub = (unsigned long) ((bucket - HISTOGRAM_SUB_COUNT) % (HISTOGRAM_SUB_COUNT / 2) + HISTOGRAM_SUB_COUNT / 2);
+    return ((sub + 1) << group) - 1;
+}
+
+/* A method that records a value in a histogram. */
+static inline void histogramRecord(struct histogram *histogram, unsigned long value) {
+    histogram->counts[histogramBucket(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if(value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/* A method that adds the values of one histogram to another. */
+static inline void histogramMerge(struct histogram *into, struct histogram *from) {
+    int i;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if(from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/* A method that finds the value below which the given percentage of the
+ * values in a histogram are. It is never more than the largest value.
+ */
+static inline unsigned long histogramPercentile(struct histogram *histogram, double percentile) {
+    if(histogram->total == 0) {
+        return 0;
+    }
+    unsigned long wanted = (unsigned long) (percentile / 100.0 * (double) histogram->total + 0.5);
+    if(wanted == 0) {
+        wanted = 1;
+    }
+    unsigned long seen = 0;
+    int i;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if(seen >= wanted) {
+            unsigned long value = histogramValue(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/* A method that starts reading the responses of a new connection. */
+static inline void resetReader(struct responseReader *reader) {
+    reader->inputLength = 0;
+    reader->used = 0;
+    reader->state = RESPONSE_HEAD;
+    reader->bodyLeft = 0;
+    reader->closeAfter = 0;
+}
+
+/* A method that tells if there is input that has not been read as part of a
+ * response yet.
+ */
+static inline int hasUnreadInput(struct responseReader *reader) {
+    return reader->used < reader->inputLength;
+}
+
+/* A method that reads the head of a response when all of it is in the input.
+ * The response to a HEAD request has no body, whatever its head says.
+ * Returns the length of the head, 0 if more is needed and -1 if it is not a
+ * response we understand.
+ */
+static inline long readResponseHead(struct responseReader *reader, int headRequest) {
+    static struct delimiterSet lineBreaks = { { '\n' }, 1, { ['\n'] = 1 } };
+    size_t length = findHeadEnd(reader->input, reader->inputLength, &lineBreaks);
+    if(length == 0) {
+        return reader->inputLength == INPUT_LENGTH ? -1 : 0;
+    }
+    if(length < 12 || memcmp(reader->input, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    /* The empty line, which the last header line ends before. */
+    char *end = reader->input + length - (reader->input[length - 2] == '\r' ? 2 : 1);
+    reader->status = atoi(reader->input + 9);
+    reader->bodyLeft = 0;
+    reader->state = RESPONSE_BODY;
+    char *line = (char *) memchr(reader->input, '\n', length) + 1;
+    while(line < end) {
+        char *next = (char *) memchr(line, '\n', (size_t) (end - line)) + 1;
+        if(strncasecmp(line, "Content-Length:", 15) == 0) {
+            reader->bodyLeft = strtoul(line + 15, NULL, 10);
+        }
+        else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0 && memmem(line, (size_t) (next - line), "chunked", 7) != NULL) {
+            reader->state = RESPONSE_CHUNK_SIZE;
+        }
+        else if(strncasecmp(line, "Connection:", 11) == 0 && memmem(line, (size_t) (next - line), "close", 5) != NULL) {
+            reader->closeAfter = 1;
+        }
+        line = next;
+    }
+    if(headRequest) {
+        reader->state = RESPONSE_BODY;
+        reader->bodyLeft = 0;
+    }
+    return (long) length;
+}
+
+/* A method that reads the next response in the input of a connection, as far
+ * as it has arrived. Bodies are skipped as they arrive and never kept; what
+ * is left of the input is kept for the next call.
+ * Returns 1 once the whole response has been read, 0 if more input is needed
+ * and -1 if the response is malformed.
+ */
+static inline int readResponse(struct responseReader *reader, int headRequest) {
+    while(reader->used < reader->inputLength || (reader->state == RESPONSE_BODY && reader->bodyLeft == 0)) {
+        char *data = reader->input + reader->used;
+        size_t available = reader->inputLength - reader->used;
+        int complete = 0;
+        switch(reader->state) {
+            case RESPONSE_HEAD: {
+                memmove(reader->input, data, available);
+                reader->inputLength = available;
+                reader->used = 0;
+                long length = readResponseHead(reader, headRequest);
+                if(length <= 0) {
+                    return (int) length;
+                }
+                reader->used = (size_t) length;
+                break;
+            }
+            case RESPONSE_BODY:
+            case RESPONSE_CHUNK_DATA: {
+                size_t skip = available < reader->bodyLeft ? available : reader->bodyLeft;
+                reader->used += skip;
+                reader->bodyLeft -= skip;
+                if(reader->bodyLeft == 0) {
+                    if(reader->state == RESPONSE_BODY) {
+                        complete = 1;
+                    }
+                    else {
+                        reader->state = RESPONSE_CHUNK_END;
+                        reader->bodyLeft = 2;
+                    }
+                }
+                break;
+            }
+            case RESPONSE_CHUNK_END: {
+                size_t skip = available < reader->bodyLeft ? available : reader->bodyLeft;
+                reader->used += skip;
+                reader->bodyLeft -= skip;
+                if(reader->bodyLeft == 0) {
+                    reader->state = RESPONSE_CHUNK_SIZE;
+                }
+                break;
+            }
+            case RESPONSE_CHUNK_SIZE:
+            case RESPONSE_TRAILER: {
+                char *newline = memchr(data, '\n', available);
+                if(newline == NULL) {
+                    memmove(reader->input, data, available);
+                    reader->inputLength = available;
+                    reader->used = 0;
+                    return 0;
+                }
+                reader->used += (size_t) (newline - data) + 1;
+                if(reader->state == RESPONSE_TRAILER) {
+                    complete = newline == data || (newline == data + 1 && data[0] == '\r');
+                }
+                else {
+                    reader->bodyLeft = strtoul(data, NULL, 16);
+                    reader->state = reader->bodyLeft == 0 ? RESPONSE_TRAILER : RESPONSE_CHUNK_DATA;
+                }
+                break;
+            }
+        }
+        if(complete) {
+            reader->state = RESPONSE_HEAD;
+            if(reader->used == reader->inputLength) {
+                reader->inputLength = 0;
+                reader->used = 0;
+            }
+            return 1;
+        }
+    }
+    reader->inputLength = 0;
+    reader->used = 0;
+    return 0;
+}
+
+#endif
@@ -1,742 +1,6292 @@
-/* A UDP echo server with timeouts.
+/* A HTTP server that serves a generated color page, and static files from a
+ * document root when it is given one.
  *
- * Note that you will not need to use select and the timeout for a
- * tftp server. However, select is also useful if you want to receive
- * from multiple sockets at the same time. Read the documentation for
- * select on how to do this (Hint: Iterate with FD_ISSET()).
+ * The server runs an event loop over non-blocking sockets, so the work done
+ * on each wakeup depends on the number of sockets with something to do and
+ * not on the number of open connections. The loop gets its events from an
+ * engine: edge-triggered epoll, or io_uring with -e io_uring, which falls back
+ * to epoll on kernels that can not run it. With the -w option the server runs
+ * one such loop per worker thread, each on its own SO_REUSEPORT listening socket.
+ *
+ * Built with make CPPFLAGS=-DPHASE_TRACING the server also times the phases of
+ * each request and of the event loops into a ring per worker, and sends the
+ * last of them as Chrome trace events for GET /phases, or writes them to
+ * PHASES_FILE on SIGUSR2.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
-#include <sys/select.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <time.h>
 #include <arpa/inet.h>
-#include <glib.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <zlib.h>
+#include "scan.h"
 
 /* Macros */
-#define REQUEST_METHOD_LENGTH 8
-#define REQUEST_URL_LENGTH 100
-#define CONTENT_LENGTH 6000
-#define PORT_LENGTH 6
-#define MAX_QUERY_LENGTH 100
-#define MESSAGE_LENGTH 512
-#define COOKIE_LENGTH 1000
-#define MAX_HTML_LENGTH 99999
+#define INPUT_BUFFER_LENGTH 4096
+#define MAX_HEADER_LENGTH (32 * 1024)
+#define MAX_BODY_SIZE (64L * 1024 * 1024)
+#define OUTPUT_HIGH_WATER (256 * 1024)
+#define IOV_BATCH 64
+#define ECHO_SCRATCH_LENGTH 8192
+#define ECHO_COPY_MIN 256
+#define PAGE_START "<!DOCTYPE html>\n<html>\n<head></head>\n<body{style}>\n\t<p>\n\t\thttp://localhost/{server-port}{target}<br>\n\t\t{queries}{ip}<br>\n\t\t{port}<br>\n\t</p>\n"
+#define GET_PAGE_TEMPLATE PAGE_START "</body>\n</html>\n"
+#define POST_PAGE_TEMPLATE PAGE_START "\t<p>\n\t\t{content}<br>\n\t</p>\n</body>\n</html>\n"
+#define MAX_PAGE_PIECES 32
+#define FILE_CACHE_ENTRIES 256
+#define FILE_CACHE_BUCKETS 512
+#define FILE_MISS_SLOTS 64
+#define FILE_HEAD_LENGTH 256
+#define ARENA_BLOCK_SIZE 8192
+#define POOL_CLASSES 4
+#define POOL_MIN_BUFFER 4096
+#define POOL_MAX_FREE (8L * 1024 * 1024)
+#define CONNECTION_SLAB 64
+#define ARENA_ALIGNMENT 16
+#define NUMBER_LENGTH 20
 #define HEAD_LENGTH 1000
-#define MAX_TOKENS -1
-#define CONNECTION_TIME 10
-#define MAX_NUMBER_OF_QUERIES 100
-#define NUMBER_OF_CONNECTIONS 5
+#define HEAD_TEMPLATE_LENGTH 128
+#define DATE_LENGTH 20
+#define MAX_COOKIE_LENGTH 512
+#define TIMER_TICK 10
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define HEADER_TIMEOUT 10000
+#define BODY_TIMEOUT 30000
+#define KEEPALIVE_TIMEOUT 10000
+#define WRITE_TIMEOUT 30000
+#define IDLE_TIMEOUT 5000
+#define MAX_NUMBER_OF_QUERIES 50
+#define MAX_HEADERS 32
+#define PARSE_ERROR -1
+#define PARSE_INCOMPLETE 0
+#define PARSE_COMPLETE 1
+#define INITIAL_CONNECTIONS 1024
+#define LISTEN_BACKLOG 128
+#define MAX_PENDING 1024
+#define RETRY_AFTER 1
+#define LENGTH_CHUNKED -1
+#define LENGTH_UNTIL_CLOSE -2
+#define SHED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nServer: jordanthor\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define LIMIT_RESPONSE "HTTP/1.1 429 Too Many Requests\r\nServer: jordanthor\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define LINGER_SLOTS 64
+#define LINGER_TIMEOUT 2000
+#define LINGER_DRAIN 65536
+#define CLIENT_SHARDS 64
+#define CLIENT_SHARD_SLOTS 1024
+#define CLIENT_PROBES 16
+#define CLIENT_OCCUPIED (1ULL << 31)
+#define CLIENT_COUNT_MASK (CLIENT_OCCUPIED - 1)
+#define MAX_EVENTS 1024
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define URING_KIND_BITS 3
+#define HANDOFF_BATCH 64
+#define LOG_LINE_LENGTH 1024
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_BATCH_SIZE (256 * 1024)
+#define LOG_FLUSH_INTERVAL 50
+#define LOG_ROTATIONS 5
+#define LOG_PATH "src/httpd.log"
+#define TRACE_LINE_LENGTH 16384
+#define CACHE_LINE_SIZE 64
+#define STATUS_KINDS 11
+#define LATENCY_BUCKETS 24
+#define STATS_PATH "/stats"
+#define PHASES_PATH "/phases"
+#define PHASES_FILE "src/httpd-phases.json"
+#define PHASE_RING_SIZE 65536
+#define COMPRESS_LEVEL 6
+#define COMPRESS_MIN_SIZE 1024
+#define COMPRESS_CACHE_SIZE (16L * 1024 * 1024)
+#define COMPRESS_MAX_FILE_SIZE (4L * 1024 * 1024)
+#define RUN_MEM_LEVEL 4
+#define STORED_RUN 128
+#define GZIP_HEADER "\x1f\x8b\x08\0\0\0\0\0\0\x03"
+#define ZLIB_HEADER "\x78\x9c"
+
+/* The phases of the requests are only timed when the server is built with
+ * -DPHASE_TRACING, otherwise marking them compiles to nothing.
+ */
+#ifdef PHASE_TRACING
+#define MARK_PHASE(conn, next) markPhase(conn, next)
+#define MARK_PHASE_AFTER(conn, from, next) do { if((conn)->phase == (from)) markPhase(conn, next); } while(0)
+#define MARK_LOOP(ring, next) markLoop(ring, next)
+#else
+#define MARK_PHASE(conn, next) ((void) 0)
+#define MARK_PHASE_AFTER(conn, from, next) ((void) 0)
+#define MARK_LOOP(ring, next) ((void) 0)
+#endif
+
+/* A struct describing a piece of a request buffer by a pointer and a length.
+ * The parser hands out views into the buffer instead of copying strings out.
+ */
+struct stringView {
+    char *start;
+    size_t length;
+};
+
+/* A struct containing a single header line of a request. */
+struct httpHeader {
+    struct stringView name;
+    struct stringView value;
+};
+
+/* A struct containing a single query parameter, i.e. "bg=red" has the
+ * variable "bg" and the value "red".
+ */
+struct queryParameter {
+    struct stringView variable;
+    struct stringView value;
+};
+
+/* The states of the request parser, one for each part of the request. */
+enum parseState {
+    PARSE_METHOD,
+    PARSE_TARGET,
+    PARSE_VERSION,
+    PARSE_REQUEST_LINE_END,
+    PARSE_HEADER_START,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE_START,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADER_LINE_END,
+    PARSE_HEADERS_END,
+    PARSE_DONE
+};
+
+/* A struct containing a parsed request. Every field is a view into the buffer
+ * that was parsed, so the buffer must stay in place while the request is used.
+ * The parser is incremental: offset is where it stopped, and calling it again
+ * on a longer buffer continues from there.
+ */
+struct httpRequest {
+    enum parseState state;
+    size_t offset;
+    size_t tokenStart;
+    struct stringView method;
+    struct stringView target;
+    struct stringView path;
+    struct stringView query;
+    struct stringView version;
+    struct queryParameter queries[MAX_NUMBER_OF_QUERIES];
+    int numberOfQueries;
+    int inQueryValue;
+    struct httpHeader headers[MAX_HEADERS];
+    int numberOfHeaders;
+    struct stringView headerName;
+    size_t headerLength;
+    struct stringView body;
+    long contentLength;
+    int chunked;
+    int keepAlive;
+};
+
+/* A struct containing a piece of a response that the client could not take
+ * yet. The pieces of a connection form a queue that is written out in order
+ * when the socket becomes writable again. A piece is either data or, if fd
+ * is not -1, the part of a file from offset to length, which is sent with
+ * sendfile() and has no data. With io_uring a piece is sent by the kernel in
+ * the background, and while it is inFlight it can not be freed; if its
+ * connection is closed in the meantime owner is cleared instead, and the
+ * piece is freed when the send completes.
+ */
+struct outputBuffer {
+    struct outputBuffer *next;
+    struct connection *owner;
+    int inFlight;
+    int fd;
+    size_t length;
+    size_t offset;
+    char data[];
+};
+
+/* The states of a request body that is being streamed, one for each part of
+ * a chunked body and BODY_LENGTH for a body with a Content-Length. A chunk
+ * size starts in BODY_CHUNK_SIZE_START, which only takes a hex digit.
+ */
+enum bodyState {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNK_SIZE_START,
+    BODY_CHUNK_SIZE,
+    BODY_CHUNK_EXTENSION,
+    BODY_CHUNK_SIZE_END,
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_DATA_END,
+    BODY_TRAILER_START,
+    BODY_TRAILER_LINE
+};
+
+/* A struct containing a buffer on one of the free lists of a pool. */
+struct pooledBuffer {
+    struct pooledBuffer *next;
+};
+
+/* A struct containing the buffers a worker lends to its connections while
+ * they have a request in progress, that is their input buffers and the blocks
+ * of their arenas. The buffers come in POOL_CLASSES sizes, each twice the one
+ * before starting at POOL_MIN_BUFFER, with a free list per size. Buffers that
+ * are given back are kept for the next connection, as long as no more than
+ * POOL_MAX_FREE bytes are kept in all; larger buffers are not pooled.
+ */
+struct bufferPool {
+    struct pooledBuffer *free[POOL_CLASSES];
+    size_t freeBytes;
+};
+
+/* A struct containing a block of memory in an arena. Allocations are bumped
+ * from data until the block is full. The block is a buffer of the pool, and
+ * its capacity is what is left of the buffer after the header.
+ */
+struct arenaBlock {
+    struct arenaBlock *next;
+    size_t capacity;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+/* A struct containing a bump allocator for everything a request needs while
+ * it is parsed and rendered. Nothing is freed on its own, the whole arena is
+ * reset at once when the request is done. Its blocks come from pool.
+ */
+struct arena {
+    struct arenaBlock *blocks;
+    struct bufferPool *pool;
+};
+
+/* A struct containing text that is built up piece by piece, i.e. a page we
+ * send back. The length is tracked so appending never has to look for the
+ * end of the text, and the memory comes from the arena of the request.
+ * If the arena runs out of memory failed is set and further appends are ignored.
+ */
+struct textBuffer {
+    struct arena *arena;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+};
+
+/* The slots of a page template, that is the parts of a page that depend on
+ * the request. SLOT_NONE marks the static text in between.
+ */
+enum pageSlot {
+    SLOT_NONE,
+    SLOT_STYLE,
+    SLOT_SERVER_PORT,
+    SLOT_TARGET,
+    SLOT_QUERIES,
+    SLOT_IP,
+    SLOT_PORT,
+    SLOT_CONTENT
+};
+
+/* A struct containing a piece of a page template: either static text or a
+ * slot that is filled in for each request.
+ */
+struct pagePiece {
+    enum pageSlot slot;
+    const char *text;
+    size_t length;
+    char *deflated;
+    size_t deflatedLength;
+};
+
+/* A struct containing a page that has been split into its pieces once at
+ * startup. The text of the pieces points into the template itself, so it is
+ * never copied. contentIndex is the piece where the posted content goes, or
+ * -1 if the page has none; only static text may follow it. The static text
+ * is also compressed once at startup (see compressPageTemplate).
+ */
+struct pageTemplate {
+    int count;
+    int contentIndex;
+    struct pagePiece pieces[MAX_PAGE_PIECES];
+};
+
+/* The encodings a response can be sent with. */
+enum contentEncoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE
+};
+
+/* The methods we count requests for, anything else is METHOD_OTHER. */
+enum methodKind {
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_HEAD,
+    METHOD_OTHER,
+    METHOD_KINDS
+};
+
+/* A struct containing the counters of a worker for /stats. Only the worker
+ * writes them, so they are plain loads and stores with no lock and no atomic
+ * read-modify-write; they are atomic only so the worker that serves /stats
+ * can read them while they change.
+ */
+struct workerStats {
+    _Atomic unsigned long requests[METHOD_KINDS];
+    /* By status, in the order of statusCodes, with any other status last. */
+    _Atomic unsigned long responses[STATUS_KINDS];
+    _Atomic unsigned long bytesIn;
+    _Atomic unsigned long bytesOut;
+    _Atomic unsigned long accepted;
+    _Atomic unsigned long connections;
+    _Atomic unsigned long idle;
+    _Atomic unsigned long inFlight;
+    _Atomic unsigned long pending;
+    /* Turned away with a 503 because the worker was full. */
+    _Atomic unsigned long shedConnections;
+    _Atomic unsigned long shedRequests;
+    /* Turned away with a 429 because their client address was over its limits. */
+    _Atomic unsigned long limitedConnections;
+    _Atomic unsigned long limitedRequests;
+    /* The compressed responses, and their bytes before and after compression. */
+    _Atomic unsigned long compressed;
+    _Atomic unsigned long compressedIn;
+    _Atomic unsigned long compressedOut;
+    /* A bucket for each power of two of microseconds from the first byte of a
+     * request to the last of its response being handed to the kernel, the
+     * last bucket is everything above.
+     */
+    _Atomic unsigned long latency[METHOD_KINDS][LATENCY_BUCKETS];
+    _Atomic unsigned long latencySum[METHOD_KINDS];
+};
+
+/* A struct containing a timer in the timer wheel, that is the tick it expires
+ * at, where in the wheel it sits and its neighbours in that slot.
+ */
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    unsigned long expires;
+    int level;
+    int slot;
+};
+
+/* A struct containing a hierarchical timer wheel. Level 0 has one slot per
+ * tick of TIMER_TICK milliseconds, and each level above has slots that are
+ * TIMER_SLOTS times as wide. A timer goes into the lowest level whose current
+ * round still contains its expiry tick, and moves down a level each time the
+ * level below wraps around. So adding, removing and expiring a timer are all
+ * O(1). The occupied bitmaps tell which slots hold timers, so the next
+ * deadline can be found without walking the slots.
+ */
+struct timerWheel {
+    unsigned long currentTick;
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];
+    long count;
+};
+
+/* The timeouts a connection can be waiting on. Headers must arrive within
+ * HEADER_TIMEOUT of their first byte, a body must make progress every
+ * BODY_TIMEOUT, an idle keep-alive connection is kept for KEEPALIVE_TIMEOUT
+ * and queued output must make progress every WRITE_TIMEOUT.
+ */
+enum timeoutKind {
+    TIMEOUT_NONE,
+    TIMEOUT_HEADER,
+    TIMEOUT_BODY,
+    TIMEOUT_KEEPALIVE,
+    TIMEOUT_WRITE
+};
+
+#ifdef PHASE_TRACING
+/* The phases a request goes through, which are timed when the server is built
+ * with -DPHASE_TRACING. A request is read until its head is complete, with each
+ * attempt to parse it timed on its own, may wait in the pending queue, is
+ * handled until its response starts to be written, streams its body if it has
+ * one and is done once its response has been written. PHASE_REQUEST spans all
+ * of them. The event loop of a worker alternates between waiting for events
+ * and working on them.
+ */
+enum phase {
+    PHASE_NONE,
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_QUEUE,
+    PHASE_HANDLE,
+    PHASE_BODY,
+    PHASE_WRITE,
+    PHASE_REQUEST,
+    PHASE_WAIT,
+    PHASE_WORK,
+    PHASE_KINDS
+};
+
+/* A struct containing a phase that has ended, in monotonic nanoseconds. track
+ * is the generation of the connection it belongs to, or 0 for the event loop.
+ * method and status are only set for PHASE_REQUEST.
+ */
+struct phaseSpan {
+    long start;
+    long end;
+    unsigned track;
+    unsigned char phase;
+    unsigned char method;
+    short status;
+};
+
+/* A struct containing the last PHASE_RING_SIZE phases a worker has timed. Only
+ * the worker writes to it, and next only grows, so a reader can tell which
+ * spans were overwritten while it copied them. loopPhase is the phase the
+ * event loop is in and loopStart when it started.
+ */
+struct phaseRing {
+    _Atomic unsigned long next;
+    enum phase loopPhase;
+    long loopStart;
+    struct phaseSpan spans[PHASE_RING_SIZE];
+};
+#endif
 
-/* A struct containing information about a connection, that is its file descriptor, 
- * whether the connection is "keep-alive" or not, and the starting time of the connection.
+/* A struct containing information about a connection: its file descriptor,
+ * its buffers, the request in progress and the state it is in.
+ *
+ * There is one of these for every client we hold, most of them idle between
+ * requests, so it is kept small: the flags are bits, the input buffer and the
+ * arena are borrowed from the pool of the worker only while a request is in
+ * progress, and the connections are allocated CONNECTION_SLAB at a time, each
+ * in whole cache lines. What every event looks at comes first, what only a
+ * request in progress needs after it.
  */
 struct connection {
     int connfd;
-    int keepAlive;
-    time_t startTime;
+    /* Tells this connection from an earlier one with the same fd. */
+    unsigned generation;
+    /* What the client has sent across reads. inputStart is where the next
+     * unhandled request begins.
+     */
+    char *input;
+    unsigned inputStart;
+    unsigned inputLength;
+    unsigned inputCapacity;
+    enum timeoutKind timeout : 8;
+    /* Where in the body of the request we are while it is streamed. */
+    enum bodyState bodyState : 8;
+    enum methodKind method : 8;
+    unsigned keepAlive : 1;
+    /* Set if the body goes into the response, and if that response is sent
+     * with chunked encoding.
+     */
+    unsigned echoBody : 1;
+    unsigned chunkedResponse : 1;
+    /* Set once a write has failed. */
+    unsigned writeError : 1;
+    /* Set once the connection should close as soon as its output is sent. */
+    unsigned closing : 1;
+    /* Set while the connection holds one of the worker's in-flight slots,
+     * and while it waits in the pending queue for one.
+     */
+    unsigned inFlight : 1;
+    unsigned parked : 1;
+    /* With io_uring the output is only queued and sent by the engine. */
+    unsigned queueOutput : 1;
+    /* The operations the kernel has in progress for the connection with
+     * io_uring.
+     */
+    unsigned receiving : 1;
+    unsigned polling : 1;
+    unsigned sendBlocked : 1;
+    /* Set once the kernel has been asked to stop receiving, so the connection
+     * can be handed over to the server that takes over from us.
+     */
+    unsigned cancelling : 1;
+    /* The status of the response, for the log and the counters. */
+    short status;
+    /* The sends the kernel has in progress with io_uring. */
+    int sending;
+    /* What has not been written yet. */
+    struct outputBuffer *outputHead;
+    struct outputBuffer *outputTail;
+    size_t outputQueued;
+    struct timer timer;
+    /* Holds the request and everything else it needs until it is handled. */
+    struct arena arena;
+    struct httpRequest *request;
+    size_t bodyRemaining;
+    size_t bodyReceived;
+    long requestStart;
+    struct workerStats *stats;
+    /* The connection behind this one in the pending queue. */
+    struct connection *nextPending;
+    struct sockaddr_in client;
+    /* Where the connection is counted against the limits of its client
+     * address, if it is.
+     */
+    struct clientEntry *clientEntry;
+#ifdef PHASE_TRACING
+    /* The ring of the worker the phases are timed into, and the phase the
+     * request is in since phaseStart.
+     */
+    struct phaseRing *phases;
+    long phaseStart;
+    long phaseRequestStart;
+    enum phase phase;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A struct containing all open connections and their timers. The slots are
+ * indexed by file descriptor and grow on demand. stats are the counters of
+ * the worker the table belongs to. inFlight is the number of connections
+ * with a request in progress and the pending queue holds the connections
+ * whose request waits for one of them to finish. generations numbers the
+ * connections as they are added. Connections that are gone are kept in
+ * spare, linked by nextPending, for the next ones, and pool lends the
+ * connections their buffers. phases is where the worker times its phases.
+ */
+/* A struct containing the connections a worker is done with and has shut down
+ * for writing, which are kept open for a moment before they are closed. They
+ * are closed in the order they were shut down, since they all wait as long,
+ * so the queue is a ring with the oldest at head.
+ */
+struct lingerQueue {
+    int fds[LINGER_SLOTS];
+    unsigned long expires[LINGER_SLOTS];
+    int head;
+    int count;
 };
 
-/* A method that gets the first string from the request from
- * the client, which is the method of the request (i.e. GET, POST, HEAD, etc.)
+struct connectionTable {
+    struct connection **slots;
+    int capacity;
+    int count;
+    unsigned generations;
+    struct connection *spare;
+    struct bufferPool pool;
+    struct timerWheel timers;
+    struct workerStats *stats;
+    int inFlight;
+    int pendingCount;
+    struct connection *pendingHead;
+    struct connection *pendingTail;
+    struct lingerQueue lingering;
+#ifdef PHASE_TRACING
+    struct phaseRing *phases;
+#endif
+};
+
+/* A struct containing what is known of a client address for the per-client
+ * limits. owner has the address in its high 32 bits, CLIENT_OCCUPIED and the
+ * number of open connections from it in the low 31, so an entry is claimed,
+ * taken over and has its connections counted with a single compare-and-swap
+ * each. An owner of 0 is an empty entry, which no address matches since its
+ * CLIENT_OCCUPIED bit is clear. full is the token bucket of the requests from the
+ * address, kept as the time in microseconds at which the bucket is full
+ * again: each request moves it on by the time one token takes to come back,
+ * and a request that would move it more than a whole bucket past now is over
+ * the limit.
  */
-void getRequestMethod(char message[], char requestMethod[]) {
-    gchar** splitMessage = g_strsplit(message, " ", MAX_TOKENS);
-    if(splitMessage[0] != NULL) {
-        strcpy(requestMethod, (char*)splitMessage[0]);
-    }
-    else {
-        requestMethod = NULL;
+struct clientEntry {
+    _Atomic uint64_t owner;
+    _Atomic long full;
+};
+
+/* A struct containing one shard of the client table. An address is looked
+ * for in the CLIENT_PROBES entries from where it hashes to within its shard,
+ * which are a few cache lines next to each other. lock is only taken to give
+ * an address an entry.
+ */
+struct clientShard {
+    pthread_mutex_t lock;
+    struct clientEntry entries[CLIENT_SHARD_SLOTS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A struct containing the client addresses all workers count their limits
+ * in, as a client may connect to any of them. It is open addressed and the
+ * entries are updated with atomics, so only giving a new address an entry
+ * takes the lock of its shard. Entries are never emptied: one whose address
+ * has no connections and a full bucket is stale and is taken over by the next
+ * address that needs a place, so evicting costs nothing until then. interval is the time in microseconds a token
+ * takes to come back and burst the time a whole bucket does. The hash is
+ * seeded so clients can not pick addresses that collide.
+ */
+struct clientTable {
+    uint32_t seed;
+    long interval;
+    long burst;
+    int maxConnections;
+    struct clientShard shards[CLIENT_SHARDS];
+};
+
+/* A struct containing the settings given on the command line, shared read-only
+ * by all workers. The connection, in-flight and pending limits are per worker,
+ * and 0 means no limit. So is the size of the cache of compressed files, and
+ * a compression level of 0 means responses are never compressed. deferAccept
+ * and fastOpen are 0 when the listening sockets are made without them. handoff is
+ * NULL unless the server was given a socket to hand itself over on, and tracePath
+ * NULL unless the requests are captured to a trace, whose times count from traceStart.
+ * clients is NULL unless there is a limit on the requests or the connections
+ * of each client address, in which case clientRate is the requests per second
+ * and maxClientConnections the connections one may have, 0 meaning no limit.
+ */
+struct settings {
+    char *port;
+    int numberOfWorkers;
+    long maxBodySize;
+    int logToStdout;
+    long maxLogSize;
+    char *docRoot;
+    int docRootfd;
+    int backlog;
+    int deferAccept;
+    int fastOpen;
+    int maxConnections;
+    int maxInFlight;
+    int maxPending;
+    const char *engine;
+    int compressionLevel;
+    long minCompressSize;
+    long compressCacheSize;
+    struct worker *workers;
+    struct handoff *handoff;
+    char *tracePath;
+    long traceStart;
+    int clientRate;
+    int maxClientConnections;
+    struct clientTable *clients;
+    time_t started;
+    struct pageTemplate getPage;
+    struct pageTemplate postPage;
+};
+
+/* A struct containing the access log lines of one worker that have not been
+ * written yet. It is a ring with a single producer (the worker) and a single
+ * consumer (the log writer), so the two only share the head and tail positions,
+ * which are kept on separate cache lines. Both positions only ever grow and
+ * are masked with LOG_RING_SIZE - 1 to index the data. Lines that do not fit
+ * are dropped and counted instead of blocking the worker.
+ */
+struct logRing {
+    _Atomic size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic unsigned long dropped;
+    char data[LOG_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* A struct containing the log writer: one ring per worker, the batch the
+ * rings are collected into, the log file and how large it has grown, and the
+ * number of dropped lines already reported.
+ * The same writer writes the trace of the requests when tracing is set; a
+ * trace file starts out empty and reports dropped records with a record.
+ */
+struct logger {
+    struct logRing *rings;
+    int numberOfRings;
+    char *batch;
+    const char *path;
+    int tracing;
+    int fd;
+    long size;
+    int toStdout;
+    long maxSize;
+    unsigned long reportedDrops;
+    _Atomic int stopping;
+    pthread_t thread;
+};
+
+/* The kinds of messages a server sends to the one taking over from it. */
+enum handoffKind {
+    HANDOFF_LISTENERS = 1,
+    HANDOFF_CONNECTIONS
+};
+
+/* A struct containing the head of a message on the handoff socket. The file
+ * descriptors come along with it; total is the number of listening sockets
+ * in all the messages of that kind.
+ */
+struct handoffMessage {
+    int kind;
+    int total;
+};
+
+/* A struct containing a queue of file descriptors that one thread passes to
+ * another. count may be read without the lock, to see if there is anything.
+ */
+struct descriptorQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int *fds;
+    _Atomic int count;
+    int capacity;
+};
+
+/* A struct containing what a server needs to take over from the one before it
+ * and to hand over to the one after it, over a Unix socket at path: listenfd
+ * is where the next server connects and peerfd is the server being taken
+ * over from, or -1. Once draining is set the workers stop accepting, put
+ * their idle keep-alive connections in the idle queue and stop when they have
+ * no connections left; workersLeft, protected by the lock of the queue,
+ * counts the ones still running.
+ */
+struct handoff {
+    const char *path;
+    int listenfd;
+    int peerfd;
+    _Atomic int draining;
+    struct descriptorQueue idle;
+    int workersLeft;
+    pthread_t thread;
+};
+
+/* A struct containing a file in the document root that a worker has looked
+ * up, with the file open and the head of a response to it already made, so
+ * a request for a hot file needs neither open() nor stat(). checked is the
+ * second the file was last compared to the disk; it is compared again in a
+ * later second, and loaded again if it has been changed or replaced. Entries
+ * are in a hash table and on a list from the most to the least recently used.
+ * A file that is worth compressing keeps its compressed contents once a
+ * client has asked for them, as raw deflate blocks with the checksums of both
+ * gzip and zlib, so either encoding is sent from the same copy.
+ */
+struct fileEntry {
+    struct fileEntry *hashNext;
+    struct fileEntry *newer;
+    struct fileEntry *older;
+    unsigned long hash;
+    int fd;
+    off_t size;
+    ino_t inode;
+    struct timespec mtime;
+    time_t checked;
+    size_t headLength;
+    size_t dateOffset;
+    char head[FILE_HEAD_LENGTH];
+    int compressible;
+    char *deflated;
+    size_t deflatedLength;
+    unsigned long crc;
+    unsigned long adler;
+    size_t pathLength;
+    char path[];
+};
+
+/* A struct containing a path that was looked up in the document root and not
+ * found, in the second it was looked up in.
+ */
+struct fileMiss {
+    unsigned long hash;
+    size_t pathLength;
+    time_t checked;
+};
+
+/* A struct containing the open-file cache of a worker. Each worker has its
+ * own, so it needs no locks. When it holds FILE_CACHE_ENTRIES files the least
+ * recently used one is closed, and when the compressed contents it keeps add up
+ * to more than the cache size those of the least recently used files are freed.
+ * Paths that are not found are only remembered in misses, one per slot of their
+ * hash and for the second they were looked up in, so requests for the color
+ * page do not look for a file every time but made up paths can not push the
+ * files out of the cache.
+ */
+struct fileCache {
+    struct fileEntry *buckets[FILE_CACHE_BUCKETS];
+    struct fileEntry *newest;
+    struct fileEntry *oldest;
+    int count;
+    size_t deflatedSize;
+    struct fileMiss misses[FILE_MISS_SLOTS];
+};
+
+struct worker;
+
+/* A struct containing the functions of an event engine, which waits for the
+ * sockets of a worker and drives its connections. start sets the engine up in
+ * the worker's thread and fails if the kernel can not run it, wait blocks for
+ * at most timeout milliseconds and returns the number of events, dispatch
+ * handles them, watch starts on a new connection and resume goes on with one
+ * that had to wait, i.e. for an in-flight slot. When the server hands itself
+ * over, stopAccepting stops taking connections from the listening socket and
+ * release lets go of an idle connection, which fails until the engine has
+ * nothing in progress for it.
+ */
+struct eventEngine {
+    const char *name;
+    int (*start)(struct worker *worker);
+    int (*wait)(struct worker *worker, int timeout);
+    void (*dispatch)(struct worker *worker, int count);
+    int (*watch)(struct worker *worker, struct connection *conn);
+    void (*resume)(struct worker *worker, struct connection *conn);
+    void (*stopAccepting)(struct worker *worker);
+    int (*release)(struct worker *worker, struct connection *conn);
+};
+
+/* What an io_uring completion is for, kept in the low bits of its user data. */
+enum uringKind {
+    URING_ACCEPT = 1,
+    URING_RECEIVE,
+    URING_SEND,
+    URING_POLL,
+    URING_CANCEL
+};
+
+/* A struct containing an io_uring instance of a worker: the submission and
+ * completion rings the kernel shares with us, how far we have filled the
+ * submission ring (sqTail) and handed it to the kernel (submitted), and the
+ * ring of buffers the kernel picks from for each receive. Only the worker
+ * thread touches it.
+ */
+struct uring {
+    int fd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTailShared;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqTail;
+    unsigned submitted;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buffers;
+    unsigned short bufferTail;
+    char *bufferData;
+};
+
+/* A struct containing everything a worker thread owns: its listening socket,
+ * its event engine, its connections, its open-file cache, its log ring and
+ * its counters for /stats. The struct is aligned to a cache line so workers
+ * never share one.
+ */
+struct worker {
+    int id;
+    pthread_t thread;
+    int sockfd;
+    /* The engine and the epoll instance or io_uring it waits on. */
+    const struct eventEngine *engine;
+    int epfd;
+    struct epoll_event events[MAX_EVENTS];
+    struct uring ring;
+    struct logRing *log;
+    /* NULL unless the requests are traced. */
+    struct logRing *trace;
+    struct settings *settings;
+    struct connectionTable connections;
+    struct fileCache files;
+    int sparefd;
+    /* Compresses the parts of pages that come from requests. */
+    z_stream deflater;
+    int deflaterReady;
+    struct workerStats stats __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* The current time in seconds and in timer ticks. */
+    time_t now;
+    unsigned long nowTick;
+    /* The date, formatted once per second, and the head that every response
+     * starts with.
+     */
+    time_t dateSecond;
+    char date[DATE_LENGTH + 1];
+    char headTemplate[HEAD_TEMPLATE_LENGTH];
+    size_t headTemplateLength;
+    size_t dateOffset;
+    /* The connections the server before us handed over, to be taken on. */
+    struct descriptorQueue adopted;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A method that finds the size class of a buffer of the given size.
+ * Returns the class, or -1 if the buffer is too large to be pooled.
+ */
+int poolClass(size_t size) {
+    int class = 0;
+    while(class < POOL_CLASSES && ((size_t) POOL_MIN_BUFFER << class) < size) {
+        class++;
     }
+    return class < POOL_CLASSES ? class : -1;
+}
 
-    g_strfreev(splitMessage);
+/* A method that rounds the size of a buffer up to its size class, so the
+ * whole of what the pool lends can be used.
+ */
+size_t poolSize(size_t size) {
+    int class = poolClass(size);
+    return class == -1 ? size : (size_t) POOL_MIN_BUFFER << class;
 }
 
-/* A method that gets the second string from the request from
- * the client, which is the requested URL (i.e. "/color")
+/* A method that borrows a buffer of at least the given size from a pool, one
+ * that was given back if there is one. The memory is not cleared.
+ * Returns NULL if we are out of memory.
  */
-void getRequestURL(char message[], char requestURL[]) {
-    gchar** splitMessage = g_strsplit(message, " ", MAX_TOKENS);
-    if(splitMessage[1] != NULL) {
-        strcat(requestURL, splitMessage[1]);
+void *poolAlloc(struct bufferPool *pool, size_t size) {
+    int class = poolClass(size);
+    if(class == -1) {
+        return malloc(size);
     }
-    else {
-        requestURL = NULL;
+    struct pooledBuffer *buffer = pool->free[class];
+    if(buffer == NULL) {
+        return malloc((size_t) POOL_MIN_BUFFER << class);
     }
-
-    g_strfreev(splitMessage);
+    pool->free[class] = buffer->next;
+    pool->freeBytes -= (size_t) POOL_MIN_BUFFER << class;
+    return buffer;
 }
 
-/* A method that is only called when the requested URL from the client
- * includes "?", which marks the beginning of a query (i.e. "?bg=red"). 
- * This method gets the query string that comes after the question mark.
+/* A method that gives a buffer of the given size back to a pool. It is kept
+ * for the next one who asks, unless the pool already keeps as much as it may.
  */
-void getQuery(char requestURL[], char query[]) { 
-    gchar** splitMessage = g_strsplit(requestURL, "?", MAX_TOKENS);
-    if(splitMessage[1] != NULL) {
-        strcpy(query, splitMessage[1]);
+void poolFree(struct bufferPool *pool, void *memory, size_t size) {
+    int class = poolClass(size);
+    if(class == -1 || pool->freeBytes + ((size_t) POOL_MIN_BUFFER << class) > POOL_MAX_FREE) {
+        free(memory);
+        return;
     }
-    else {
-        query = NULL;
+    if(memory != NULL) {
+        struct pooledBuffer *buffer = memory;
+        buffer->next = pool->free[class];
+        pool->free[class] = buffer;
+        pool->freeBytes += (size_t) POOL_MIN_BUFFER << class;
     }
-
-    g_strfreev(splitMessage);
 }
 
-/* A method that is only called when the requested URL includes a query.
- * This method gets the query parameters and puts it in an array containing all parameters
- * such that values at even positions in the array are values located left of the equation
- * mark in the query and values at odd positions in the array are values located right of the 
- * equation mark in the query.
- * Example: If query is "?bg=red&ex=ample" then "bg" is at position 0 in the array,
- * "red" is at position 1, "ex" at position 2 and so on.
+/* A method that allocates memory from an arena. The memory is not cleared.
+ * Allocations that do not fit in the current block get a new block, which is
+ * a buffer of at least ARENA_BLOCK_SIZE from the pool.
+ * Returns NULL if we are out of memory.
  */
-void getParam(char query[], char allQueries[MAX_NUMBER_OF_QUERIES][MAX_QUERY_LENGTH]) {
-    gchar** splitMessage = g_strsplit(query, "&", MAX_TOKENS);
-    int i = 0, j = 0;
-    while(splitMessage[i] != NULL) {
-        gchar** splitQuery = g_strsplit(splitMessage[i], "=", MAX_TOKENS);
-        strcpy(allQueries[j], splitQuery[0]);
-        //If we have a weird query with no equal sign
-        //we don't try to access the value to the right of it.
-        if(splitQuery[1] != NULL) {
-            strcpy(allQueries[j+1], splitQuery[1]);
+void *arenaAlloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+    struct arenaBlock *block = arena->blocks;
+    if(block == NULL || block->capacity - block->used < size) {
+        size_t total = sizeof(struct arenaBlock) + size;
+        total = poolSize(total > ARENA_BLOCK_SIZE ? total : ARENA_BLOCK_SIZE);
+        block = poolAlloc(arena->pool, total);
+        if(block == NULL) {
+            return NULL;
         }
-        i += 1;
-        j += 2; 
-        g_strfreev(splitQuery);
+        block->capacity = total - sizeof(struct arenaBlock);
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
     }
-    g_strfreev(splitMessage);
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
 }
 
-
-/* A method that is only called when the requested method from the client
- * is a POST method. This method gets the string content that the user
- * is posting to us which will be shown in the body of the requested site. 
+/* A method that frees everything allocated from an arena at once. The first
+ * block is kept for the next request, the larger ones a big request needed
+ * are given back.
  */
-void getContent(char message[], char content[]) {
-    gchar** splitMessage = g_strsplit(message, "\r\n\r\n", MAX_TOKENS); 
-    if(splitMessage[1] != NULL) {
-        strcat(content, splitMessage[1]);
+void resetArena(struct arena *arena) {
+    struct arenaBlock *block = arena->blocks;
+    while(block != NULL && block->next != NULL) {
+        struct arenaBlock *next = block->next;
+        poolFree(arena->pool, block, sizeof(struct arenaBlock) + block->capacity);
+        block = next;
     }
-    else {
-        content = NULL;
+    if(block != NULL) {
+        block->used = 0;
     }
+    arena->blocks = block;
+}
 
-    g_strfreev(splitMessage);
+/* A method that gives all memory of an arena back to its pool. */
+void freeArena(struct arena *arena) {
+    resetArena(arena);
+    if(arena->blocks != NULL) {
+        poolFree(arena->pool, arena->blocks, sizeof(struct arenaBlock) + arena->blocks->capacity);
+        arena->blocks = NULL;
+    }
 }
 
-/* A method that gets the header of a client request, i.e. everything before
- * the double line break in the request that seperates the header lines
- * and the actual content.
+/* A method that adds to one of the counters of a worker. Only the worker
+ * itself writes its counters, so a load and a store are enough.
  */
-void getHead(char message[], char head[]) {	
-    gchar** splitMessage = g_strsplit(message, "\r\n\r\n", MAX_TOKENS); 
-    if(splitMessage[0] != NULL) {
-        strcat(head, splitMessage[0]);
-    }
-    else {
-        head = NULL;
+void addStat(_Atomic unsigned long *stat, unsigned long amount) {
+    atomic_store_explicit(stat, atomic_load_explicit(stat, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+/* A method that reads one of the counters of a worker, from any thread. */
+unsigned long readStat(_Atomic unsigned long *stat) {
+    return atomic_load_explicit(stat, memory_order_relaxed);
+}
+
+/* The statuses we send, in the order they are counted in. */
+static const int statusCodes[STATUS_KINDS - 1] = { 200, 400, 404, 408, 413, 429, 431, 500, 501, 503 };
+
+/* A method that counts a response with the given status. */
+void countResponse(struct workerStats *stats, int status) {
+    int i;
+    for(i = 0; i < STATUS_KINDS - 1; i++) {
+        if(statusCodes[i] == status) {
+            break;
+        }
     }
-    
-    g_strfreev(splitMessage);
+    addStat(&stats->responses[i], 1);
+}
+
+/* A method that returns the monotonic time in microseconds. */
+long monotonicMicroseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-/* A method that gets the cookie from the header in the client request,
- * given that one exists.
+/* A method that counts how long the request of a connection took, from its
+ * first byte until its response has been handed on.
  */
-void getCookie(char message[], char cookie[]) {
-    gchar** splitMessage = g_strsplit(message, "Cookie: ", MAX_TOKENS);
-    
-    if(splitMessage[1] != NULL) {
-        strcat(cookie, splitMessage[1]);
+void countLatency(struct connection *conn) {
+    long microseconds = monotonicMicroseconds() - conn->requestStart;
+    if(microseconds < 0) {
+        microseconds = 0;
     }
-    else {
-       cookie = NULL; 
+    int bucket = microseconds == 0 ? 0 : 64 - __builtin_clzl((unsigned long) microseconds);
+    if(bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
     }
-    g_strfreev(splitMessage);
+    addStat(&conn->stats->latency[conn->method][bucket], 1);
+    addStat(&conn->stats->latencySum[conn->method], (unsigned long) microseconds);
+}
+
+#ifdef PHASE_TRACING
+/* The names of the phases in the trace. */
+static const char *phaseNames[PHASE_KINDS] = { "none", "read", "parse", "queue", "handle", "body", "write", "request", "wait", "work" };
+
+/* A method that returns the monotonic time in nanoseconds. */
+long monotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-/* A method that gets the type of the connection we are dealing with,
- * i.e. "HTTP/1.1" or "HTTP/1.0" etc.
+/* A method that adds a phase that has ended to the ring of a worker, over the
+ * oldest one once the ring is full.
  */
-void typeOfConnection(char message[], char type[]) {
-    gchar** splitMessage = g_strsplit_set(message, " \n", MAX_TOKENS);
-    if(splitMessage[2] != NULL) {
-        strcpy(type, splitMessage[2]);
+void recordPhase(struct phaseRing *ring, struct phaseSpan *span) {
+    unsigned long next = atomic_load_explicit(&ring->next, memory_order_relaxed);
+    ring->spans[next % PHASE_RING_SIZE] = *span;
+    atomic_store_explicit(&ring->next, next + 1, memory_order_release);
+}
+
+/* A method that ends the phase the request on a connection is in and starts
+ * the next one. The first phase of a request starts it and PHASE_NONE ends it,
+ * which records the whole request as well.
+ */
+void markPhase(struct connection *conn, enum phase next) {
+    if(conn->phase == next) {
+        return;
+    }
+    long time = monotonicNanoseconds();
+    if(conn->phase == PHASE_NONE) {
+        conn->phaseRequestStart = time;
     }
     else {
-        type = NULL;
+        struct phaseSpan span = { conn->phaseStart, time, conn->generation, (unsigned char) conn->phase, 0, 0 };
+        recordPhase(conn->phases, &span);
+        if(next == PHASE_NONE) {
+            struct phaseSpan request = { conn->phaseRequestStart, time, conn->generation, PHASE_REQUEST, (unsigned char) conn->method, conn->status };
+            recordPhase(conn->phases, &request);
+        }
     }
+    conn->phase = next;
+    conn->phaseStart = time;
 }
 
-/* Method that tells if a client requested a persistence connection or not.
- * If the request contains HTTP/1.1 the requested connection is persistence but
- * if that does not apply than we have to search for a "Connection: keep-alive"
- * message in the header from the client.
+/* A method that ends the phase the event loop of a worker is in and starts
+ * the next one.
  */
-int getPersistence(char message[]) {
-    char head[HEAD_LENGTH];
-    char type[MESSAGE_LENGTH];
-    memset(head, 0, HEAD_LENGTH);
-    memset(type, 0, MESSAGE_LENGTH);
-    typeOfConnection(message, type);
+void markLoop(struct phaseRing *ring, enum phase next) {
+    long time = monotonicNanoseconds();
+    if(ring->loopPhase != PHASE_NONE) {
+        struct phaseSpan span = { ring->loopStart, time, 0, (unsigned char) ring->loopPhase, 0, 0 };
+        recordPhase(ring, &span);
+    }
+    ring->loopPhase = next;
+    ring->loopStart = time;
+}
 
-    if((type != NULL) && (strcmp(type, "HTTP/1.1\r") == 0)) {
-        return 1;
+/* A method that writes the phases in the rings of all workers as Chrome trace
+ * events, which chrome://tracing and Perfetto open. Each worker is a process,
+ * with its event loop as thread 0 and each connection as the thread numbered
+ * by its generation. The workers go on while their rings are copied, so the
+ * spans they wrote over in the meantime, and the one they may have been
+ * writing, are left out.
+ * Returns 0 on success and -1 if there was no memory or writing failed.
+ */
+int writePhases(FILE *out, struct settings *settings) {
+    static const char *methods[METHOD_KINDS] = { "GET", "POST", "HEAD", "other" };
+    struct phaseSpan *copy = malloc(sizeof(struct phaseSpan) * PHASE_RING_SIZE);
+    if(copy == NULL) {
+        return -1;
     }
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    int i;
+    for(i = 0; i < settings->numberOfWorkers; i++) {
+        struct phaseRing *ring = settings->workers[i].connections.phases;
+        unsigned long end = atomic_load_explicit(&ring->next, memory_order_acquire);
+        memcpy(copy, ring->spans, sizeof(struct phaseSpan) * PHASE_RING_SIZE);
+        atomic_thread_fence(memory_order_acquire);
+        unsigned long written = atomic_load_explicit(&ring->next, memory_order_relaxed) + 1;
+        unsigned long first = written > PHASE_RING_SIZE ? written - PHASE_RING_SIZE : 0;
 
-    gchar** splitMessage;
-    gchar** tmpSplitMessage;
-    getHead(message, head);
-    tmpSplitMessage = g_strsplit(message, "Connection: ", MAX_TOKENS);
-    
-    if(tmpSplitMessage[1] != NULL) {
-        splitMessage = g_strsplit(tmpSplitMessage[1], "\n", MAX_TOKENS);
-        if(splitMessage[0] != NULL) {
-            if((strcmp(splitMessage[0], "keep-alive\r") == 0) ||(strcmp(splitMessage[0], "Keep-Alive\r") == 0)) { 
-                return 1;
+        fprintf(out, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"worker %d\"}}", i == 0 ? "" : ",", i, i);
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"event loop\"}}", i);
+        unsigned long j;
+        for(j = first; j < end; j++) {
+            struct phaseSpan *span = &copy[j % PHASE_RING_SIZE];
+            long duration = span->end - span->start;
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%ld.%03ld,\"dur\":%ld.%03ld",
+                    phaseNames[span->phase], span->track == 0 ? "loop" : "request", i, span->track,
+                    span->start / 1000, span->start % 1000, duration / 1000, duration % 1000);
+            if(span->phase == PHASE_REQUEST) {
+                fprintf(out, ",\"args\":{\"method\":\"%s\",\"status\":%d}", methods[span->method], span->status);
             }
+            fputs("}", out);
         }
     }
-
-    return 0;
+    fputs("\n]}\n", out);
+    free(copy);
+    return ferror(out) ? -1 : 0;
 }
 
-/* A method that creates the header that we will send in our server response to the client.
- * It includes the basic header fields Date, Server and Content-Type.
+/* A method that writes the phases to PHASES_FILE, which the server does when
+ * it gets SIGUSR2.
  */
-void handleHEAD(char head[], int sizeOfBody) {
-    time_t now;
-    time(&now);
-    char buf[sizeof "2011-10-08T07:07:09Z"];
-    strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
-    memset(head, 0, HEAD_LENGTH);
-    strcpy(head, "HTTP/1.1 200 OK\r\n");
-    strcat(head, "Date: ");
-    strcat(head, buf);
-    strcat(head, "\r\n");
-    strcat(head, "Server: jordanthor\r\n");
-    strcat(head, "Content-Type: text/html\r\n");
-    strcat(head, "Content-Length: ");
-    char s_sizeOfBody[512];
-    sprintf(s_sizeOfBody, "%d", sizeOfBody);
-    strcat(head, s_sizeOfBody);
-    strcat(head, "\r\n\r\n");
+void dumpPhases(struct settings *settings) {
+    FILE *out = fopen(PHASES_FILE, "w");
+    if(out == NULL) {
+        perror(PHASES_FILE);
+        return;
+    }
+    int result = writePhases(out, settings);
+    if(fclose(out) != 0 || result == -1) {
+        perror(PHASES_FILE);
+        return;
+    }
+    fprintf(stderr, "The phases of the last requests are in %s\n", PHASES_FILE);
 }
+#endif
 
-/* A method that creates the header that we will send in our server response to the client.
- * It differs from the one above as it includes information on setting a cookie
- * and is only called when we want to set a cookie for the client.
+/* A method that starts an empty text buffer in an arena with room for
+ * capacity bytes. The buffer grows when that turns out to be too little.
  */
-void handleHEADWithCookie(char head[], char variable[], char value[], int sizeOfBody) {
-    time_t now;
-    time(&now);
-    char buf[sizeof "2011-10-08T07:07:09Z"];
-    strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
-    memset(head, 0, HEAD_LENGTH);
-    strcpy(head, "HTTP/1.1 200 OK\r\n");
-    strcat(head, "Date: ");
-    strcat(head, buf);
-    strcat(head, "\r\n");
-    strcat(head, "Server: jordanthor\r\n");
-    strcat(head, "Content-Type: text/html\r\n");
-    strcat(head, "Content-Length: ");
-    char s_sizeOfBody[512];
-    sprintf(s_sizeOfBody, "%d", sizeOfBody);
-    strcat(head, s_sizeOfBody);
-    strcat(head, "\r\nSet-Cookie: ");
-    strcat(head, variable);
-    strcat(head, "=");
-    strcat(head, value);
-    strcat(head, "\r\n\r\n");
+void initTextBuffer(struct textBuffer *buffer, struct arena *arena, size_t capacity) {
+    buffer->arena = arena;
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    buffer->data = arenaAlloc(arena, capacity);
+    buffer->failed = buffer->data == NULL;
 }
 
-
-/* A method that is called when we handle a GET request from a client.
- * It creates our server response as a HTML document to such a request
- * and includes the correctly structured header and content.
- * Parameters sent to this function are connfd (the connection file descriptor), 
- * requestURL (the client's requested URL), ip_address (the client's IP address), 
- * port (the client's port), head (the header lines sent in our server response),
- * variable (if there is a query, this is the value left of the equation mark, i.e. "bg"),
- * value (if there is a query, this is the value right of the equation mark, i.e. "red"),
- * cookie (the cookie received from the client, if it exists), 
- * allQueries (an array of all query parameters, described above in the getParam function).
- */
-void handleGET(int connfd, char requestURL[], char ip_address[], int port, char head[], char variable[], char value[], char cookie[], char allQueries[MAX_NUMBER_OF_QUERIES][MAX_QUERY_LENGTH]) {
-    int colorCookie = 0;
-    int i = 0;
-    char body[MAX_HTML_LENGTH], result[MAX_HTML_LENGTH];
-    memset(body, 0, MAX_HTML_LENGTH);
-    memset(result, 0, MAX_HTML_LENGTH);
-
-    /* Go through all the queries from the client and search for "bg". If
-     * that is found than we set the color to the body tag of the response.
-     */
-    while(strlen(allQueries[i]) != 0) {
-        if(strcmp(allQueries[i], "bg") == 0) {
-            strcpy(variable, allQueries[i]);
-            strcpy(value, allQueries[i+1]);
-            colorCookie = 1;
-            break;
-        }
-        i += 2;
-    }
-        
-    /* If we found a query that contains "bg" than we set the bg-color. 
-     */     
-    if((strchr(requestURL, '?') != NULL) && colorCookie == 1) {
-        strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body");
-        strcat(body, " style='background-color:");
-        strcat(body, value);
-        strcat(body, "'>\n");
-    }
-    /* If we did not find "bg" in the queries we search in cookies. If
-     * we find "bg" in the the cookies then we set the bg-color to the
-     * value there.
-     */    
-    else {
-        if(strlen(cookie) > 0) {
-            strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body");
-            gchar** splitCookie = g_strsplit(cookie, "=", MAX_TOKENS);
-
-            if((strcmp(splitCookie[0], "bg") == 0) && (splitCookie[1] != NULL)) {
-                gchar** cleanValue = g_strsplit_set(splitCookie[1], " \n\r", MAX_TOKENS);
-                strcat(body, " style='background-color:");
-                strcat(body, cleanValue[0]);
-                strcat(body, "'");
-            }
-            strcat(body, ">\n");
-        }
-        else {
-            strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n");
-        }
+/* A method that makes sure there is room for length more bytes in a text
+ * buffer. The text is moved to twice the memory when it is not. The old memory
+ * stays in the arena until the request is done.
+ * Returns 0 on success and -1 if we are out of memory.
+ */
+int reserveText(struct textBuffer *buffer, size_t length) {
+    if(buffer->failed) {
+        return -1;
     }
-    
-    strcat(body, "\t<p>\n\t\t");
-    strcat(body, requestURL);
-    strcat(body, "<br>\n\t\t");
-
-    /* Set the query parameters to the body of the html. */ 
-    if(cookie != NULL) {
-        int j = 0;
-        while(strlen(allQueries[j]) > 0) {
-            strcat(body, allQueries[j]);
-
-            if(strlen(allQueries[j+1]) > 0) {
-                strcat(body, "=");
-                strcat(body, allQueries[j+1]);
-            }
+    if(buffer->capacity - buffer->length >= length) {
+        return 0;
+    }
+    size_t capacity = buffer->capacity * 2;
+    while(capacity - buffer->length < length) {
+        capacity *= 2;
+    }
+    char *data = arenaAlloc(buffer->arena, capacity);
+    if(data == NULL) {
+        buffer->failed = 1;
+        return -1;
+    }
+    memcpy(data, buffer->data, buffer->length);
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
 
-            strcat(body, "<br>\n\t\t");
-            j += 2;
-        }
+/* A method that appends bytes to a text buffer. */
+void appendText(struct textBuffer *buffer, const char *data, size_t length) {
+    if(reserveText(buffer, length) == -1) {
+        return;
     }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
 
-    strcat(body, ip_address);
-    strcat(body, "<br>\n\t\t");
-    char s_port[PORT_LENGTH];
-    memset(s_port, 0, PORT_LENGTH);
-    snprintf(s_port, PORT_LENGTH, "%d", port);
-    strcat(body, s_port);
-    strcat(body, "<br>\n\t</p>\n");
-    strcat(body, "</body>\n</html>\n");
+/* A method that appends a string literal to a text buffer, with its length known at compile time. */
+#define appendLiteral(buffer, literal) appendText(buffer, literal, sizeof(literal) - 1)
 
-    int sizeOfBody = strlen(body);
- 
-    /* If we got a query that contained "bg" then we handle the head 
-     * with cookie. (That is add the cookie to the header response).
-     */
-    if((strchr(requestURL, '?') != NULL) && colorCookie == 1) {
-        handleHEADWithCookie(head, variable, value, sizeOfBody);
+/* A method that appends a view to a text buffer with the characters that mean
+ * something in HTML escaped, so what the client sent us can not end up as markup
+ * on the page. Room for the worst case is made first, so the view is only read once.
+ */
+void appendEscaped(struct textBuffer *buffer, struct stringView view) {
+    if(reserveText(buffer, view.length * 6) == -1) {
+        return;
     }
-    /* Else we handle the head normally. */
-    else {
-        handleHEAD(head, sizeOfBody);
+    char *out = buffer->data + buffer->length;
+    size_t i;
+    for(i = 0; i < view.length; i++) {
+        switch(view.start[i]) {
+            case '&':
+                memcpy(out, "&amp;", 5);
+                out += 5;
+                break;
+            case '<':
+                memcpy(out, "&lt;", 4);
+                out += 4;
+                break;
+            case '>':
+                memcpy(out, "&gt;", 4);
+                out += 4;
+                break;
+            case '"':
+                memcpy(out, "&quot;", 6);
+                out += 6;
+                break;
+            case '\'':
+                memcpy(out, "&#39;", 5);
+                out += 5;
+                break;
+            default:
+                *out++ = view.start[i];
+                break;
+        }
     }
+    buffer->length = (size_t) (out - buffer->data);
+}
 
-    strcpy(result, head);
-    strcat(result, body);
-    ssize_t n = strlen(result);
+/* A method that compares a view to a C string, case sensitive. */
+int viewEquals(struct stringView view, const char *string) {
+    size_t length = strlen(string);
+    return view.length == length && memcmp(view.start, string, length) == 0;
+}
 
-    write(connfd, result, (size_t) n);
+/* A method that compares a view to a C string, ignoring case. */
+int viewEqualsIgnoreCase(struct stringView view, const char *string) {
+    size_t length = strlen(string);
+    return view.length == length && strncasecmp(view.start, string, length) == 0;
 }
 
-/* A method that is called when we handle a POST request from a client.
- * It creates our server response as a HTML document to such a request
- * and includes the correctly structured header and content.
- * Parameters sent to this function are connfd (the connection file descriptor), 
- * requestURL (the client's requested URL), ip_address (the client's IP address), 
- * port (the client's port), content (the content posted by the client), 
- * head (the header lines sent in our server response),
- * variable (if there is a query, this is the value left of the equation mark, i.e. "bg"),
- * value (if there is a query, this is the value right of the equation mark, i.e. "red"),
- * cookie (the cookie received from the client, if it exists), 
- * allQueries (an array of all query parameters, described above in the getParam function).
- */
-void handlePOST(int connfd, char requestURL[], char ip_address[], int port, char content[], char head[], char variable[], char value[], char cookie[], char allQueries[MAX_NUMBER_OF_QUERIES][MAX_QUERY_LENGTH]) {
-    char body[MAX_HTML_LENGTH], result[MAX_HTML_LENGTH];
-    memset(body, 0, MAX_HTML_LENGTH);
-    memset(result, 0, MAX_HTML_LENGTH);
-
-    /* Go through all the queries from the client and search for "bg". If
-     * that is found than we set the color to the body tag of the response.
-     */
-    int colorCookie = 0;
-    int i = 0;
-    while(strlen(allQueries[i]) != 0) {
-        if(strcmp(allQueries[i], "bg") == 0) {
-            strcpy(variable, allQueries[i]);
-            strcpy(value, allQueries[i+1]);
-            colorCookie = 1;
-            break;
-        }
+/* A method that resets a request so the parser starts from the beginning. */
+void initRequest(struct httpRequest *request) {
+    memset(request, 0, sizeof(struct httpRequest));
+    request->state = PARSE_METHOD;
+}
 
-        i += 2;
-    }
-    
-    /* If we found a query that contains "bg" than we set the bg-color. 
-     */     
-    if((strchr(requestURL, '?') != NULL) && colorCookie == 1) {
-        strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body");
-        strcat(body, " style='background-color:");
-        strcat(body, value);
-        strcat(body, "'>\n");
+/* A method that finds a header by name, ignoring case as HTTP requires.
+ * Returns an empty view if the request does not contain the header.
+ */
+struct stringView findHeader(struct httpRequest *request, const char *name) {
+    struct stringView none = { NULL, 0 };
+    int i;
+    for(i = 0; i < request->numberOfHeaders; i++) {
+        if(viewEqualsIgnoreCase(request->headers[i].name, name)) {
+            return request->headers[i].value;
+        }
     }
-    /* If we did not find "bg" in the queries we search in cookies. If
-     * we find "bg" in the the cookies then we set the bg-color to the
-     * value there.
-     */    
-    else { 
-        if(strlen(cookie) > 0) {
-            strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body");
-            gchar** splitCookie = g_strsplit(cookie, "=", MAX_TOKENS);
+    return none;
+}
 
-            if((strcmp(splitCookie[0], "bg") == 0) && (splitCookie[1] != NULL)) {
-                gchar** cleanValue = g_strsplit_set(splitCookie[1], " \n\r", MAX_TOKENS);
-                strcat(body, " style='background-color:");
-                strcat(body, cleanValue[0]);
-                strcat(body, "'");
-            }
-            strcat(body, ">\n");
+/* A method that finds the value of a cookie by name in the Cookie header,
+ * where cookies are separated by ";" (i.e. "bg=red; x=y").
+ * Returns an empty view if there is no such cookie.
+ */
+struct stringView findCookie(struct httpRequest *request, const char *name) {
+    struct stringView none = { NULL, 0 };
+    struct stringView cookie = findHeader(request, "Cookie");
+    char *p = cookie.start;
+    char *end = cookie.start + cookie.length;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == ';')) {
+            p++;
         }
-        else {
-            strcat(body, "<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n");
+        char *nameStart = p;
+        while(p < end && *p != '=' && *p != ';') {
+            p++;
+        }
+        struct stringView cookieName = { nameStart, (size_t) (p - nameStart) };
+        if(p < end && *p == '=') {
+            p++;
+        }
+        char *valueStart = p;
+        while(p < end && *p != ';' && *p != ' ') {
+            p++;
+        }
+        if(viewEquals(cookieName, name)) {
+            struct stringView value = { valueStart, (size_t) (p - valueStart) };
+            return value;
+        }
+        while(p < end && *p != ';') {
+            p++;
         }
     }
+    return none;
+}
 
-    strcat(body, "\t<p>\n\t\t");
-    strcat(body, requestURL);
-    strcat(body, "<br>\n\t\t");
-
-    /* Set the query parameters to the body of the html. */ 
-    if(cookie != NULL) {
-        int j = 0;
-        while(strlen(allQueries[j]) != 0) {
-            strcat(body, allQueries[j]);
-            strcat(body, "=");
-            strcat(body, allQueries[j+1]);
-            strcat(body, "<br>\n\t\t");
-            j += 2;
+/* A method that finds the value of a query parameter by name.
+ * Returns NULL if the query does not contain the parameter.
+ */
+struct queryParameter *findQuery(struct httpRequest *request, const char *name) {
+    int i;
+    for(i = 0; i < request->numberOfQueries; i++) {
+        if(viewEquals(request->queries[i].variable, name)) {
+            return &request->queries[i];
         }
     }
+    return NULL;
+}
 
-    strcat(body, ip_address);
-    strcat(body, "<br>\n\t\t");
-    char s_port[PORT_LENGTH];
-    memset(s_port, 0, PORT_LENGTH);
-    snprintf(s_port, PORT_LENGTH, "%d", port);
-    strcat(body, s_port);
-    strcat(body, "<br>\n\t</p>\n\t<p>\n\t\t");
-    strcat(body, content);
-    strcat(body, "<br>\n\t</p>\n</body>\n</html>\n");
-
-    int sizeOfBody = strlen(body);
- 
-    /* If we got a query that contained "bg" then we handle the head 
-     * with cookie. (That is add the cookie to the header response).
-     */
-    if((strchr(requestURL, '?') != NULL) && colorCookie == 1) {
-        handleHEADWithCookie(head, variable, value, sizeOfBody);
+/* A method that closes the query parameter the parser is currently in, if any. */
+void endQueryParameter(struct httpRequest *request, char *buffer, size_t end) {
+    if(request->numberOfQueries >= MAX_NUMBER_OF_QUERIES) {
+        return;
+    }
+    struct queryParameter *parameter = &request->queries[request->numberOfQueries];
+    struct stringView *current = request->inQueryValue ? &parameter->value : &parameter->variable;
+    current->start = buffer + request->tokenStart;
+    current->length = end - request->tokenStart;
+    /* Skip empty parameters such as the one between "&&". */
+    if(parameter->variable.length > 0) {
+        request->numberOfQueries += 1;
     }
-    /* Else we handle the head normally. */
     else {
-        handleHEAD(head, sizeOfBody);
+        memset(parameter, 0, sizeof(struct queryParameter));
     }
-
-    strcpy(result, head);
-    strcat(result, body);
-    ssize_t n = strlen(result);
-
-    write(connfd, result, (size_t) n);
+    request->inQueryValue = 0;
 }
 
-/*
- *
+/* A method that decides if the connection should be kept alive after this
+ * request. HTTP/1.1 connections are persistent unless the client sends
+ * "Connection: close", older ones only if the client asks for keep-alive.
  */
-void handler(int connfd, struct sockaddr_in client, FILE *fp, char message[], char ip_address[]) {
-    char requestMethod[REQUEST_METHOD_LENGTH];
-    char requestURL[REQUEST_URL_LENGTH];
-    char content[CONTENT_LENGTH];
-    char head[HEAD_LENGTH];
-    char query[REQUEST_URL_LENGTH];
-    char variable[REQUEST_URL_LENGTH];
-    char value[REQUEST_URL_LENGTH];
-    char cookie[COOKIE_LENGTH];
-    char allQueries[MAX_NUMBER_OF_QUERIES][MAX_QUERY_LENGTH];
-    
-    memset(requestMethod, 0, REQUEST_METHOD_LENGTH);
-    memset(requestURL, 0, REQUEST_URL_LENGTH);
-    memset(content, 0, CONTENT_LENGTH);
-    memset(head, 0, HEAD_LENGTH);
-    memset(query, 0, REQUEST_URL_LENGTH);
-    memset(variable, 0, REQUEST_URL_LENGTH);
-    memset(value, 0, REQUEST_URL_LENGTH);
-    memset(cookie, 0, COOKIE_LENGTH);
-    memset(allQueries, 0, sizeof(char) * MAX_NUMBER_OF_QUERIES * MAX_QUERY_LENGTH);
-
-    strcpy(requestURL, "http://localhost/");
-    strcat(requestURL, ip_address);
-    time_t now;
-    time(&now);
-    char buf[sizeof "2011-10-08T07:07:09Z"];
-    strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
-    getRequestMethod(message, requestMethod);
-    getRequestURL(message, requestURL);
-    getCookie(message, cookie);
+int getPersistence(struct httpRequest *request) {
+    struct stringView connection = findHeader(request, "Connection");
+    if(viewEquals(request->version, "HTTP/1.1")) {
+        return !viewEqualsIgnoreCase(connection, "close");
+    }
+    return viewEqualsIgnoreCase(connection, "keep-alive");
+}
 
-    if(strchr(requestURL, '?') != NULL) {
-        getQuery(requestURL, query);
-        //getParam(query, variable, value);
-        getParam(query, allQueries);
+/* A method that finds the length of the body of a request from its
+ * Content-Length header. Returns 0 if there is no such header and -1 if the
+ * header is not a valid length.
+ */
+long getContentLength(struct httpRequest *request) {
+    struct stringView header = findHeader(request, "Content-Length");
+    long length = 0;
+    size_t i;
+    for(i = 0; i < header.length; i++) {
+        if(header.start[i] < '0' || header.start[i] > '9' || length > LONG_MAX / 10 - 1) {
+            return -1;
+        }
+        length = length * 10 + (header.start[i] - '0');
     }
+    return length;
+}
 
-    /* GET. */ 
-    if(strcmp(requestMethod, "GET") == 0) {
-        handleGET(connfd, requestURL, inet_ntoa(client.sin_addr), client.sin_port, head, variable, value, cookie, allQueries);
+/* A method that tells if the body of a request is sent with chunked encoding,
+ * which is the case if chunked is the last coding in Transfer-Encoding. The
+ * codings are separated by commas, with optional whitespace around them.
+ */
+int isChunked(struct httpRequest *request) {
+    struct stringView codings = findHeader(request, "Transfer-Encoding");
+    char *start = codings.start;
+    char *end = codings.start + codings.length;
+    char *comma = codings.length > 0 ? memrchr(start, ',', codings.length) : NULL;
+    if(comma != NULL) {
+        start = comma + 1;
     }
-    /* POST. */
-    else if(strcmp(requestMethod, "POST") == 0) {
-        getContent(message, content);
-        handlePOST(connfd, requestURL, inet_ntoa(client.sin_addr), client.sin_port, content, head, variable, value, cookie, allQueries);
+    while(start < end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while(end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    struct stringView last = { start, (size_t) (end - start) };
+    return viewEqualsIgnoreCase(last, "chunked");
+}
+
+/* The delimiters that end the run of bytes the parser is in, for each state
+ * where it is in such a run: the method, the target with its query, the
+ * version, a header name and a header value. What is between them is skipped
+ * with a scanning kernel rather than looked at a byte at a time.
+ */
+static struct delimiterSet parseDelimiters[PARSE_DONE + 1];
+
+/* The characters that mean something in HTML, which are escaped in a body
+ * that is echoed on a page.
+ */
+static struct delimiterSet markupDelimiters;
+
+/* A method that sets up the delimiters of the parser and picks the scanning
+ * kernel it uses. It is called once, before any threads are started.
+ */
+void initParser(void) {
+    initDelimiterSet(&parseDelimiters[PARSE_METHOD], " \r\n");
+    initDelimiterSet(&parseDelimiters[PARSE_TARGET], " ?&=\r\n");
+    initDelimiterSet(&parseDelimiters[PARSE_VERSION], "\r\n");
+    initDelimiterSet(&parseDelimiters[PARSE_HEADER_NAME], ":\r\n");
+    initDelimiterSet(&parseDelimiters[PARSE_HEADER_VALUE], "\r\n");
+    initDelimiterSet(&markupDelimiters, "&<>\"'");
+    initScanning();
+}
+
+/* A method that parses a request in a single pass over the buffer without
+ * allocating or copying anything. The request line gives the method, the target
+ * (split into path and query parameters) and the version; the header lines are
+ * split into names and values and everything after the empty line is the body.
+ * The framing of the body is taken from Transfer-Encoding and Content-Length.
+ * Returns PARSE_COMPLETE once the headers have been read, PARSE_INCOMPLETE if
+ * the buffer ends before that and PARSE_ERROR if the request is malformed.
+ */
+int parseRequest(struct httpRequest *request, char *buffer, size_t length) {
+    size_t i;
+    for(i = request->offset; i < length && request->state != PARSE_DONE; i++) {
+        /* Inside a run only its delimiters change anything, so skip to the next
+         * one. The first byte of the target is not skipped, it starts the target.
+         */
+        const struct delimiterSet *run = &parseDelimiters[request->state];
+        if(run->count > 0 && (request->state != PARSE_TARGET || request->target.start != NULL)) {
+            i += scanDelimiters(buffer + i, length - i, run);
+            if(i == length) {
+                break;
+            }
+        }
+        char c = buffer[i];
+        switch(request->state) {
+            case PARSE_METHOD:
+                if(c == ' ') {
+                    request->method.start = buffer + request->tokenStart;
+                    request->method.length = i - request->tokenStart;
+                    if(request->method.length == 0) {
+                        return PARSE_ERROR;
+                    }
+                    request->tokenStart = i + 1;
+                    request->state = PARSE_TARGET;
+                }
+                else if(c == '\r' || c == '\n') {
+                    return PARSE_ERROR;
+                }
+                break;
+            case PARSE_TARGET:
+                /* A target is never empty, so a space before it is malformed. */
+                if(c == ' ' && request->target.start == NULL) {
+                    return PARSE_ERROR;
+                }
+                if(c == ' ') {
+                    request->target.length = (size_t) (buffer + i - request->target.start);
+                    if(request->query.start != NULL) {
+                        request->query.length = (size_t) (buffer + i - request->query.start);
+                        endQueryParameter(request, buffer, i);
+                    }
+                    else {
+                        request->path.length = (size_t) (buffer + i - request->path.start);
+                    }
+                    request->tokenStart = i + 1;
+                    request->state = PARSE_VERSION;
+                }
+                else if(c == '\r' || c == '\n') {
+                    return PARSE_ERROR;
+                }
+                else {
+                    if(request->target.start == NULL) {
+                        request->target.start = buffer + i;
+                        request->path.start = buffer + i;
+                    }
+                    if(request->query.start == NULL) {
+                        /* The first "?" ends the path and starts the query. */
+                        if(c == '?') {
+                            request->path.length = (size_t) (buffer + i - request->path.start);
+                            request->query.start = buffer + i + 1;
+                            request->tokenStart = i + 1;
+                        }
+                    }
+                    else if(c == '&') {
+                        endQueryParameter(request, buffer, i);
+                        request->tokenStart = i + 1;
+                    }
+                    else if(c == '=' && !request->inQueryValue && request->numberOfQueries < MAX_NUMBER_OF_QUERIES) {
+                        struct queryParameter *parameter = &request->queries[request->numberOfQueries];
+                        parameter->variable.start = buffer + request->tokenStart;
+                        parameter->variable.length = i - request->tokenStart;
+                        request->inQueryValue = 1;
+                        request->tokenStart = i + 1;
+                    }
+                }
+                break;
+            case PARSE_VERSION:
+                if(c == '\r' || c == '\n') {
+                    request->version.start = buffer + request->tokenStart;
+                    request->version.length = i - request->tokenStart;
+                    request->state = c == '\r' ? PARSE_REQUEST_LINE_END : PARSE_HEADER_START;
+                }
+                break;
+            case PARSE_REQUEST_LINE_END:
+            case PARSE_HEADER_LINE_END:
+                if(c != '\n') {
+                    return PARSE_ERROR;
+                }
+                request->state = PARSE_HEADER_START;
+                break;
+            case PARSE_HEADER_START:
+                if(c == '\r') {
+                    request->state = PARSE_HEADERS_END;
+                }
+                else if(c == '\n') {
+                    request->state = PARSE_DONE;
+                }
+                else {
+                    request->tokenStart = i;
+                    request->state = PARSE_HEADER_NAME;
+                }
+                break;
+            case PARSE_HEADER_NAME:
+                if(c == ':') {
+                    request->headerName.start = buffer + request->tokenStart;
+                    request->headerName.length = i - request->tokenStart;
+                    request->state = PARSE_HEADER_VALUE_START;
+                }
+                else if(c == '\r' || c == '\n') {
+                    return PARSE_ERROR;
+                }
+                break;
+            case PARSE_HEADER_VALUE_START:
+                if(c == ' ' || c == '\t') {
+                    break;
+                }
+                request->tokenStart = i;
+                request->state = PARSE_HEADER_VALUE;
+                /* The first character may already end the line, so fall through. */
+                /* fall through */
+            case PARSE_HEADER_VALUE:
+                if(c == '\r' || c == '\n') {
+                    size_t end = i;
+                    while(end > request->tokenStart && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t')) {
+                        end--;
+                    }
+                    /* Headers beyond MAX_HEADERS are skipped, not rejected. */
+                    if(request->numberOfHeaders < MAX_HEADERS) {
+                        struct httpHeader *header = &request->headers[request->numberOfHeaders];
+                        header->name = request->headerName;
+                        header->value.start = buffer + request->tokenStart;
+                        header->value.length = end - request->tokenStart;
+                        request->numberOfHeaders += 1;
+                    }
+                    request->state = c == '\r' ? PARSE_HEADER_LINE_END : PARSE_HEADER_START;
+                }
+                break;
+            case PARSE_HEADERS_END:
+                if(c != '\n') {
+                    return PARSE_ERROR;
+                }
+                request->state = PARSE_DONE;
+                break;
+            case PARSE_DONE:
+                break;
+        }
+    }
+    request->offset = i;
+
+    if(request->state != PARSE_DONE) {
+        return PARSE_INCOMPLETE;
+    }
+    request->headerLength = i;
+    request->body.start = buffer + i;
+    request->body.length = length - i;
+    request->chunked = isChunked(request);
+    /* A body framed by Transfer-Encoding has to end in chunked and may not
+     * have a Content-Length too, or a proxy in front of us could read it one
+     * way and we the other (RFC 9112 6.3).
+     */
+    if(findHeader(request, "Transfer-Encoding").start != NULL
+       && (!request->chunked || findHeader(request, "Content-Length").start != NULL)) {
+        return PARSE_ERROR;
+    }
+    request->contentLength = request->chunked ? 0 : getContentLength(request);
+    if(request->contentLength < 0) {
+        return PARSE_ERROR;
+    }
+    request->keepAlive = getPersistence(request);
+    return PARSE_COMPLETE;
+}
+
+/* A method that frees a piece of the output queue, and closes its file if it has one. */
+void freeOutputBuffer(struct outputBuffer *buffer) {
+    if(buffer->fd != -1) {
+        close(buffer->fd);
+    }
+    free(buffer);
+}
+
+/* A method that writes as much of the output queue of a connection as the
+ * socket takes, with one writev() for up to IOV_BATCH queued pieces of data
+ * and with sendfile() for a piece of a file.
+ * Returns 0 once the queue is empty, 1 if the socket is full and -1 if the
+ * client went away.
+ */
+int flushOutput(struct connection *conn) {
+    while(conn->outputHead != NULL) {
+        struct outputBuffer *buffer = conn->outputHead;
+        ssize_t n;
+        if(buffer->fd != -1) {
+            off_t offset = (off_t) buffer->offset;
+            n = sendfile(conn->connfd, buffer->fd, &offset, buffer->length - buffer->offset);
+            /* The file got shorter than the Content-Length we sent, so the
+             * response can not be finished.
+             */
+            if(n == 0) {
+                conn->writeError = 1;
+                return -1;
+            }
+        }
+        else {
+            struct iovec iov[IOV_BATCH];
+            int count = 0;
+            for(; buffer != NULL && buffer->fd == -1 && count < IOV_BATCH; buffer = buffer->next) {
+                iov[count].iov_base = buffer->data + buffer->offset;
+                iov[count].iov_len = buffer->length - buffer->offset;
+                count++;
+            }
+            n = writev(conn->connfd, iov, count);
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            conn->writeError = 1;
+            return -1;
+        }
+        conn->outputQueued -= (size_t) n;
+        addStat(&conn->stats->bytesOut, (size_t) n);
+        /* Free every piece that has been written completely. */
+        while(n > 0) {
+            buffer = conn->outputHead;
+            size_t left = buffer->length - buffer->offset;
+            if((size_t) n < left) {
+                buffer->offset += (size_t) n;
+                break;
+            }
+            n -= (ssize_t) left;
+            conn->outputHead = buffer->next;
+            freeOutputBuffer(buffer);
+        }
+        if(conn->outputHead == NULL) {
+            conn->outputTail = NULL;
+        }
+    }
+    return 0;
+}
+
+/* A method that sends the given buffers to a client with a single writev().
+ * Whatever the socket does not take right away (or everything, if older output
+ * is still waiting) is copied to the end of the connection's output queue and
+ * written out by flushOutput when epoll reports the socket writable. So a slow
+ * client never blocks the event loop and a large response is never truncated.
+ * With io_uring everything is queued, and the engine sends the queue once the
+ * input at hand has been handled.
+ * Returns 0 on success and -1 if the client went away.
+ */
+int sendResponse(struct connection *conn, struct iovec *iov, int count) {
+    MARK_PHASE_AFTER(conn, PHASE_HANDLE, PHASE_WRITE);
+    if(conn->writeError) {
+        return -1;
+    }
+    if(conn->outputHead == NULL && !conn->queueOutput) {
+        ssize_t n;
+        do {
+            n = writev(conn->connfd, iov, count);
+        } while(n == -1 && errno == EINTR);
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn->writeError = 1;
+            return -1;
+        }
+        if(n > 0) {
+            addStat(&conn->stats->bytesOut, (size_t) n);
+        }
+        /* Skip past everything that was written. */
+        while(n > 0 && count > 0) {
+            if((size_t) n < iov->iov_len) {
+                iov->iov_base = (char *) iov->iov_base + n;
+                iov->iov_len -= (size_t) n;
+                break;
+            }
+            n -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+    }
+
+    size_t left = 0;
+    int i;
+    for(i = 0; i < count; i++) {
+        left += iov[i].iov_len;
+    }
+    if(left == 0) {
+        return 0;
+    }
+    struct outputBuffer *buffer = malloc(sizeof(struct outputBuffer) + left);
+    if(buffer == NULL) {
+        conn->writeError = 1;
+        return -1;
+    }
+    buffer->next = NULL;
+    buffer->owner = NULL;
+    buffer->inFlight = 0;
+    buffer->fd = -1;
+    buffer->length = left;
+    buffer->offset = 0;
+    size_t offset = 0;
+    for(i = 0; i < count; i++) {
+        memcpy(buffer->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    if(conn->outputTail != NULL) {
+        conn->outputTail->next = buffer;
+    }
+    else {
+        conn->outputHead = buffer;
+    }
+    conn->outputTail = buffer;
+    conn->outputQueued += left;
+    return 0;
+}
+
+/* A method that sends part of a file to a client with sendfile(), so the file
+ * is never copied into our memory. What the socket does not take right away
+ * is queued behind the rest of the output with its own copy of the fd, as the
+ * fd given may be closed before the queue has been written.
+ * Returns 0 on success and -1 if the client went away.
+ */
+int sendFile(struct connection *conn, int fd, size_t offset, size_t length) {
+    if(conn->writeError) {
+        return -1;
+    }
+    while(conn->outputHead == NULL && !conn->queueOutput && offset < length) {
+        off_t position = (off_t) offset;
+        ssize_t n = sendfile(conn->connfd, fd, &position, length - offset);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if(n <= 0) {
+            conn->writeError = 1;
+            return -1;
+        }
+        addStat(&conn->stats->bytesOut, (size_t) n);
+        offset += (size_t) n;
+    }
+    if(offset == length) {
+        return 0;
+    }
+
+    struct outputBuffer *buffer = malloc(sizeof(struct outputBuffer));
+    if(buffer == NULL) {
+        conn->writeError = 1;
+        return -1;
+    }
+    buffer->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(buffer->fd == -1) {
+        free(buffer);
+        conn->writeError = 1;
+        return -1;
+    }
+    buffer->next = NULL;
+    buffer->owner = NULL;
+    buffer->inFlight = 0;
+    buffer->length = length;
+    buffer->offset = offset;
+    if(conn->outputTail != NULL) {
+        conn->outputTail->next = buffer;
+    }
+    else {
+        conn->outputHead = buffer;
+    }
+    conn->outputTail = buffer;
+    conn->outputQueued += length - offset;
+    return 0;
+}
+
+/* A method that sends a piece of a chunked response, that is the length in
+ * hex, the data and a line break. An empty piece is the last chunk.
+ */
+int writeChunk(struct connection *conn, const char *data, size_t length) {
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", length);
+    struct iovec iov[3] = { { size, (size_t) n }, { (char *) data, length }, { "\r\n", 2 } };
+    return sendResponse(conn, iov, 3);
+}
+
+/* A method that writes a number in decimal to a buffer and returns how many
+ * characters it used. It is only ever given lengths, so it can skip the
+ * generality of printf.
+ */
+size_t formatNumber(char buffer[], unsigned long number) {
+    char digits[24];
+    size_t length = 0;
+    do {
+        digits[length++] = (char) ('0' + number % 10);
+        number /= 10;
+    } while(number > 0);
+    size_t i;
+    for(i = 0; i < length; i++) {
+        buffer[i] = digits[length - 1 - i];
+    }
+    return length;
+}
+
+/* A method that refreshes the cached time and date of a worker. It is called
+ * once per wakeup of the event loop, but the date is only formatted again when
+ * the second has changed, and then patched into the header template in place.
+ * Timers run on the monotonic clock, so they are not affected by clock changes.
+ */
+void updateTime(struct worker *worker) {
+    struct timespec monotonic;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    worker->nowTick = (unsigned long) monotonic.tv_sec * (1000 / TIMER_TICK) + (unsigned long) monotonic.tv_nsec / (TIMER_TICK * 1000000L);
+    time_t now = time(NULL);
+    worker->now = now;
+    if(now == worker->dateSecond) {
+        return;
+    }
+    worker->dateSecond = now;
+    struct tm tm;
+    strftime(worker->date, sizeof(worker->date), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+    memcpy(worker->headTemplate + worker->dateOffset, worker->date, DATE_LENGTH);
+}
+
+/* A method that prepares the header template of a worker, that is every
+ * header line that is the same for all our responses. The date is left blank
+ * here and filled in by updateTime.
+ */
+void initHeadTemplate(struct worker *worker) {
+    const char *start = "HTTP/1.1 200 OK\r\nDate: ";
+    const char *end = "\r\nServer: jordanthor\r\nContent-Type: text/html\r\n";
+    worker->dateOffset = strlen(start);
+    worker->headTemplateLength = (size_t) snprintf(worker->headTemplate, sizeof(worker->headTemplate), "%s%*s%s", start, DATE_LENGTH, "", end);
+    worker->dateSecond = 0;
+    updateTime(worker);
+}
+
+/* A method that creates the header that we will send in our server response to the client.
+ * It includes the basic header fields Date, Server and Content-Type, which are copied
+ * from the worker's header template, followed by the length of the body. When
+ * the length is not known up front the size is LENGTH_CHUNKED, and the body is
+ * sent in chunks, or LENGTH_UNTIL_CLOSE for a client too old for chunks, and
+ * the body ends when the connection is closed.
+ * Returns the length of the header.
+ */
+size_t handleHEAD(struct worker *worker, char head[], long sizeOfBody) {
+    size_t length = worker->headTemplateLength;
+    memcpy(head, worker->headTemplate, length);
+    if(sizeOfBody == LENGTH_UNTIL_CLOSE) {
+        memcpy(head + length, "Connection: close\r\n\r\n", 21);
+        return length + 21;
+    }
+    if(sizeOfBody < 0) {
+        memcpy(head + length, "Transfer-Encoding: chunked\r\n\r\n", 30);
+        return length + 30;
+    }
+    memcpy(head + length, "Content-Length: ", 16);
+    length += 16;
+    length += formatNumber(head + length, (unsigned long) sizeOfBody);
+    memcpy(head + length, "\r\n\r\n", 4);
+    return length + 4;
+}
+
+/* A method that creates the header that we will send in our server response to the client.
+ * It differs from the one above as it includes information on setting a cookie
+ * and is only called when we want to set a cookie for the client. A cookie that
+ * does not fit in MAX_COOKIE_LENGTH is not set.
+ */
+size_t handleHEADWithCookie(struct worker *worker, char head[], struct stringView variable, struct stringView value, long sizeOfBody) {
+    size_t length = handleHEAD(worker, head, sizeOfBody) - 2;
+    if(variable.length + value.length > MAX_COOKIE_LENGTH) {
+        return length + 2;
+    }
+    memcpy(head + length, "Set-Cookie: ", 12);
+    length += 12;
+    memcpy(head + length, variable.start, variable.length);
+    length += variable.length;
+    head[length++] = '=';
+    memcpy(head + length, value.start, value.length);
+    length += value.length;
+    memcpy(head + length, "\r\n\r\n", 4);
+    return length + 4;
+}
+
+/* A method that splits a page template into static text and slots. A slot is
+ * written as its name in curly braces, i.e. "{target}".
+ * Returns 0 on success and -1 if the template has an unknown slot, too many
+ * pieces or a slot after the content.
+ */
+int compilePageTemplate(struct pageTemplate *page, const char *source) {
+    static const char *slotNames[] = { NULL, "style", "server-port", "target", "queries", "ip", "port", "content" };
+    page->count = 0;
+    page->contentIndex = -1;
+    const char *text = source;
+    while(*text != '\0') {
+        const char *open = strchr(text, '{');
+        const char *end = open != NULL ? open : text + strlen(text);
+        if(end > text) {
+            if(page->count == MAX_PAGE_PIECES) {
+                return -1;
+            }
+            page->pieces[page->count++] = (struct pagePiece) { .slot = SLOT_NONE, .text = text, .length = (size_t) (end - text) };
+        }
+        if(open == NULL) {
+            break;
+        }
+        const char *close = strchr(open, '}');
+        if(close == NULL || page->count == MAX_PAGE_PIECES || page->contentIndex != -1) {
+            return -1;
+        }
+        size_t length = (size_t) (close - open - 1);
+        enum pageSlot slot = SLOT_NONE;
+        size_t i;
+        for(i = 1; i < sizeof(slotNames) / sizeof(slotNames[0]); i++) {
+            if(strlen(slotNames[i]) == length && strncmp(open + 1, slotNames[i], length) == 0) {
+                slot = (enum pageSlot) i;
+            }
+        }
+        if(slot == SLOT_NONE) {
+            return -1;
+        }
+        if(slot == SLOT_CONTENT) {
+            page->contentIndex = page->count;
+        }
+        page->pieces[page->count++] = (struct pagePiece) { .slot = slot };
+        text = close + 1;
+    }
+    return 0;
+}
+
+/* A method that makes a view safe to put on a page: if it has characters that
+ * mean something in HTML it is replaced with an escaped copy in the arena,
+ * otherwise it is used as it is.
+ * Returns 0 on success and -1 if we are out of memory.
+ */
+int escapeView(struct arena *arena, struct stringView *view) {
+    size_t i;
+    for(i = 0; i < view->length; i++) {
+        char c = view->start[i];
+        if(c == '&' || c == '<' || c == '>' || c == '"' || c == '\'') {
+            break;
+        }
+    }
+    if(i == view->length) {
+        return 0;
+    }
+    struct textBuffer buffer;
+    initTextBuffer(&buffer, arena, view->length * 6);
+    appendEscaped(&buffer, *view);
+    if(buffer.failed) {
+        return -1;
+    }
+    view->start = buffer.data;
+    view->length = buffer.length;
+    return 0;
+}
+
+/* A method that adds a piece of a page to an iovec array, unless it is empty. */
+void addPiece(struct iovec *iov, int *count, const char *data, size_t length) {
+    if(length > 0) {
+        iov[*count].iov_base = (char *) data;
+        iov[*count].iov_len = length;
+        (*count)++;
+    }
+}
+
+/* A method that finds how many iovecs filling in a page for a request can take. */
+int countPagePieces(struct pageTemplate *page, struct httpRequest *request) {
+    return page->count + 3 + 4 * request->numberOfQueries;
+}
+
+/* A method that fills in the slots of a page template for a request. Static
+ * text is not copied, the iovecs point into the template, and values from the
+ * request point into the input buffer unless they have to be escaped. Only the
+ * part of the page before the content is filled in.
+ * Returns the number of iovecs used, or -1 if we are out of memory.
+ */
+int fillPage(struct pageTemplate *page, struct connection *conn, struct httpRequest *request, struct queryParameter *color,
+             char serverPort[], char ip_address[], int port, struct iovec *iov) {
+    int count = 0;
+    int i;
+    for(i = 0; i < page->count && i != page->contentIndex; i++) {
+        struct pagePiece *piece = &page->pieces[i];
+        switch(piece->slot) {
+            case SLOT_NONE:
+                addPiece(iov, &count, piece->text, piece->length);
+                break;
+
+            /* The background color comes from the "bg" query parameter if
+             * there is one and otherwise from the "bg" cookie, if the client
+             * sent one.
+             */
+            case SLOT_STYLE: {
+                struct stringView value = color != NULL ? color->value : findCookie(request, "bg");
+                if(value.length > 0) {
+                    if(escapeView(&conn->arena, &value) == -1) {
+                        return -1;
+                    }
+                    addPiece(iov, &count, " style='background-color:", 25);
+                    addPiece(iov, &count, value.start, value.length);
+                    addPiece(iov, &count, "'", 1);
+                }
+                break;
+            }
+            case SLOT_SERVER_PORT:
+                addPiece(iov, &count, serverPort, strlen(serverPort));
+                break;
+            case SLOT_TARGET: {
+                struct stringView target = request->target;
+                if(escapeView(&conn->arena, &target) == -1) {
+                    return -1;
+                }
+                addPiece(iov, &count, target.start, target.length);
+                break;
+            }
+            case SLOT_QUERIES: {
+                int j;
+                for(j = 0; j < request->numberOfQueries; j++) {
+                    struct stringView variable = request->queries[j].variable;
+                    struct stringView value = request->queries[j].value;
+                    if(escapeView(&conn->arena, &variable) == -1 || escapeView(&conn->arena, &value) == -1) {
+                        return -1;
+                    }
+                    addPiece(iov, &count, variable.start, variable.length);
+                    if(value.length > 0) {
+                        addPiece(iov, &count, "=", 1);
+                        addPiece(iov, &count, value.start, value.length);
+                    }
+                    addPiece(iov, &count, "<br>\n\t\t", 7);
+                }
+                break;
+            }
+            case SLOT_IP:
+                addPiece(iov, &count, ip_address, strlen(ip_address));
+                break;
+            case SLOT_PORT: {
+                char *digits = arenaAlloc(&conn->arena, NUMBER_LENGTH);
+                if(digits == NULL) {
+                    return -1;
+                }
+                addPiece(iov, &count, digits, formatNumber(digits, (unsigned long) port));
+                break;
+            }
+            case SLOT_CONTENT:
+                break;
+        }
+    }
+    return count;
+}
+
+/* A method that reads the weight of a coding in an Accept-Encoding header,
+ * i.e. "0.5" in "gzip;q=0.5", in thousandths.
+ */
+int parseWeight(const char *p, const char *end) {
+    if(p < end && *p == '1') {
+        return 1000;
+    }
+    if(p == end || *p != '0') {
+        return 0;
+    }
+    int weight = 0;
+    int scale = 100;
+    for(p++; p < end && *p == '.'; p++) {
+        for(p++; p < end && scale > 0 && isdigit((unsigned char) *p); p++) {
+            weight += (*p - '0') * scale;
+            scale /= 10;
+        }
+        break;
+    }
+    return weight;
+}
+
+/* A method that finds which encoding a client accepts from its
+ * Accept-Encoding header. gzip is preferred to deflate unless the client gives
+ * deflate a higher weight, and a coding with a weight of 0 is refused. A
+ * client that sends no header gets no encoding.
+ */
+enum contentEncoding acceptedEncoding(struct httpRequest *request) {
+    struct stringView header = findHeader(request, "Accept-Encoding");
+    int gzip = -1;
+    int deflate = -1;
+    int any = -1;
+    const char *p = header.start;
+    const char *end = header.start + header.length;
+    while(p < end) {
+        /* One coding, i.e. "gzip;q=0.8", up to the next comma. */
+        const char *comma = memchr(p, ',', (size_t) (end - p));
+        const char *stop = comma != NULL ? comma : end;
+        while(p < stop && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        struct stringView coding = { (char *) p, 0 };
+        while(p < stop && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        coding.length = (size_t) (p - coding.start);
+        int weight = 1000;
+        while(p < stop) {
+            if(*p++ != ';') {
+                continue;
+            }
+            while(p < stop && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if(stop - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                weight = parseWeight(p + 2, stop);
+            }
+        }
+        if(viewEqualsIgnoreCase(coding, "gzip") || viewEqualsIgnoreCase(coding, "x-gzip")) {
+            gzip = weight;
+        }
+        else if(viewEqualsIgnoreCase(coding, "deflate")) {
+            deflate = weight;
+        }
+        else if(viewEquals(coding, "*")) {
+            any = weight;
+        }
+        p = stop + 1;
+    }
+    if(gzip == -1) {
+        gzip = any;
+    }
+    if(deflate == -1) {
+        deflate = any;
+    }
+    if(gzip > 0 && gzip >= deflate) {
+        return ENCODING_GZIP;
+    }
+    return deflate > 0 ? ENCODING_DEFLATE : ENCODING_IDENTITY;
+}
+
+/* A method that finds the encoding to send a response of the given size with.
+ * It is compressed if compression is on, it is large enough to be worth it and
+ * the client accepts gzip or deflate.
+ */
+enum contentEncoding responseEncoding(struct settings *settings, struct httpRequest *request, size_t size) {
+    if(settings->compressionLevel == 0 || size < (size_t) settings->minCompressSize) {
+        return ENCODING_IDENTITY;
+    }
+    return acceptedEncoding(request);
+}
+
+/* A method that compresses data into raw deflate blocks with a stream made by
+ * deflateInit2(), in memory from an arena or, if arena is NULL, from malloc().
+ * With Z_SYNC_FLUSH the blocks end on a byte boundary and are not the last
+ * ones, so other blocks can follow them; with Z_FINISH they end the stream.
+ * Returns the compressed data, or NULL if we are out of memory.
+ */
+char *deflateData(z_stream *stream, struct arena *arena, const struct iovec *iov, int count, int flush, size_t *length) {
+    size_t size = 0;
+    int i;
+    for(i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    if(deflateReset(stream) != Z_OK) {
+        return NULL;
+    }
+    /* deflateBound() does not count the empty block a flush ends with. */
+    size_t capacity = deflateBound(stream, size) + 16;
+    char *data = arena != NULL ? arenaAlloc(arena, capacity) : malloc(capacity);
+    if(data == NULL) {
+        return NULL;
+    }
+    stream->next_out = (Bytef *) data;
+    stream->avail_out = (uInt) capacity;
+    int result = Z_OK;
+    for(i = 0; i < count && result == Z_OK; i++) {
+        stream->next_in = (Bytef *) iov[i].iov_base;
+        stream->avail_in = (uInt) iov[i].iov_len;
+        result = deflate(stream, i == count - 1 ? flush : Z_NO_FLUSH);
+        if(stream->avail_in != 0) {
+            result = Z_BUF_ERROR;
+        }
+    }
+    if(result != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)) {
+        if(arena == NULL) {
+            free(data);
+        }
+        return NULL;
+    }
+    *length = capacity - stream->avail_out;
+    return data;
+}
+
+/* A method that compresses the static text of a page template. Each piece is
+ * compressed on its own, so it does not refer back to what comes before it in
+ * a page. A piece that does not get smaller than it is in a stored block is
+ * left as it is.
+ * Returns 0 on success and -1 if we are out of memory.
+ */
+int compressPageTemplate(struct pageTemplate *page, int level) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    int i;
+    for(i = 0; i < page->count; i++) {
+        struct pagePiece *piece = &page->pieces[i];
+        if(piece->slot != SLOT_NONE) {
+            continue;
+        }
+        struct iovec iov = { (char *) piece->text, piece->length };
+        piece->deflated = deflateData(&stream, NULL, &iov, 1, Z_SYNC_FLUSH, &piece->deflatedLength);
+        if(piece->deflated == NULL) {
+            deflateEnd(&stream);
+            return -1;
+        }
+        if(piece->deflatedLength >= piece->length + 5) {
+            free(piece->deflated);
+            piece->deflated = NULL;
+        }
+    }
+    deflateEnd(&stream);
+    return 0;
+}
+
+/* A method that finds the compressed piece of static text of a page template
+ * that an iovec of a filled in page points to.
+ */
+struct pagePiece *findPiece(struct pageTemplate *page, const void *data) {
+    int i;
+    for(i = 0; i < page->count; i++) {
+        if(page->pieces[i].text == data && page->pieces[i].deflated != NULL) {
+            return &page->pieces[i];
+        }
+    }
+    return NULL;
+}
+
+/* A method that writes the checksum that ends a gzip or zlib stream.
+ * Returns its length.
+ */
+size_t encodingTrailer(enum contentEncoding encoding, unsigned long crc, unsigned long adler, size_t size, unsigned char trailer[8]) {
+    if(encoding == ENCODING_GZIP) {
+        int i;
+        for(i = 0; i < 4; i++) {
+            trailer[i] = (unsigned char) (crc >> (8 * i));
+            trailer[4 + i] = (unsigned char) (size >> (8 * i));
+        }
+        return 8;
+    }
+    trailer[0] = (unsigned char) (adler >> 24);
+    trailer[1] = (unsigned char) (adler >> 16);
+    trailer[2] = (unsigned char) (adler >> 8);
+    trailer[3] = (unsigned char) adler;
+    return 4;
+}
+
+/* A method that puts the header of a gzip or zlib stream in an iovec. */
+void addEncodingHeader(struct iovec *iov, int *count, enum contentEncoding encoding) {
+    if(encoding == ENCODING_GZIP) {
+        addPiece(iov, count, GZIP_HEADER, sizeof(GZIP_HEADER) - 1);
+    }
+    else {
+        addPiece(iov, count, ZLIB_HEADER, sizeof(ZLIB_HEADER) - 1);
+    }
+}
+
+/* A method that compresses a filled in page for a client that accepts gzip or
+ * deflate. The static text of the template was compressed at startup, so only
+ * the text in between, which comes from the request, is compressed here. A run
+ * of it shorter than STORED_RUN is not worth compressing and goes in a stored
+ * block as it is. All the blocks end on a byte boundary, so they are sent one
+ * after another and an empty last block ends them. encoded needs room for
+ * 2 * count + 3 iovecs.
+ * Returns the number of iovecs used, or -1 if the worker has no deflate
+ * stream or we are out of memory.
+ */
+int encodePage(struct worker *worker, struct connection *conn, struct pageTemplate *page, enum contentEncoding encoding,
+               struct iovec *iov, int count, struct iovec *encoded) {
+    static const char lastBlock[2] = { 0x03, 0x00 };
+    if(!worker->deflaterReady) {
+        return -1;
+    }
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    unsigned long adler = adler32(0L, Z_NULL, 0);
+    size_t size = 0;
+    int i;
+    for(i = 0; i < count; i++) {
+        if(encoding == ENCODING_GZIP) {
+            crc = crc32(crc, (Bytef *) iov[i].iov_base, (uInt) iov[i].iov_len);
+        }
+        else {
+            adler = adler32(adler, (Bytef *) iov[i].iov_base, (uInt) iov[i].iov_len);
+        }
+        size += iov[i].iov_len;
+    }
+
+    int used = 0;
+    addEncodingHeader(encoded, &used, encoding);
+    i = 0;
+    while(i < count) {
+        struct pagePiece *piece = findPiece(page, iov[i].iov_base);
+        if(piece != NULL) {
+            addPiece(encoded, &used, piece->deflated, piece->deflatedLength);
+            i++;
+            continue;
+        }
+        /* A run of text from the request, up to the next compressed piece. */
+        int start = i;
+        size_t runLength = 0;
+        while(i < count && findPiece(page, iov[i].iov_base) == NULL) {
+            runLength += iov[i].iov_len;
+            i++;
+        }
+        if(runLength >= STORED_RUN) {
+            size_t length;
+            char *data = deflateData(&worker->deflater, &conn->arena, iov + start, i - start, Z_SYNC_FLUSH, &length);
+            if(data == NULL) {
+                return -1;
+            }
+            addPiece(encoded, &used, data, length);
+            continue;
+        }
+        /* A stored block is its length, the length inverted and the run itself. */
+        unsigned char *stored = arenaAlloc(&conn->arena, 5);
+        if(stored == NULL) {
+            return -1;
+        }
+        stored[0] = 0;
+        stored[1] = (unsigned char) runLength;
+        stored[2] = (unsigned char) (runLength >> 8);
+        stored[3] = (unsigned char) ~runLength;
+        stored[4] = (unsigned char) (~runLength >> 8);
+        addPiece(encoded, &used, (char *) stored, 5);
+        for(; start < i; start++) {
+            addPiece(encoded, &used, iov[start].iov_base, iov[start].iov_len);
+        }
+    }
+    addPiece(encoded, &used, lastBlock, sizeof(lastBlock));
+
+    unsigned char *trailer = arenaAlloc(&conn->arena, 8);
+    if(trailer == NULL) {
+        return -1;
+    }
+    addPiece(encoded, &used, (char *) trailer, encodingTrailer(encoding, crc, adler, size, trailer));
+    return used;
+}
+
+/* A method that adds the headers of a response that may be compressed to a
+ * head: Content-Encoding if it is compressed, and Vary if whether it is
+ * depends on what the client accepts. Vary goes on the response either way,
+ * so a cache does not hand one variant to a client that asked for the other.
+ * Returns the new length of the head.
+ */
+size_t addEncodingHeaders(char head[], size_t length, enum contentEncoding encoding, int vary) {
+    if(encoding == ENCODING_IDENTITY && !vary) {
+        return length;
+    }
+    length -= 2;
+    if(encoding != ENCODING_IDENTITY) {
+        length += (size_t) sprintf(head + length, "Content-Encoding: %s\r\n", encoding == ENCODING_GZIP ? "gzip" : "deflate");
+    }
+    if(vary) {
+        length += (size_t) sprintf(head + length, "Vary: Accept-Encoding\r\n");
+    }
+    length += (size_t) sprintf(head + length, "\r\n");
+    return length;
+}
+
+/* A method that counts a compressed response for /stats. */
+void countCompressed(struct workerStats *stats, size_t size, size_t compressedSize) {
+    addStat(&stats->compressed, 1);
+    addStat(&stats->compressedIn, size);
+    addStat(&stats->compressedOut, compressedSize);
+}
+
+/* A method that sends an empty response with the given error status to a
+ * client, i.e. when its request is malformed or too large. The connection is
+ * closed afterwards, which the response announces. The status is counted
+ * here for every error we send.
+ */
+void handleError(struct connection *conn, int status) {
+    const char *reason;
+    switch(status) {
+        case 400:
+            reason = "Bad Request";
+            break;
+        case 408:
+            reason = "Request Timeout";
+            break;
+        case 413:
+            reason = "Payload Too Large";
+            break;
+        case 429:
+            reason = "Too Many Requests";
+            break;
+        case 431:
+            reason = "Request Header Fields Too Large";
+            break;
+        case 501:
+            reason = "Not Implemented";
+            break;
+        case 503:
+            reason = "Service Unavailable";
+            break;
+        default:
+            reason = "Internal Server Error";
+            break;
+    }
+    char head[HEAD_LENGTH];
+    /* A client we turn away for being busy, or for asking too much, is told
+     * when to come back.
+     */
+    char retry[32] = "";
+    if(status == 503 || status == 429) {
+        snprintf(retry, sizeof(retry), "Retry-After: %d\r\n", RETRY_AFTER);
+    }
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nServer: jordanthor\r\n%sContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason, retry);
+    struct iovec iov[1] = { { head, (size_t) n } };
+    sendResponse(conn, iov, 1);
+    conn->keepAlive = 0;
+    conn->status = status;
+    countResponse(conn->stats, status);
+}
+
+/* A method that creates the head for a page of the given length, with the
+ * cookie for the background color if the client asked for one, the encoding
+ * the page is compressed with and, if vary is set, Vary.
+ */
+size_t renderHead(struct worker *worker, char head[], struct queryParameter *color, long sizeOfBody, enum contentEncoding encoding, int vary) {
+    /* If we got a query that contained "bg" then we handle the head
+     * with cookie. (That is add the cookie to the header response).
+     */
+    if(color != NULL) {
+        return addEncodingHeaders(head, handleHEADWithCookie(worker, head, color->variable, color->value, sizeOfBody), encoding, vary);
+    }
+    /* Else we handle the head normally. */
+    return addEncodingHeaders(head, handleHEAD(worker, head, sizeOfBody), encoding, vary);
+}
+
+/* A method that is called when we handle a GET request from a client.
+ * It creates our server response as a HTML document to such a request
+ * and includes the correctly structured header and content.
+ * Parameters sent to this function are worker (the worker handling the request),
+ * conn (the connection to the client), request (the parsed client request),
+ * ip_address (the client's IP address), port (the client's port) and
+ * head (the header lines sent in our server response).
+ */
+void handleGET(struct worker *worker, struct connection *conn, struct httpRequest *request, char ip_address[], int port, char head[]) {
+    struct pageTemplate *page = &worker->settings->getPage;
+
+    /* Search the queries from the client for "bg". If that is found than
+     * we set the color to the body tag of the response.
+     */
+    struct queryParameter *color = findQuery(request, "bg");
+
+    /* The first iovec is kept for the head, which needs the length of the page. */
+    struct iovec *iov = arenaAlloc(&conn->arena, (size_t) (1 + countPagePieces(page, request)) * sizeof(struct iovec));
+    int count = iov != NULL ? fillPage(page, conn, request, color, worker->settings->port, ip_address, port, iov + 1) : -1;
+    if(count == -1) {
+        handleError(conn, 500);
+        return;
+    }
+    size_t sizeOfBody = 0;
+    int i;
+    for(i = 1; i <= count; i++) {
+        sizeOfBody += iov[i].iov_len;
+    }
+
+    /* A page that is large enough is compressed if the client accepts it,
+     * or sent as it is if we run out of memory doing so.
+     */
+    int vary = worker->settings->compressionLevel > 0 && sizeOfBody >= (size_t) worker->settings->minCompressSize;
+    enum contentEncoding encoding = responseEncoding(worker->settings, request, sizeOfBody);
+    if(encoding != ENCODING_IDENTITY) {
+        struct iovec *encoded = arenaAlloc(&conn->arena, (size_t) (2 * count + 4) * sizeof(struct iovec));
+        int encodedCount = encoded != NULL ? encodePage(worker, conn, page, encoding, iov + 1, count, encoded + 1) : -1;
+        if(encodedCount == -1) {
+            encoding = ENCODING_IDENTITY;
+        }
+        else {
+            size_t sizeOfPage = sizeOfBody;
+            iov = encoded;
+            count = encodedCount;
+            sizeOfBody = 0;
+            for(i = 1; i <= count; i++) {
+                sizeOfBody += iov[i].iov_len;
+            }
+            countCompressed(conn->stats, sizeOfPage, sizeOfBody);
+        }
+    }
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = renderHead(worker, head, color, (long) sizeOfBody, encoding, vary);
+    sendResponse(conn, iov, count + 1);
+}
+
+/* A method that tells if the page echoing the body of a request is sent in
+ * chunks, which only HTTP/1.1 clients can read.
+ */
+int echoesChunked(struct httpRequest *request) {
+    return viewEquals(request->version, "HTTP/1.1");
+}
+
+/* A method that is called when we handle a POST request from a client.
+ * It creates our server response as a HTML document to such a request
+ * and includes the correctly structured header and content.
+ * Parameters sent to this function are the same as for handleGET. The content
+ * posted by the client is not part of the request yet: this method only sends
+ * the header and the page up to the content, which is then streamed into the
+ * response as it arrives and followed by the rest of the page (see finishBody).
+ * The content is escaped on the way, so the length of the page is not known
+ * up front: it is sent in chunks, or to a client too old for chunks until the
+ * connection is closed.
+ */
+void handlePOST(struct worker *worker, struct connection *conn, struct httpRequest *request, char ip_address[], int port, char head[]) {
+    struct pageTemplate *page = &worker->settings->postPage;
+
+    /* Search the queries from the client for "bg". If that is found than
+     * we set the color to the body tag of the response.
+     */
+    struct queryParameter *color = findQuery(request, "bg");
+
+    /* The first two iovecs are kept for the head and the size of the chunk
+     * and the last one for the end of the chunk.
+     */
+    struct iovec *iov = arenaAlloc(&conn->arena, (size_t) (3 + countPagePieces(page, request)) * sizeof(struct iovec));
+    int count = iov != NULL ? fillPage(page, conn, request, color, worker->settings->port, ip_address, port, iov + 2) : -1;
+    if(count == -1) {
+        handleError(conn, 500);
+        return;
+    }
+    size_t sizeOfStart = 0;
+    int i;
+    for(i = 2; i < count + 2; i++) {
+        sizeOfStart += iov[i].iov_len;
+    }
+
+    if(echoesChunked(request)) {
+        char size[32];
+        iov[0].iov_base = head;
+        iov[0].iov_len = renderHead(worker, head, color, LENGTH_CHUNKED, ENCODING_IDENTITY, 0);
+        iov[1].iov_base = size;
+        iov[1].iov_len = (size_t) snprintf(size, sizeof(size), "%zx\r\n", sizeOfStart);
+        iov[count + 2].iov_base = "\r\n";
+        iov[count + 2].iov_len = 2;
+        sendResponse(conn, iov, count + 3);
+        return;
+    }
+
+    conn->keepAlive = 0;
+    iov[1].iov_base = head;
+    iov[1].iov_len = renderHead(worker, head, color, LENGTH_UNTIL_CLOSE, ENCODING_IDENTITY, 0);
+    sendResponse(conn, iov + 1, count + 1);
+}
+
+/* A method that finds the content type of a file from its extension. */
+const char *contentType(const char *path, size_t length) {
+    static const char *types[][2] = {
+        { ".html", "text/html" },
+        { ".htm", "text/html" },
+        { ".css", "text/css" },
+        { ".js", "application/javascript" },
+        { ".json", "application/json" },
+        { ".txt", "text/plain" },
+        { ".png", "image/png" },
+        { ".jpg", "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif", "image/gif" },
+        { ".svg", "image/svg+xml" },
+        { ".ico", "image/x-icon" },
+        { ".woff2", "font/woff2" },
+    };
+    size_t i;
+    for(i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        size_t extension = strlen(types[i][0]);
+        if(length > extension && strncasecmp(path + length - extension, types[i][0], extension) == 0) {
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* A method that hashes a path for the open-file cache (FNV-1a). */
+unsigned long hashPath(struct stringView path) {
+    unsigned long hash = 14695981039346656037UL;
+    size_t i;
+    for(i = 0; i < path.length; i++) {
+        hash ^= (unsigned char) path.start[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/* A method that takes a file off the list of recently used files. */
+void unlinkFile(struct fileCache *cache, struct fileEntry *file) {
+    if(file->newer != NULL) {
+        file->newer->older = file->older;
+    }
+    else {
+        cache->newest = file->older;
+    }
+    if(file->older != NULL) {
+        file->older->newer = file->newer;
+    }
+    else {
+        cache->oldest = file->newer;
+    }
+}
+
+/* A method that puts a file at the front of the list of recently used files. */
+void pushFile(struct fileCache *cache, struct fileEntry *file) {
+    file->newer = NULL;
+    file->older = cache->newest;
+    if(cache->newest != NULL) {
+        cache->newest->newer = file;
+    }
+    else {
+        cache->oldest = file;
+    }
+    cache->newest = file;
+}
+
+/* A method that frees the compressed contents of a file in the open-file cache. */
+void freeDeflated(struct fileCache *cache, struct fileEntry *file) {
+    if(file->deflated != NULL) {
+        free(file->deflated);
+        file->deflated = NULL;
+        cache->deflatedSize -= file->deflatedLength;
+    }
+}
+
+/* A method that takes a file out of the open-file cache of a worker and closes it. */
+void evictFile(struct fileCache *cache, struct fileEntry *file) {
+    struct fileEntry **link = &cache->buckets[file->hash % FILE_CACHE_BUCKETS];
+    while(*link != file) {
+        link = &(*link)->hashNext;
+    }
+    *link = file->hashNext;
+    unlinkFile(cache, file);
+    cache->count -= 1;
+    if(file->fd != -1) {
+        close(file->fd);
+    }
+    freeDeflated(cache, file);
+    free(file);
+}
+
+/* A method that finds if a file of a content type is worth compressing, which
+ * it is not if it is compressed already, like images other than SVG.
+ */
+int isCompressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/javascript") == 0
+           || strcmp(type, "application/json") == 0 || strcmp(type, "image/svg+xml") == 0;
+}
+
+/* A method that opens a path in the document root so that it can not resolve
+ * to anything outside of it, through a symlink or otherwise. Kernels without
+ * openat2 fall back to openat, where the checks in findFile still keep the
+ * path itself in the document root.
+ * Returns the file descriptor, or -1 with errno set.
+ */
+int openBeneath(int dirfd, const char *path) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int fd = (int) syscall(__NR_openat2, dirfd, path, &how, sizeof(how));
+    if(fd == -1 && errno == ENOSYS) {
+        fd = openat(dirfd, path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    return fd;
+}
+
+/* A method that opens a file in the document root and makes the head of the
+ * response to it. If there is no regular file at the path the entry gets fd -1.
+ * A file that may be sent compressed says so in its head with Vary.
+ * Returns -1 if the file could not be looked at for another reason, i.e. we
+ * are out of file descriptors.
+ */
+int loadFile(struct worker *worker, struct fileEntry *file) {
+    struct settings *settings = worker->settings;
+    struct stat st;
+    file->compressible = 0;
+    file->deflated = NULL;
+    file->fd = openBeneath(settings->docRootfd, file->path);
+    if(file->fd == -1) {
+        return errno == ENOENT || errno == ENOTDIR || errno == EACCES || errno == ENAMETOOLONG
+               || errno == EXDEV || errno == ELOOP ? 0 : -1;
+    }
+    if(fstat(file->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(file->fd);
+        file->fd = -1;
+        return 0;
+    }
+    file->size = st.st_size;
+    file->inode = st.st_ino;
+    file->mtime = st.st_mtim;
+    const char *type = contentType(file->path, file->pathLength);
+    file->compressible = settings->compressionLevel > 0 && isCompressible(type)
+                         && file->size >= settings->minCompressSize && file->size <= COMPRESS_MAX_FILE_SIZE;
+
+    const char *start = "HTTP/1.1 200 OK\r\nDate: ";
+    file->dateOffset = strlen(start);
+    int n = snprintf(file->head, sizeof(file->head), "%s%*s\r\nServer: jordanthor\r\nContent-Type: %s\r\n%sContent-Length: %lld\r\n\r\n",
+                     start, DATE_LENGTH, "", type, file->compressible ? "Vary: Accept-Encoding\r\n" : "", (long long) file->size);
+    file->headLength = (size_t) n;
+    return 0;
+}
+
+/* A method that looks up a path in the document root through the open-file
+ * cache of a worker. A path with a ".." segment or more than one leading
+ * slash is never looked up, so a client can not get out of the document root.
+ * Returns the file, or NULL if there is no regular file at the path.
+ */
+struct fileEntry *findFile(struct worker *worker, struct stringView path) {
+    if(path.length < 2 || path.start[0] != '/' || path.start[1] == '/' || path.length >= PATH_MAX
+       || memchr(path.start, '\0', path.length) != NULL) {
+        return NULL;
+    }
+    size_t i;
+    for(i = 0; i + 2 < path.length; i++) {
+        if(path.start[i] == '/' && path.start[i + 1] == '.' && path.start[i + 2] == '.' && (i + 3 == path.length || path.start[i + 3] == '/')) {
+            return NULL;
+        }
+    }
+    /* The path without its leading slash is relative to the document root. */
+    path.start++;
+    path.length--;
+
+    struct fileCache *cache = &worker->files;
+    unsigned long hash = hashPath(path);
+    struct fileEntry *file;
+    for(file = cache->buckets[hash % FILE_CACHE_BUCKETS]; file != NULL; file = file->hashNext) {
+        if(file->hash == hash && file->pathLength == path.length && memcmp(file->path, path.start, path.length) == 0) {
+            break;
+        }
+    }
+
+    /* A cached file is compared to the disk once per second. */
+    if(file != NULL && file->checked != worker->now) {
+        struct stat st;
+        if(fstatat(worker->settings->docRootfd, file->path, &st, 0) == -1 || !S_ISREG(st.st_mode) || st.st_ino != file->inode
+           || st.st_size != file->size || st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec) {
+            evictFile(cache, file);
+            file = NULL;
+        }
+        else {
+            file->checked = worker->now;
+        }
+    }
+
+    if(file == NULL) {
+        struct fileMiss *miss = &cache->misses[hash % FILE_MISS_SLOTS];
+        if(miss->checked == worker->now && miss->hash == hash && miss->pathLength == path.length) {
+            return NULL;
+        }
+        file = malloc(sizeof(struct fileEntry) + path.length + 1);
+        if(file == NULL) {
+            return NULL;
+        }
+        file->hash = hash;
+        file->pathLength = path.length;
+        memcpy(file->path, path.start, path.length);
+        file->path[path.length] = '\0';
+        file->checked = worker->now;
+        int loaded = loadFile(worker, file);
+        if(loaded == -1 || file->fd == -1) {
+            /* A path that could not be looked at, i.e. for lack of file
+             * descriptors, is not remembered as missing.
+             */
+            if(loaded == 0) {
+                miss->hash = hash;
+                miss->pathLength = path.length;
+                miss->checked = worker->now;
+            }
+            free(file);
+            return NULL;
+        }
+        if(cache->count == FILE_CACHE_ENTRIES) {
+            evictFile(cache, cache->oldest);
+        }
+        file->hashNext = cache->buckets[hash % FILE_CACHE_BUCKETS];
+        cache->buckets[hash % FILE_CACHE_BUCKETS] = file;
+        cache->count += 1;
+    }
+    /* Else the file moves to the front of the list. */
+    else {
+        unlinkFile(cache, file);
+    }
+    pushFile(cache, file);
+    return file;
+}
+
+/* A method that compresses a file in the open-file cache of a worker, once for
+ * every client that asks for it compressed. To keep the compressed contents in
+ * the cache within its size, those of the least recently used files are freed.
+ * Returns 0 on success and -1 if the file could not be read, does not get
+ * smaller or does not fit in the cache, or we are out of memory.
+ */
+int compressFile(struct worker *worker, struct fileEntry *file) {
+    struct fileCache *cache = &worker->files;
+    size_t size = (size_t) file->size;
+    char *data = malloc(size);
+    if(data == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = pread(file->fd, data + done, size - done, (off_t) done);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            free(data);
+            return -1;
+        }
+        done += (size_t) n;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, worker->settings->compressionLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(data);
+        return -1;
+    }
+    struct iovec iov = { data, size };
+    file->deflated = deflateData(&stream, NULL, &iov, 1, Z_FINISH, &file->deflatedLength);
+    deflateEnd(&stream);
+    if(file->deflated == NULL) {
+        free(data);
+        return -1;
+    }
+    file->crc = crc32(crc32(0L, Z_NULL, 0), (Bytef *) data, (uInt) size);
+    file->adler = adler32(adler32(0L, Z_NULL, 0), (Bytef *) data, (uInt) size);
+    free(data);
+    cache->deflatedSize += file->deflatedLength;
+
+    /* A file that does not get smaller is not compressed again. */
+    if(file->deflatedLength >= size || file->deflatedLength > (size_t) worker->settings->compressCacheSize) {
+        freeDeflated(cache, file);
+        file->compressible = 0;
+        return -1;
+    }
+    struct fileEntry *older = cache->oldest;
+    while(cache->deflatedSize > (size_t) worker->settings->compressCacheSize && older != file) {
+        freeDeflated(cache, older);
+        older = older->newer;
+    }
+    return 0;
+}
+
+/* A method that sends the compressed contents of a file to a client: the head,
+ * which is made for each response as it depends on the encoding, and for GET
+ * the header, the deflate blocks and the checksum of the encoding.
+ */
+void sendEncodedFile(struct worker *worker, struct connection *conn, struct fileEntry *file, int withBody, enum contentEncoding encoding, char head[]) {
+    struct iovec iov[4];
+    int count = 1;
+    addEncodingHeader(iov, &count, encoding);
+    iov[count].iov_base = file->deflated;
+    iov[count++].iov_len = file->deflatedLength;
+    unsigned char trailer[8];
+    iov[count].iov_base = trailer;
+    iov[count++].iov_len = encodingTrailer(encoding, file->crc, file->adler, (size_t) file->size, trailer);
+    size_t sizeOfBody = iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+
+    int n = snprintf(head, HEAD_LENGTH, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: jordanthor\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                     worker->date, contentType(file->path, file->pathLength), sizeOfBody);
+    iov[0].iov_base = head;
+    iov[0].iov_len = addEncodingHeaders(head, (size_t) n, encoding, 1);
+    if(sendResponse(conn, iov, withBody ? count : 1) == 0 && withBody) {
+        countCompressed(conn->stats, (size_t) file->size, sizeOfBody);
+    }
+}
+
+/* A method that sends a file from the document root to a client: the head
+ * that was made when the file was loaded with today's date patched in, and
+ * for GET the file itself with sendfile(). A client that accepts gzip or
+ * deflate gets a file that is worth compressing compressed instead.
+ */
+void handleFile(struct worker *worker, struct connection *conn, struct fileEntry *file, int withBody, enum contentEncoding encoding, char head[]) {
+    if(encoding != ENCODING_IDENTITY && (file->deflated != NULL || compressFile(worker, file) == 0)) {
+        sendEncodedFile(worker, conn, file, withBody, encoding, head);
+        return;
+    }
+    memcpy(file->head + file->dateOffset, worker->date, DATE_LENGTH);
+    struct iovec iov[1] = { { file->head, file->headLength } };
+    if(sendResponse(conn, iov, 1) == -1 || !withBody) {
+        return;
+    }
+    sendFile(conn, file->fd, 0, (size_t) file->size);
+}
+
+/* A method that appends a number in decimal to a text buffer. */
+void appendNumber(struct textBuffer *buffer, unsigned long number) {
+    char digits[NUMBER_LENGTH];
+    appendText(buffer, digits, formatNumber(digits, number));
+}
+
+/* A method that adds the counters of every worker together. They are read
+ * while the workers go on, so the sum is not one instant, but every counter
+ * in it is one that has been reached.
+ */
+void sumStats(struct settings *settings, struct workerStats *total) {
+    /* The counters are all the same type, so they can be walked as an array. */
+    size_t count = sizeof(struct workerStats) / sizeof(_Atomic unsigned long);
+    _Atomic unsigned long *totals = (_Atomic unsigned long *) total;
+    memset(total, 0, sizeof(struct workerStats));
+    int w;
+    for(w = 0; w < settings->numberOfWorkers; w++) {
+        _Atomic unsigned long *stats = (_Atomic unsigned long *) &settings->workers[w].stats;
+        size_t i;
+        for(i = 0; i < count; i++) {
+            addStat(&totals[i], readStat(&stats[i]));
+        }
+    }
+}
+
+/* A method that renders the counters of all workers as JSON. */
+void renderStatsJSON(struct textBuffer *body, struct settings *settings, struct workerStats *total, time_t now) {
+    static const char *methods[METHOD_KINDS] = { "GET", "POST", "HEAD", "other" };
+    int i, j;
+    appendLiteral(body, "{\"workers\":");
+    appendNumber(body, (unsigned long) settings->numberOfWorkers);
+    appendLiteral(body, ",\"uptime\":");
+    appendNumber(body, (unsigned long) (now - settings->started));
+    appendLiteral(body, ",\"connections\":{\"accepted\":");
+    appendNumber(body, total->accepted);
+    appendLiteral(body, ",\"active\":");
+    appendNumber(body, total->connections);
+    appendLiteral(body, ",\"idle\":");
+    appendNumber(body, total->idle);
+    appendLiteral(body, "},\"load\":{\"in_flight\":");
+    appendNumber(body, total->inFlight);
+    appendLiteral(body, ",\"pending\":");
+    appendNumber(body, total->pending);
+    appendLiteral(body, "},\"shed\":{\"connections\":");
+    appendNumber(body, total->shedConnections);
+    appendLiteral(body, ",\"requests\":");
+    appendNumber(body, total->shedRequests);
+    appendLiteral(body, "},\"limited\":{\"connections\":");
+    appendNumber(body, total->limitedConnections);
+    appendLiteral(body, ",\"requests\":");
+    appendNumber(body, total->limitedRequests);
+    appendLiteral(body, "},\"compressed\":{\"responses\":");
+    appendNumber(body, total->compressed);
+    appendLiteral(body, ",\"in\":");
+    appendNumber(body, total->compressedIn);
+    appendLiteral(body, ",\"out\":");
+    appendNumber(body, total->compressedOut);
+    appendLiteral(body, "},\"bytes\":{\"in\":");
+    appendNumber(body, total->bytesIn);
+    appendLiteral(body, ",\"out\":");
+    appendNumber(body, total->bytesOut);
+    appendLiteral(body, "},\"requests\":{");
+    for(i = 0; i < METHOD_KINDS; i++) {
+        appendLiteral(body, "\"");
+        appendText(body, methods[i], strlen(methods[i]));
+        appendLiteral(body, "\":");
+        appendNumber(body, total->requests[i]);
+        if(i < METHOD_KINDS - 1) {
+            appendLiteral(body, ",");
+        }
+    }
+    appendLiteral(body, "},\"responses\":{");
+    for(i = 0; i < STATUS_KINDS; i++) {
+        if(i > 0) {
+            appendLiteral(body, ",");
+        }
+        appendLiteral(body, "\"");
+        if(i < STATUS_KINDS - 1) {
+            appendNumber(body, (unsigned long) statusCodes[i]);
+        }
+        else {
+            appendLiteral(body, "other");
+        }
+        appendLiteral(body, "\":");
+        appendNumber(body, total->responses[i]);
+    }
+    /* The buckets are cumulative, as in the Prometheus format. */
+    appendLiteral(body, "},\"latency_us\":{");
+    for(i = 0; i < METHOD_KINDS; i++) {
+        unsigned long count = 0;
+        if(i > 0) {
+            appendLiteral(body, ",");
+        }
+        appendLiteral(body, "\"");
+        appendText(body, methods[i], strlen(methods[i]));
+        appendLiteral(body, "\":{\"buckets\":{");
+        for(j = 0; j < LATENCY_BUCKETS; j++) {
+            count += total->latency[i][j];
+            if(j > 0) {
+                appendLiteral(body, ",");
+            }
+            appendLiteral(body, "\"");
+            if(j < LATENCY_BUCKETS - 1) {
+                appendNumber(body, 1UL << j);
+            }
+            else {
+                appendLiteral(body, "+Inf");
+            }
+            appendLiteral(body, "\":");
+            appendNumber(body, count);
+        }
+        appendLiteral(body, "},\"count\":");
+        appendNumber(body, count);
+        appendLiteral(body, ",\"sum\":");
+        appendNumber(body, total->latencySum[i]);
+        appendLiteral(body, "}");
+    }
+    appendLiteral(body, "}}\n");
+}
+
+/* A method that appends one sample in the Prometheus text format. */
+void appendSample(struct textBuffer *body, const char *name, const char *labels, unsigned long value) {
+    appendText(body, name, strlen(name));
+    if(labels != NULL) {
+        appendLiteral(body, "{");
+        appendText(body, labels, strlen(labels));
+        appendLiteral(body, "}");
+    }
+    appendLiteral(body, " ");
+    appendNumber(body, value);
+    appendLiteral(body, "\n");
+}
+
+/* A method that renders the counters of all workers in the Prometheus text format. */
+void renderStatsPrometheus(struct textBuffer *body, struct settings *settings, struct workerStats *total, time_t now) {
+    static const char *methods[METHOD_KINDS] = { "GET", "POST", "HEAD", "other" };
+    char labels[64];
+    int i, j;
+    appendLiteral(body, "# TYPE httpd_workers gauge\n");
+    appendSample(body, "httpd_workers", NULL, (unsigned long) settings->numberOfWorkers);
+    appendLiteral(body, "# TYPE httpd_uptime_seconds gauge\n");
+    appendSample(body, "httpd_uptime_seconds", NULL, (unsigned long) (now - settings->started));
+    appendLiteral(body, "# TYPE httpd_connections_accepted_total counter\n");
+    appendSample(body, "httpd_connections_accepted_total", NULL, total->accepted);
+    appendLiteral(body, "# TYPE httpd_connections gauge\n");
+    appendSample(body, "httpd_connections", "state=\"active\"", total->connections);
+    appendSample(body, "httpd_connections", "state=\"idle\"", total->idle);
+    appendLiteral(body, "# TYPE httpd_requests_in_flight gauge\n");
+    appendSample(body, "httpd_requests_in_flight", NULL, total->inFlight);
+    appendLiteral(body, "# TYPE httpd_requests_pending gauge\n");
+    appendSample(body, "httpd_requests_pending", NULL, total->pending);
+    appendLiteral(body, "# TYPE httpd_shed_total counter\n");
+    appendSample(body, "httpd_shed_total", "kind=\"connection\"", total->shedConnections);
+    appendSample(body, "httpd_shed_total", "kind=\"request\"", total->shedRequests);
+    appendLiteral(body, "# TYPE httpd_limited_total counter\n");
+    appendSample(body, "httpd_limited_total", "kind=\"connection\"", total->limitedConnections);
+    appendSample(body, "httpd_limited_total", "kind=\"request\"", total->limitedRequests);
+    appendLiteral(body, "# TYPE httpd_compressed_responses_total counter\n");
+    appendSample(body, "httpd_compressed_responses_total", NULL, total->compressed);
+    appendLiteral(body, "# TYPE httpd_compressed_bytes_total counter\n");
+    appendSample(body, "httpd_compressed_bytes_total", "direction=\"in\"", total->compressedIn);
+    appendSample(body, "httpd_compressed_bytes_total", "direction=\"out\"", total->compressedOut);
+    appendLiteral(body, "# TYPE httpd_bytes_total counter\n");
+    appendSample(body, "httpd_bytes_total", "direction=\"in\"", total->bytesIn);
+    appendSample(body, "httpd_bytes_total", "direction=\"out\"", total->bytesOut);
+    appendLiteral(body, "# TYPE httpd_requests_total counter\n");
+    for(i = 0; i < METHOD_KINDS; i++) {
+        snprintf(labels, sizeof(labels), "method=\"%s\"", methods[i]);
+        appendSample(body, "httpd_requests_total", labels, total->requests[i]);
+    }
+    appendLiteral(body, "# TYPE httpd_responses_total counter\n");
+    for(i = 0; i < STATUS_KINDS; i++) {
+        if(i < STATUS_KINDS - 1) {
+            snprintf(labels, sizeof(labels), "status=\"%d\"", statusCodes[i]);
+        }
+        else {
+            snprintf(labels, sizeof(labels), "status=\"other\"");
+        }
+        appendSample(body, "httpd_responses_total", labels, total->responses[i]);
+    }
+    appendLiteral(body, "# TYPE httpd_request_duration_microseconds histogram\n");
+    for(i = 0; i < METHOD_KINDS; i++) {
+        unsigned long count = 0;
+        for(j = 0; j < LATENCY_BUCKETS; j++) {
+            count += total->latency[i][j];
+            if(j < LATENCY_BUCKETS - 1) {
+                snprintf(labels, sizeof(labels), "method=\"%s\",le=\"%lu\"", methods[i], 1UL << j);
+            }
+            else {
+                snprintf(labels, sizeof(labels), "method=\"%s\",le=\"+Inf\"", methods[i]);
+            }
+            appendSample(body, "httpd_request_duration_microseconds_bucket", labels, count);
+        }
+        snprintf(labels, sizeof(labels), "method=\"%s\"", methods[i]);
+        appendSample(body, "httpd_request_duration_microseconds_sum", labels, total->latencySum[i]);
+        appendSample(body, "httpd_request_duration_microseconds_count", labels, count);
+    }
+}
+
+/* A method that is called for GET on STATS_PATH. It sends the counters of
+ * all workers added together, as JSON or, with "?format=prometheus", in
+ * the Prometheus text format.
+ */
+void handleStats(struct worker *worker, struct connection *conn, struct httpRequest *request, char head[]) {
+    struct workerStats total;
+    sumStats(worker->settings, &total);
+
+    struct queryParameter *format = findQuery(request, "format");
+    int prometheus = format != NULL && viewEquals(format->value, "prometheus");
+    struct textBuffer body;
+    initTextBuffer(&body, &conn->arena, 8192);
+    if(prometheus) {
+        renderStatsPrometheus(&body, worker->settings, &total, worker->now);
+    }
+    else {
+        renderStatsJSON(&body, worker->settings, &total, worker->now);
+    }
+    if(body.failed) {
+        handleError(conn, 500);
+        return;
+    }
+
+    int n = snprintf(head, HEAD_LENGTH, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: jordanthor\r\nContent-Type: %s\r\nCache-Control: no-store\r\nContent-Length: %zu\r\n\r\n",
+                     worker->date, prometheus ? "text/plain; version=0.0.4" : "application/json", body.length);
+    struct iovec iov[2] = { { head, (size_t) n }, { body.data, body.length } };
+    sendResponse(conn, iov, 2);
+}
+
+#ifdef PHASE_TRACING
+/* A method that is called for GET on PHASES_PATH. It sends the phases of the
+ * last requests of every worker as Chrome trace events.
+ */
+void handlePhases(struct worker *worker, struct connection *conn, char head[]) {
+    char *data = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&data, &length);
+    if(out == NULL) {
+        handleError(conn, 500);
+        return;
+    }
+    int result = writePhases(out, worker->settings);
+    if(fclose(out) != 0 || result == -1) {
+        free(data);
+        handleError(conn, 500);
+        return;
+    }
+
+    int n = snprintf(head, HEAD_LENGTH, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: jordanthor\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: %zu\r\n\r\n",
+                     worker->date, length);
+    struct iovec iov[2] = { { head, (size_t) n }, { data, length } };
+    sendResponse(conn, iov, 2);
+    free(data);
+}
+#endif
+
+/* A method that adds a line to the log ring of a worker. It never blocks and
+ * never makes a system call: if the log writer has fallen behind and the line
+ * does not fit, the line is dropped and counted.
+ */
+void logLine(struct logRing *ring, const char *line, size_t length) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(length > LOG_RING_SIZE - (tail - head)) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset < length ? LOG_RING_SIZE - offset : length;
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, length - first);
+    /* Publish the line only once it has been copied. */
+    atomic_store_explicit(&ring->tail, tail + length, memory_order_release);
+}
+
+/* A method that adds what a client sent to the trace, as one JSON line per
+ * record: when it arrived in microseconds since the trace started, the worker
+ * and connection it arrived on, how many requests start in it and the bytes
+ * themselves. Bytes outside printable ASCII are escaped as \u00XX, so the
+ * trace holds exactly what was sent. Data that does not fit in one line is
+ * split over more, the later ones starting no request.
+ */
+void traceInput(struct worker *worker, struct connection *conn, int requests, const char *data, size_t length, long time) {
+    static const char hex[] = "0123456789abcdef";
+    char line[TRACE_LINE_LENGTH];
+    do {
+        size_t n = (size_t) snprintf(line, sizeof(line), "{\"time\":%ld,\"worker\":%d,\"connection\":%u,\"requests\":%d,\"data\":\"",
+                                     time - worker->settings->traceStart, worker->id, conn->generation, requests);
+        /* Room is left for the longest escape and the end of the line. */
+        for(; length > 0 && n + 9 <= sizeof(line); data++, length--) {
+            unsigned char c = (unsigned char) *data;
+            if(c == '"' || c == '\\') {
+                line[n++] = '\\';
+                line[n++] = (char) c;
+            }
+            else if(c == '\r' || c == '\n') {
+                line[n++] = '\\';
+                line[n++] = c == '\r' ? 'r' : 'n';
+            }
+            else if(c >= 0x20 && c < 0x7f) {
+                line[n++] = (char) c;
+            }
+            else {
+                memcpy(line + n, "\\u00", 4);
+                line[n + 4] = hex[c >> 4];
+                line[n + 5] = hex[c & 15];
+                n += 6;
+            }
+        }
+        memcpy(line + n, "\"}\n", 3);
+        logLine(worker->trace, line, n + 3);
+        requests = 0;
+    } while(length > 0);
+}
+
+/* A method that handles a single parsed request from a client and writes the
+ * access log line for it. The log line goes to the worker's log ring, from
+ * where the log writer thread writes it to the log file (and stdout) in batches.
+ */
+void handler(struct worker *worker, struct connection *conn, struct httpRequest *request) {
+    struct sockaddr_in client = conn->client;
+    char *head = arenaAlloc(&conn->arena, HEAD_LENGTH);
+    if(head == NULL) {
+        handleError(conn, 500);
+        return;
+    }
+    char clientIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client.sin_addr, clientIP, sizeof(clientIP));
+
+    conn->status = 200;
+
+    /* A file in the document root, for GET and HEAD. */
+    struct fileEntry *file = NULL;
+    if(worker->settings->docRoot != NULL && (conn->method == METHOD_GET || conn->method == METHOD_HEAD)) {
+        file = findFile(worker, request->path);
+    }
+
+    /* The counters of the server. */
+    if(conn->method == METHOD_GET && viewEquals(request->path, STATS_PATH)) {
+        handleStats(worker, conn, request, head);
+    }
+#ifdef PHASE_TRACING
+    /* The phases of the last requests. */
+    else if(conn->method == METHOD_GET && viewEquals(request->path, PHASES_PATH)) {
+        handlePhases(worker, conn, head);
+    }
+#endif
+    else if(file != NULL) {
+        enum contentEncoding encoding = file->compressible ? acceptedEncoding(request) : ENCODING_IDENTITY;
+        handleFile(worker, conn, file, conn->method == METHOD_GET, encoding, head);
+    }
+    /* GET. */ 
+    else if(conn->method == METHOD_GET) {
+        handleGET(worker, conn, request, clientIP, client.sin_port, head);
+    }
+    /* POST. */
+    else if(conn->method == METHOD_POST) {
+        handlePOST(worker, conn, request, clientIP, client.sin_port, head);
     }
     /* HEAD. */
-    else if(strcmp(requestMethod, "HEAD") == 0) {
-        ssize_t n = HEAD_LENGTH;
-        handleHEAD(head, 0);
-        write(connfd, head, (size_t) n);
+    else if(conn->method == METHOD_HEAD) {
+        struct iovec iov[1] = { { head, handleHEAD(worker, head, 0) } };
+        sendResponse(conn, iov, 1);
+    }
+    /* Error. */
+    else {
+        handleError(conn, 501);
+    }
+
+    /* Errors were counted when they were sent. */
+    if(conn->status == 200) {
+        countResponse(worker->connections.stats, 200);
+    }
+
+    char line[LOG_LINE_LENGTH];
+    int len = snprintf(line, sizeof(line), "%s : %s:%d %.*s\nhttp://localhost/%s%.*s : %d\n", worker->date, clientIP, client.sin_port,
+                       (int) request->method.length, request->method.start, worker->settings->port,
+                       (int) request->target.length, request->target.start, conn->status);
+    if(len >= (int) sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    logLine(worker->log, line, (size_t) len);
+}
+
+/* A method that makes the table of client addresses for the given limits.
+ * Returns NULL if there is no memory for it.
+ */
+struct clientTable *createClientTable(int rate, int maxConnections) {
+    struct clientTable *clients = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct clientTable));
+    if(clients == NULL) {
+        return NULL;
+    }
+    memset(clients, 0, sizeof(struct clientTable));
+    int i;
+    for(i = 0; i < CLIENT_SHARDS; i++) {
+        pthread_mutex_init(&clients->shards[i].lock, NULL);
+    }
+    if(getrandom(&clients->seed, sizeof(clients->seed), 0) != sizeof(clients->seed)) {
+        clients->seed = (uint32_t) monotonicMicroseconds() ^ (uint32_t) getpid();
+    }
+    clients->interval = rate > 0 ? 1000000 / rate : 0;
+    clients->burst = clients->interval * rate;
+    clients->maxConnections = maxConnections;
+    return clients;
+}
+
+/* A method that hashes a client address with the seed of the table. */
+uint32_t hashClient(struct clientTable *clients, uint32_t address) {
+    uint32_t hash = address ^ clients->seed;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352d;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* A method that finds the owner of the entry of a client address, with the
+ * connection count left out.
+ */
+uint64_t clientKey(uint32_t address) {
+    return (uint64_t) address << 32 | CLIENT_OCCUPIED;
+}
+
+/* A method that finds the entry of a client address, or gives it one. An
+ * address that has an entry is found without a lock. A new one is given an
+ * entry with its shard locked, after looking for it again, so two workers can
+ * not give it one each. It gets the first entry that is empty or stale, and
+ * a stale one is taken over; since entries are never emptied, the address
+ * can not be past an empty one.
+ * Returns NULL if every entry the address could have belongs to another
+ * address that is still in use, in which case it is not limited.
+ */
+struct clientEntry *findClient(struct clientTable *clients, uint32_t address, long now) {
+    uint32_t hash = hashClient(clients, address);
+    struct clientShard *shard = &clients->shards[hash / CLIENT_SHARD_SLOTS % CLIENT_SHARDS];
+    uint64_t key = clientKey(address);
+    int i;
+    for(i = 0; i < CLIENT_PROBES; i++) {
+        struct clientEntry *entry = &shard->entries[(hash + (uint32_t) i) % CLIENT_SHARD_SLOTS];
+        uint64_t owner = atomic_load_explicit(&entry->owner, memory_order_acquire);
+        if((owner & ~CLIENT_COUNT_MASK) == key) {
+            return entry;
+        }
+        if(owner == 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    struct clientEntry *found = NULL;
+    struct clientEntry *place = NULL;
+    uint64_t placeOwner = 0;
+    for(i = 0; i < CLIENT_PROBES; i++) {
+        struct clientEntry *entry = &shard->entries[(hash + (uint32_t) i) % CLIENT_SHARD_SLOTS];
+        uint64_t owner = atomic_load_explicit(&entry->owner, memory_order_acquire);
+        if((owner & ~CLIENT_COUNT_MASK) == key) {
+            found = entry;
+            break;
+        }
+        if(place == NULL && (owner == 0 || ((owner & CLIENT_COUNT_MASK) == 0
+                                          && atomic_load_explicit(&entry->full, memory_order_relaxed) <= now))) {
+            place = entry;
+            placeOwner = owner;
+        }
+        if(owner == 0) {
+            break;
+        }
+    }
+    /* A stale entry is only taken over if no connection was counted in it meanwhile. */
+    if(found == NULL && place != NULL) {
+        atomic_store_explicit(&place->full, 0, memory_order_relaxed);
+        if(atomic_compare_exchange_strong(&place->owner, &placeOwner, key)) {
+            found = place;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+/* A method that takes a token from the bucket of a client address for a
+ * request, if it has one left.
+ * Returns 0 if the request may go on and -1 if it is over the limit.
+ */
+int takeClientToken(struct clientTable *clients, uint32_t address, long now) {
+    struct clientEntry *entry = findClient(clients, address, now);
+    if(entry == NULL) {
+        return 0;
+    }
+    long full = atomic_load_explicit(&entry->full, memory_order_relaxed);
+    long next;
+    do {
+        next = (full > now ? full : now) + clients->interval;
+        if(next - now > clients->burst) {
+            return -1;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&entry->full, &full, next, memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
+
+/* A method that counts a new connection from a client address. While it is
+ * counted the entry can not be taken over, so it stays with the address
+ * until the connection gives it back with releaseClient(). An entry that is
+ * taken over between being found and being counted in is looked for again.
+ * Returns 0 with the entry the connection is counted in, NULL if it is not,
+ * and -1 if the address already has as many connections as it may have.
+ */
+int takeClient(struct clientTable *clients, uint32_t address, long now, struct clientEntry **taken) {
+    *taken = NULL;
+    int attempt;
+    for(attempt = 0; attempt < CLIENT_PROBES; attempt++) {
+        struct clientEntry *entry = findClient(clients, address, now);
+        if(entry == NULL) {
+            return 0;
+        }
+        uint64_t owner = atomic_load_explicit(&entry->owner, memory_order_relaxed);
+        while((owner & ~CLIENT_COUNT_MASK) == clientKey(address)) {
+            if(clients->maxConnections > 0 && (owner & CLIENT_COUNT_MASK) >= (uint64_t) clients->maxConnections) {
+                return -1;
+            }
+            if(atomic_compare_exchange_weak(&entry->owner, &owner, owner + 1)) {
+                *taken = entry;
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* A method that gives back the place of a connection in the count of its
+ * client address.
+ */
+void releaseClient(struct clientEntry *entry) {
+    atomic_fetch_sub(&entry->owner, 1);
+}
+
+/* A method that makes sure the connection table has a slot for the given
+ * file descriptor. The table is indexed by fd and doubles in size when a
+ * new fd does not fit, so lookups stay O(1) no matter how many clients we hold.
+ */
+int growConnectionTable(struct connectionTable *table, int fd) {
+    if(fd < table->capacity) {
+        return 0;
+    }
+    int newCapacity = table->capacity > 0 ? table->capacity : INITIAL_CONNECTIONS;
+    while(newCapacity <= fd) {
+        newCapacity *= 2;
+    }
+    struct connection **slots = realloc(table->slots, sizeof(struct connection *) * newCapacity);
+    if(slots == NULL) {
+        return -1;
+    }
+    memset(slots + table->capacity, 0, sizeof(struct connection *) * (newCapacity - table->capacity));
+    table->slots = slots;
+    table->capacity = newCapacity;
+    return 0;
+}
+
+/* A method that starts a timer wheel at the given tick. */
+void initTimerWheel(struct timerWheel *wheel, unsigned long now) {
+    memset(wheel, 0, sizeof(struct timerWheel));
+    wheel->currentTick = now;
+}
+
+/* A method that puts a timer into the slot it belongs in. That is the lowest
+ * level whose current round (the ticks that share everything above the level's
+ * slot bits with currentTick) contains the expiry tick.
+ */
+void placeTimer(struct timerWheel *wheel, struct timer *timer) {
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && (timer->expires >> ((level + 1) * TIMER_SLOT_BITS)) != (wheel->currentTick >> ((level + 1) * TIMER_SLOT_BITS))) {
+        level++;
+    }
+    int slot = (int) ((timer->expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if(timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+/* A method that takes a timer out of the wheel, if it is in it. */
+void cancelTimer(struct timerWheel *wheel, struct timer *timer) {
+    if(timer->expires == 0) {
+        return;
+    }
+    if(timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    }
+    else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+        if(timer->next == NULL) {
+            wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+        }
+    }
+    if(timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expires = 0;
+    wheel->count -= 1;
+}
+
+/* A method that (re)arms a timer to expire the given number of milliseconds
+ * from now. Timers further away than the top level can hold are capped.
+ */
+void armTimer(struct timerWheel *wheel, struct timer *timer, long milliseconds) {
+    cancelTimer(wheel, timer);
+    unsigned long ticks = (unsigned long) (milliseconds + TIMER_TICK - 1) / TIMER_TICK;
+    unsigned long maximum = ((unsigned long) 1 << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+    if(ticks < 1) {
+        ticks = 1;
+    }
+    if(ticks > maximum) {
+        ticks = maximum;
+    }
+    timer->expires = wheel->currentTick + ticks;
+    wheel->count += 1;
+    placeTimer(wheel, timer);
+}
+
+/* A method that moves the timers in a slot of a higher level down into the
+ * levels below, once the wheel has reached the round that slot stands for.
+ */
+void cascadeTimers(struct timerWheel *wheel, int level, int slot) {
+    struct timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+    while(timer != NULL) {
+        struct timer *next = timer->next;
+        placeTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+/* A method that moves the wheel forward to the given tick and returns the
+ * timers that have expired on the way as a list linked by next. The timers
+ * are out of the wheel when they are returned. If the wheel is empty it just
+ * jumps to the tick.
+ */
+struct timer *advanceTimers(struct timerWheel *wheel, unsigned long now) {
+    struct timer *expired = NULL;
+    while(wheel->currentTick < now) {
+        if(wheel->count == 0) {
+            wheel->currentTick = now;
+            break;
+        }
+        wheel->currentTick++;
+        /* Each time a level wraps around, the next slot of the level above
+         * is spread over the levels below.
+         */
+        int level;
+        for(level = 1; level < TIMER_LEVELS; level++) {
+            if((wheel->currentTick & (((unsigned long) 1 << (level * TIMER_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+            cascadeTimers(wheel, level, (int) ((wheel->currentTick >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)));
+        }
+        int slot = (int) (wheel->currentTick & (TIMER_SLOTS - 1));
+        struct timer *timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+        while(timer != NULL) {
+            struct timer *next = timer->next;
+            timer->prev = NULL;
+            timer->expires = 0;
+            timer->next = expired;
+            expired = timer;
+            wheel->count -= 1;
+            timer = next;
+        }
+    }
+    return expired;
+}
+
+/* A method that finds the tick the wheel next has to be advanced to, which is
+ * the earliest expiry on level 0 or else the earliest cascade on a higher
+ * level. Returns 0 if there are no timers.
+ */
+unsigned long nextTimerTick(struct timerWheel *wheel) {
+    int level;
+    for(level = 0; level < TIMER_LEVELS; level++) {
+        int shift = level * TIMER_SLOT_BITS;
+        int current = (int) ((wheel->currentTick >> shift) & (TIMER_SLOTS - 1));
+        /* Only the slots after the current one belong to this round. */
+        uint64_t ahead = current == TIMER_SLOTS - 1 ? 0 : wheel->occupied[level] & ~(((uint64_t) 2 << current) - 1);
+        if(ahead != 0) {
+            unsigned long round = (wheel->currentTick >> (shift + TIMER_SLOT_BITS)) << (shift + TIMER_SLOT_BITS);
+            return round | ((unsigned long) __builtin_ctzll(ahead) << shift);
+        }
+    }
+    return 0;
+}
+
+/* A method that picks the timeout a connection is waiting on from what it is
+ * doing and arms its timer for it. The header timeout runs from the first byte
+ * of a request and is not restarted by further bytes, so a client that sends
+ * its headers a byte at a time still runs out of time. The others measure
+ * inactivity and are restarted on every call.
+ */
+void updateTimeout(struct connectionTable *table, struct connection *conn) {
+    enum timeoutKind timeout;
+    long milliseconds;
+    if(conn->outputHead != NULL) {
+        timeout = TIMEOUT_WRITE;
+        milliseconds = WRITE_TIMEOUT;
+    }
+    else if(conn->bodyState != BODY_NONE) {
+        timeout = TIMEOUT_BODY;
+        milliseconds = BODY_TIMEOUT;
+    }
+    else if(conn->inputStart < conn->inputLength) {
+        timeout = TIMEOUT_HEADER;
+        milliseconds = HEADER_TIMEOUT;
+    }
+    else {
+        timeout = TIMEOUT_KEEPALIVE;
+        milliseconds = KEEPALIVE_TIMEOUT;
+    }
+    if(timeout == TIMEOUT_HEADER && conn->timeout == TIMEOUT_HEADER) {
+        return;
+    }
+    if((timeout == TIMEOUT_KEEPALIVE) != (conn->timeout == TIMEOUT_KEEPALIVE)) {
+        addStat(&table->stats->idle, timeout == TIMEOUT_KEEPALIVE ? 1 : (unsigned long) -1);
+    }
+    conn->timeout = timeout;
+    armTimer(&table->timers, &conn->timer, milliseconds);
+}
+
+/* A method that takes a cleared connection from the spare ones of a table.
+ * When there are none left a slab of CONNECTION_SLAB is allocated, aligned to
+ * a cache line so no two connections share one. Slabs are kept for as long
+ * as the worker runs. Returns NULL if we are out of memory.
+ */
+struct connection *allocConnection(struct connectionTable *table) {
+    if(table->spare == NULL) {
+        struct connection *slab = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct connection) * CONNECTION_SLAB);
+        if(slab == NULL) {
+            return NULL;
+        }
+        int i;
+        for(i = 0; i < CONNECTION_SLAB; i++) {
+            slab[i].nextPending = table->spare;
+            table->spare = &slab[i];
+        }
+    }
+    struct connection *conn = table->spare;
+    table->spare = conn->nextPending;
+    memset(conn, 0, sizeof(struct connection));
+    return conn;
+}
+
+/* A method that stores a newly accepted connection in the table. */
+struct connection *addConnection(struct connectionTable *table, int connfd, struct sockaddr_in *client) {
+    if(growConnectionTable(table, connfd) == -1) {
+        return NULL;
+    }
+    struct connection *conn = allocConnection(table);
+    if(conn == NULL) {
+        return NULL;
+    }
+    conn->connfd = connfd;
+    conn->keepAlive = 0;
+    conn->client = *client;
+    conn->arena.pool = &table->pool;
+    conn->stats = table->stats;
+    conn->generation = ++table->generations;
+#ifdef PHASE_TRACING
+    conn->phases = table->phases;
+#endif
+    table->slots[connfd] = conn;
+    table->count += 1;
+    addStat(&table->stats->accepted, 1);
+    addStat(&table->stats->connections, 1);
+    updateTimeout(table, conn);
+    return conn;
+}
+
+/* A method that puts a connection at the end of the pending queue, where its
+ * request waits for an in-flight slot.
+ */
+void parkConnection(struct connectionTable *table, struct connection *conn) {
+    conn->parked = 1;
+    conn->nextPending = NULL;
+    if(table->pendingTail != NULL) {
+        table->pendingTail->nextPending = conn;
+    }
+    else {
+        table->pendingHead = conn;
+    }
+    table->pendingTail = conn;
+    table->pendingCount += 1;
+    addStat(&table->stats->pending, 1);
+}
+
+/* A method that takes a connection out of the pending queue. */
+void unparkConnection(struct connectionTable *table, struct connection *conn) {
+    struct connection **link = &table->pendingHead;
+    struct connection *previous = NULL;
+    while(*link != conn) {
+        previous = *link;
+        link = &(*link)->nextPending;
+    }
+    *link = conn->nextPending;
+    if(table->pendingTail == conn) {
+        table->pendingTail = previous;
+    }
+    conn->parked = 0;
+    conn->nextPending = NULL;
+    table->pendingCount -= 1;
+    addStat(&table->stats->pending, (unsigned long) -1);
+}
+
+/* A method that gives a connection one of the in-flight slots of a worker. */
+void takeSlot(struct connectionTable *table, struct connection *conn) {
+    conn->inFlight = 1;
+    table->inFlight += 1;
+    addStat(&table->stats->inFlight, 1);
+}
+
+/* A method that gives back the in-flight slot of a connection once its
+ * request is done, that is its body has been read and its response has been
+ * written. The next request on the connection asks for a slot again once its
+ * headers are in.
+ */
+void releaseSlot(struct connectionTable *table, struct connection *conn) {
+    if(conn->outputHead == NULL) {
+        MARK_PHASE_AFTER(conn, PHASE_WRITE, PHASE_NONE);
+    }
+    if(conn->inFlight && conn->bodyState == BODY_NONE && conn->outputHead == NULL) {
+        conn->inFlight = 0;
+        table->inFlight -= 1;
+        addStat(&table->stats->inFlight, (unsigned long) -1);
+    }
+}
+
+/* A method that frees the slot of a connection in the table, and the
+ * connection, without closing its socket.
+ */
+void forgetConnection(struct connectionTable *table, struct connection *conn) {
+    MARK_PHASE(conn, PHASE_NONE);
+    if(conn->clientEntry != NULL) {
+        releaseClient(conn->clientEntry);
+    }
+    cancelTimer(&table->timers, &conn->timer);
+    table->slots[conn->connfd] = NULL;
+    table->count -= 1;
+    addStat(&table->stats->connections, (unsigned long) -1);
+    if(conn->timeout == TIMEOUT_KEEPALIVE) {
+        addStat(&table->stats->idle, (unsigned long) -1);
+    }
+    if(conn->inFlight) {
+        table->inFlight -= 1;
+        addStat(&table->stats->inFlight, (unsigned long) -1);
+    }
+    if(conn->parked) {
+        unparkConnection(table, conn);
+    }
+    while(conn->outputHead != NULL) {
+        struct outputBuffer *next = conn->outputHead->next;
+        /* A piece the kernel is still sending from is freed when it is done. */
+        if(conn->outputHead->inFlight) {
+            conn->outputHead->owner = NULL;
+        }
+        else {
+            freeOutputBuffer(conn->outputHead);
+        }
+        conn->outputHead = next;
+    }
+    poolFree(&table->pool, conn->input, conn->inputCapacity);
+    freeArena(&conn->arena);
+    conn->nextPending = table->spare;
+    table->spare = conn;
+}
+
+/* A method that closes a connection and frees its slot in the table. Closing
+ * the fd also removes it from the epoll set, and shutting it down first ends
+ * what io_uring still has in progress for it.
+ */
+void closeConnection(struct connectionTable *table, struct connection *conn) {
+    int connfd = conn->connfd;
+    forgetConnection(table, conn);
+    shutdown(connfd, SHUT_RDWR);
+    close(connfd);
+}
+
+/* A method that closes every connection whose timeout has expired. Only the
+ * expired timers are visited. A client that ran out of time before its request
+ * head was complete is told so with a 408 first. One whose body stalled is
+ * just closed, as its response has already started.
+ */
+void expireConnections(struct connectionTable *table, unsigned long now) {
+    struct timer *timer = advanceTimers(&table->timers, now);
+    while(timer != NULL) {
+        struct timer *next = timer->next;
+        struct connection *conn = (struct connection *) ((char *) timer - offsetof(struct connection, timer));
+        /* The 408 is written right away, as the connection is gone before
+         * the engine would send its queue.
+         */
+        if(conn->timeout == TIMEOUT_HEADER) {
+            conn->queueOutput = 0;
+            handleError(conn, 408);
+        }
+        closeConnection(table, conn);
+        timer = next;
+    }
+}
+
+/* A method that reads and drops what a lingering connection has sent, and
+ * closes it. Closing a socket with unread data makes the kernel reset the
+ * connection, which can make the client lose the response we sent it. A client
+ * that keeps sending after LINGER_DRAIN bytes is reset anyway.
+ */
+void closeLingering(int connfd) {
+    char scratch[4096];
+    size_t drained = 0;
+    ssize_t n;
+    while(drained < LINGER_DRAIN && (n = recv(connfd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0) {
+        drained += (size_t) n;
+    }
+    close(connfd);
+}
+
+/* A method that closes the connections that have lingered for
+ * LINGER_TIMEOUT, or all of them if all is set.
+ */
+void expireLingering(struct connectionTable *table, int all) {
+    struct lingerQueue *queue = &table->lingering;
+    while(queue->count > 0 && (all || queue->expires[queue->head] <= table->timers.currentTick)) {
+        closeLingering(queue->fds[queue->head]);
+        queue->head = (queue->head + 1) % LINGER_SLOTS;
+        queue->count -= 1;
+    }
+}
+
+/* A method that shuts a socket down for writing, so the client sees the last
+ * response end, and keeps it open for LINGER_TIMEOUT before it is closed once
+ * what the client sent has been read. If the queue is full the oldest one is
+ * closed early.
+ */
+void lingerSocket(struct connectionTable *table, int connfd) {
+    struct lingerQueue *queue = &table->lingering;
+    shutdown(connfd, SHUT_WR);
+    if(queue->count == LINGER_SLOTS) {
+        closeLingering(queue->fds[queue->head]);
+        queue->head = (queue->head + 1) % LINGER_SLOTS;
+        queue->count -= 1;
+    }
+    int tail = (queue->head + queue->count) % LINGER_SLOTS;
+    queue->fds[tail] = connfd;
+    queue->expires[tail] = table->timers.currentTick + LINGER_TIMEOUT / TIMER_TICK;
+    queue->count += 1;
+}
+
+/* A method that closes a connection everything has been written to. The
+ * client may still be sending, after an error response most of all, so the
+ * socket lingers rather than being closed right away. One io_uring still
+ * receives on is closed as usual, since only shutting it down ends that.
+ */
+void lingerConnection(struct connectionTable *table, struct connection *conn) {
+    int connfd = conn->connfd;
+    if(conn->receiving) {
+        closeConnection(table, conn);
+        return;
+    }
+    forgetConnection(table, conn);
+    lingerSocket(table, connfd);
+}
+
+/* A method that closes a connection once everything queued for it has been
+ * written, so the last response is not cut off. Until then nothing more is
+ * read from it. Returns -1, as the connection is done either way.
+ */
+int closeWhenWritten(struct connectionTable *table, struct connection *conn) {
+    if(conn->writeError) {
+        closeConnection(table, conn);
+    }
+    else if(conn->outputHead == NULL) {
+        lingerConnection(table, conn);
+    }
+    else {
+        conn->closing = 1;
+    }
+    return -1;
+}
+
+/* A method that turns away a connection with a response that fits in a single
+ * non-blocking send, which the socket buffer of a new connection always has
+ * room for. The client has usually sent its request already, or is about to,
+ * so the connection lingers rather than being closed right away.
+ */
+void turnAway(struct worker *worker, int connfd, const char *response, size_t length) {
+    send(connfd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    lingerSocket(&worker->connections, connfd);
+}
+
+/* A method that turns away a connection whose client address already has as
+ * many as it may have, with a 429.
+ */
+void limitConnection(struct worker *worker, int connfd) {
+    turnAway(worker, connfd, LIMIT_RESPONSE, sizeof(LIMIT_RESPONSE) - 1);
+    addStat(&worker->stats.limitedConnections, 1);
+    countResponse(&worker->stats, 429);
+}
+
+/* A method that turns away a connection the worker has no room for, with a
+ * 503 and Retry-After.
+ */
+void shedConnection(struct worker *worker, int connfd) {
+    turnAway(worker, connfd, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+    addStat(&worker->stats.shedConnections, 1);
+    countResponse(&worker->stats, 503);
+}
+
+/* A method that turns away a connection when we are out of file descriptors.
+ * The spare one is given up for a moment so the client can be told we are
+ * full instead of being left in the backlog.
+ * Returns 0 if a connection was turned away and -1 if there was none.
+ */
+int shedWithSpare(struct worker *worker) {
+    if(worker->sparefd == -1) {
+        return -1;
+    }
+    close(worker->sparefd);
+    int connfd = accept(worker->sockfd, NULL, NULL);
+    if(connfd != -1) {
+        shedConnection(worker, connfd);
+    }
+    worker->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return connfd != -1 ? 0 : -1;
+}
+
+/* A method that takes on a connection that has been accepted, or turns it
+ * away if the worker or its client address already has as many as it may
+ * have, and hands it to the engine of the worker. Responses are written in
+ * as few pieces as we can, so Nagle's algorithm is turned off; with it the
+ * last piece of a response waits for the client to acknowledge the one
+ * before, which a client that delays its acknowledgements does only after
+ * 40ms. With deferred accept the request has usually arrived with the
+ * connection, so it is read right away instead of after another wait for
+ * events.
+ */
+void openConnection(struct worker *worker, int connfd, struct sockaddr_in *client) {
+    struct connectionTable *table = &worker->connections;
+    struct clientTable *clients = worker->settings->clients;
+    int maxConnections = worker->settings->maxConnections;
+    if(maxConnections > 0 && table->count >= maxConnections) {
+        shedConnection(worker, connfd);
+        return;
+    }
+    struct clientEntry *entry = NULL;
+    if(clients != NULL && takeClient(clients, client->sin_addr.s_addr, monotonicMicroseconds(), &entry) == -1) {
+        limitConnection(worker, connfd);
+        return;
+    }
+    int on = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct connection *conn = addConnection(table, connfd, client);
+    if(conn == NULL) {
+        if(entry != NULL) {
+            releaseClient(entry);
+        }
+        close(connfd);
+        return;
+    }
+    conn->clientEntry = entry;
+    if(worker->engine->watch(worker, conn) == -1) {
+        closeConnection(table, conn);
+        return;
+    }
+    if(worker->settings->deferAccept > 0) {
+        worker->engine->resume(worker, conn);
+    }
+}
+
+/* A method that accepts every pending connection on the listening socket and
+ * registers it with epoll. The listening socket is edge-triggered, so we have
+ * to keep accepting until the backlog is empty. The connections are made
+ * non-blocking as they are accepted.
+ */
+void acceptConnections(struct worker *worker) {
+    for(;;) {
+        struct sockaddr_in client;
+        socklen_t len = (socklen_t) sizeof(client);
+        int connfd = accept4(worker->sockfd, (struct sockaddr *) &client, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE) {
+                if(shedWithSpare(worker) == 0) {
+                    continue;
+                }
+            }
+            else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept()");
+            }
+            return;
+        }
+        openConnection(worker, connfd, &client);
+    }
+}
+
+/* A method that makes room for more input on a connection. The buffer is
+ * borrowed from the pool on the first read and swapped for one twice the size
+ * when it is full, up to MAX_HEADER_LENGTH, which only the headers of a
+ * request can reach since bodies are streamed. Moving the buffer would leave
+ * the parser's views dangling, so the request that is being parsed is parsed
+ * again from its start. Returns -1 if the headers do not fit.
+ */
+int growInput(struct bufferPool *pool, struct connection *conn) {
+    /* Move the unhandled input to the front before growing the buffer. */
+    if(conn->inputStart > 0) {
+        memmove(conn->input, conn->input + conn->inputStart, conn->inputLength - conn->inputStart);
+        conn->inputLength -= conn->inputStart;
+        conn->inputStart = 0;
+        if(conn->request != NULL) {
+            initRequest(conn->request);
+        }
+        if(conn->inputLength < conn->inputCapacity) {
+            return 0;
+        }
+    }
+    size_t capacity = conn->inputCapacity > 0 ? (size_t) conn->inputCapacity * 2 : INPUT_BUFFER_LENGTH;
+    if(capacity > MAX_HEADER_LENGTH) {
+        return -1;
+    }
+    char *input = poolAlloc(pool, capacity);
+    if(input == NULL) {
+        return -1;
+    }
+    if(conn->input != NULL) {
+        memcpy(input, conn->input, conn->inputLength);
+        poolFree(pool, conn->input, conn->inputCapacity);
+    }
+    conn->input = input;
+    conn->inputCapacity = (unsigned) capacity;
+    if(conn->request != NULL) {
+        initRequest(conn->request);
+    }
+    return 0;
+}
+
+/* A method that makes room for length more bytes of input on a connection.
+ * Returns -1 if the headers do not fit.
+ */
+int reserveInput(struct bufferPool *pool, struct connection *conn, size_t length) {
+    while(conn->inputCapacity - conn->inputLength < length) {
+        if(growInput(pool, conn) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A method that gives the input buffer and the arena of a connection back to
+ * the pool once it has no request in progress, so an idle connection holds
+ * none of them. Anything that was queued for it to write is kept.
+ */
+void releaseBuffers(struct bufferPool *pool, struct connection *conn) {
+    if(conn->inputStart < conn->inputLength || conn->request != NULL || conn->bodyState != BODY_NONE) {
+        return;
+    }
+    poolFree(pool, conn->input, conn->inputCapacity);
+    conn->input = NULL;
+    conn->inputStart = 0;
+    conn->inputLength = 0;
+    conn->inputCapacity = 0;
+    freeArena(&conn->arena);
+}
+
+/* A method that sends a piece of the page echoing a body on to the response,
+ * as a chunk if the response is chunked.
+ */
+int sendPiece(struct connection *conn, struct iovec *iov, int count, size_t length) {
+    if(!conn->chunkedResponse) {
+        return sendResponse(conn, iov + 1, count);
+    }
+    char size[32];
+    iov[0].iov_base = size;
+    iov[0].iov_len = (size_t) snprintf(size, sizeof(size), "%zx\r\n", length);
+    iov[count + 1].iov_base = "\r\n";
+    iov[count + 1].iov_len = 2;
+    return sendResponse(conn, iov, count + 2);
+}
+
+/* A method that finds the HTML entity a character is escaped with. */
+struct stringView markupEntity(char c) {
+    switch(c) {
+        case '&':
+            return (struct stringView) { "&amp;", 5 };
+        case '<':
+            return (struct stringView) { "&lt;", 4 };
+        case '>':
+            return (struct stringView) { "&gt;", 4 };
+        case '"':
+            return (struct stringView) { "&quot;", 6 };
+        default:
+            return (struct stringView) { "&#39;", 5 };
+    }
+}
+
+/* A method that sends a piece of a request body on to the response, if the
+ * body is echoed back (POST) and drops it otherwise. The body is escaped in a
+ * single pass like the rest of what the client sent us. Runs of at least
+ * ECHO_COPY_MIN bytes between the characters that mean something in HTML are
+ * sent from the input buffer as they are; shorter ones are copied, with the
+ * entities of those characters, into a scratch buffer, so a body full of
+ * markup still goes out in a few large pieces.
+ */
+int echoBody(struct connection *conn, const char *data, size_t length) {
+    if(!conn->echoBody) {
+        return 0;
+    }
+    char scratch[ECHO_SCRATCH_LENGTH];
+    size_t used = 0;
+    /* The first and last iovecs are kept for the framing of the chunk. */
+    struct iovec iov[IOV_BATCH + 2];
+    int count = 0;
+    size_t size = 0;
+    size_t i = 0;
+    while(i < length) {
+        size_t run = scanDelimiters(data + i, length - i, &markupDelimiters);
+        if(run >= ECHO_COPY_MIN) {
+            iov[++count] = (struct iovec) { (char *) data + i, run };
+            size += run;
+            i += run;
+        }
+        else {
+            struct stringView entity = { NULL, 0 };
+            if(i + run < length) {
+                entity = markupEntity(data[i + run]);
+            }
+            if(used + run + entity.length > sizeof(scratch)) {
+                if(sendPiece(conn, iov, count, size) == -1) {
+                    return -1;
+                }
+                count = 0;
+                size = 0;
+                used = 0;
+            }
+            char *at = scratch + used;
+            memcpy(at, data + i, run);
+            memcpy(at + run, entity.start, entity.length);
+            /* What follows the last piece in the scratch buffer joins it. */
+            if(count > 0 && (char *) iov[count].iov_base + iov[count].iov_len == at) {
+                iov[count].iov_len += run + entity.length;
+            }
+            else {
+                iov[++count] = (struct iovec) { at, run + entity.length };
+            }
+            used += run + entity.length;
+            size += run + entity.length;
+            i += run + (entity.length > 0 ? 1 : 0);
+        }
+        if(count == IOV_BATCH) {
+            if(sendPiece(conn, iov, count, size) == -1) {
+                return -1;
+            }
+            count = 0;
+            size = 0;
+            used = 0;
+        }
+    }
+    if(count > 0) {
+        return sendPiece(conn, iov, count, size);
+    }
+    return 0;
+}
+
+/* A method that ends the response to a request once its body has been read.
+ * For POST this is the rest of the page after the content, and the last chunk
+ * for chunked responses.
+ */
+int finishBody(struct connection *conn, struct pageTemplate *page) {
+    if(!conn->echoBody) {
+        return 0;
+    }
+    int i;
+    for(i = page->contentIndex + 1; i < page->count; i++) {
+        struct iovec iov[3] = { { NULL, 0 }, { (char *) page->pieces[i].text, page->pieces[i].length } };
+        if(page->pieces[i].length > 0 && sendPiece(conn, iov, 1, page->pieces[i].length) == -1) {
+            return -1;
+        }
+    }
+    if(conn->chunkedResponse) {
+        return writeChunk(conn, NULL, 0);
+    }
+    return 0;
+}
+
+/* A method that streams the body of a request from the input buffer. A body
+ * with a Content-Length is passed on as it arrives; a chunked body is decoded one
+ * state at a time so a chunk may end anywhere in the buffer. Only what has
+ * arrived so far is handled, so the memory a connection needs stays the same
+ * no matter how large the body is.
+ * Returns the number of bytes used from data, or -1 if the body is malformed,
+ * larger than maxBodySize or the client went away.
+ */
+long handleBody(struct connection *conn, char *data, size_t available, long maxBodySize) {
+    size_t i = 0;
+    while(i < available && conn->bodyState != BODY_NONE) {
+        char c = data[i];
+        switch(conn->bodyState) {
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA: {
+                size_t length = available - i < conn->bodyRemaining ? available - i : conn->bodyRemaining;
+                if(echoBody(conn, data + i, length) == -1) {
+                    return -1;
+                }
+                i += length;
+                conn->bodyRemaining -= length;
+                if(conn->bodyRemaining == 0) {
+                    conn->bodyState = conn->bodyState == BODY_LENGTH ? BODY_NONE : BODY_CHUNK_DATA_END;
+                }
+                continue;
+            }
+            case BODY_CHUNK_SIZE_START:
+                /* A size line without any digits is malformed. */
+                if(!isxdigit((unsigned char) c)) {
+                    return -1;
+                }
+                conn->bodyState = BODY_CHUNK_SIZE;
+                /* fall through */
+            case BODY_CHUNK_SIZE:
+            case BODY_CHUNK_EXTENSION:
+                if(c == '\r' || c == '\n') {
+                    /* A bare LF ends the line too, and is taken by
+                     * BODY_CHUNK_SIZE_END as if it followed a CR.
+                     */
+                    conn->bodyState = BODY_CHUNK_SIZE_END;
+                    if(c == '\n') {
+                        continue;
+                    }
+                }
+                else if(conn->bodyState == BODY_CHUNK_SIZE && isxdigit((unsigned char) c)) {
+                    int digit = isdigit((unsigned char) c) ? c - '0' : (tolower((unsigned char) c) - 'a' + 10);
+                    conn->bodyRemaining = conn->bodyRemaining * 16 + (size_t) digit;
+                    if(conn->bodyReceived + conn->bodyRemaining > (size_t) maxBodySize) {
+                        return -1;
+                    }
+                }
+                else if(c == ';' || c == ' ' || c == '\t') {
+                    conn->bodyState = BODY_CHUNK_EXTENSION;
+                }
+                else if(conn->bodyState == BODY_CHUNK_SIZE) {
+                    return -1;
+                }
+                break;
+            case BODY_CHUNK_SIZE_END:
+                /* The size line ends with CRLF and nothing else. */
+                if(c != '\n') {
+                    return -1;
+                }
+                conn->bodyState = conn->bodyRemaining > 0 ? BODY_CHUNK_DATA : BODY_TRAILER_START;
+                conn->bodyReceived += conn->bodyRemaining;
+                break;
+            case BODY_CHUNK_DATA_END:
+                if(c == '\n') {
+                    conn->bodyState = BODY_CHUNK_SIZE_START;
+                }
+                else if(c != '\r') {
+                    return -1;
+                }
+                break;
+            case BODY_TRAILER_START:
+                if(c == '\n') {
+                    conn->bodyState = BODY_NONE;
+                }
+                else if(c != '\r') {
+                    conn->bodyState = BODY_TRAILER_LINE;
+                }
+                break;
+            case BODY_TRAILER_LINE:
+                if(c == '\n') {
+                    conn->bodyState = BODY_TRAILER_START;
+                }
+                break;
+            case BODY_NONE:
+                break;
+        }
+        i++;
+    }
+    return (long) i;
+}
+
+/* A method that handles every request in the input buffer of a connection, in
+ * the order they arrived. A request is handled as soon as its headers have been
+ * terminated by an empty line, then its body is streamed until it ends. Whatever
+ * is left is kept for the next read, so requests split over several reads and
+ * pipelined requests both work. Once more than OUTPUT_HIGH_WATER bytes wait in
+ * the output queue we stop, and go on when the queue has been written.
+ * Returns 0 if the connection should stay open and -1 if it is done.
+ */
+int handleInput(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    long maxBodySize = worker->settings->maxBodySize;
+    int maxInFlight = worker->settings->maxInFlight;
+    int maxPending = worker->settings->maxPending;
+    struct clientTable *clients = worker->settings->clients;
+    if(conn->parked) {
+        return 0;
+    }
+    while(conn->inputStart < conn->inputLength && conn->outputQueued <= OUTPUT_HIGH_WATER) {
+        char *start = conn->input + conn->inputStart;
+        size_t available = conn->inputLength - conn->inputStart;
+        if(conn->bodyState == BODY_NONE) {
+            /* A new request gets its parser state from the arena, once its
+             * client has been found to be within its rate. One that is not
+             * is turned away before anything of it is parsed.
+             */
+            if(conn->request == NULL) {
+                /* A connection with a request in progress is not idle, even
+                 * if it was when its timer was last armed.
+                 */
+                if(conn->timeout == TIMEOUT_KEEPALIVE) {
+                    addStat(&table->stats->idle, (unsigned long) -1);
+                    conn->timeout = TIMEOUT_NONE;
+                }
+                if(clients != NULL && clients->interval > 0 && takeClientToken(clients, conn->client.sin_addr.s_addr, monotonicMicroseconds()) == -1) {
+                    addStat(&worker->stats.limitedRequests, 1);
+                    handleError(conn, 429);
+                    return closeWhenWritten(table, conn);
+                }
+                conn->request = arenaAlloc(&conn->arena, sizeof(struct httpRequest));
+                if(conn->request == NULL) {
+                    handleError(conn, 500);
+                    return closeWhenWritten(table, conn);
+                }
+                initRequest(conn->request);
+                conn->requestStart = monotonicMicroseconds();
+                MARK_PHASE(conn, PHASE_NONE);
+                MARK_PHASE(conn, PHASE_READ);
+            }
+            struct httpRequest *request = conn->request;
+            MARK_PHASE(conn, PHASE_PARSE);
+            int result = parseRequest(request, start, available);
+            if(result == PARSE_INCOMPLETE) {
+                MARK_PHASE(conn, PHASE_READ);
+                return 0;
+            }
+            if(result == PARSE_ERROR) {
+                /* A request we can not make sense of ends the connection. */
+                handleError(conn, 400);
+                return closeWhenWritten(table, conn);
+            }
+            if(request->contentLength > maxBodySize) {
+                handleError(conn, 413);
+                return closeWhenWritten(table, conn);
+            }
+
+            /* The request needs an in-flight slot. If there is none it waits
+             * in the pending queue, and is parsed again when it gets one. If
+             * the queue is full too it is turned away right away. /stats is
+             * always answered, since it is how an overload is seen.
+             */
+            conn->method = viewEquals(request->method, "GET") ? METHOD_GET : viewEquals(request->method, "POST") ? METHOD_POST
+                           : viewEquals(request->method, "HEAD") ? METHOD_HEAD : METHOD_OTHER;
+            if(!conn->inFlight && !(conn->method == METHOD_GET && viewEquals(request->path, STATS_PATH))) {
+                if(maxInFlight > 0 && (table->inFlight >= maxInFlight || table->pendingCount > 0)) {
+                    if(maxPending > 0 && table->pendingCount >= maxPending) {
+                        addStat(&worker->stats.shedRequests, 1);
+                        handleError(conn, 503);
+                        return closeWhenWritten(table, conn);
+                    }
+                    initRequest(request);
+                    MARK_PHASE(conn, PHASE_QUEUE);
+                    parkConnection(table, conn);
+                    return 0;
+                }
+                takeSlot(table, conn);
+            }
+
+            /* Check if the request is supposed to be persistent and send
+             * the request to our handler.
+             */
+            conn->keepAlive = request->keepAlive;
+            addStat(&worker->stats.requests[conn->method], 1);
+            if(worker->trace != NULL) {
+                traceInput(worker, conn, 1, start, request->headerLength, conn->requestStart);
+            }
+            MARK_PHASE(conn, PHASE_HANDLE);
+            handler(worker, conn, request);
+
+            /* The body comes next. POST echoes it into its page, but the
+             * body of any other request, or of one that got an error instead
+             * of the page, is dropped.
+             */
+            conn->echoBody = conn->method == METHOD_POST && conn->status == 200;
+            conn->chunkedResponse = conn->echoBody && echoesChunked(request);
+            conn->bodyRemaining = (size_t) request->contentLength;
+            conn->bodyReceived = (size_t) request->contentLength;
+            conn->bodyState = request->chunked ? BODY_CHUNK_SIZE_START : (request->contentLength > 0 ? BODY_LENGTH : BODY_NONE);
+            conn->inputStart += request->headerLength;
+            MARK_PHASE(conn, conn->bodyState == BODY_NONE ? PHASE_WRITE : PHASE_BODY);
+
+            /* The request has been handled and what is left of the response
+             * is in the output queue, so its memory can be reused.
+             */
+            conn->request = NULL;
+            resetArena(&conn->arena);
+        }
+        else {
+            long used = handleBody(conn, start, available, maxBodySize);
+            if(used == -1) {
+                closeConnection(table, conn);
+                return -1;
+            }
+            if(worker->trace != NULL && used > 0) {
+                traceInput(worker, conn, 0, start, (size_t) used, monotonicMicroseconds());
+            }
+            conn->inputStart += (size_t) used;
+        }
+
+        if(conn->bodyState == BODY_NONE) {
+            if(finishBody(conn, &worker->settings->postPage) == -1) {
+                closeConnection(table, conn);
+                return -1;
+            }
+            conn->echoBody = 0;
+            countLatency(conn);
+            MARK_PHASE(conn, PHASE_WRITE);
+
+            /* Check if the connection should be kept alive and close it
+             * if it isn't.
+             */
+            if(conn->keepAlive == 0) {
+                return closeWhenWritten(table, conn);
+            }
+        }
+        if(conn->writeError) {
+            closeConnection(table, conn);
+            return -1;
+        }
+    }
+    if(conn->inputStart == conn->inputLength) {
+        /* Everything has been handled, so the buffer can start over. */
+        conn->inputStart = 0;
+        conn->inputLength = 0;
+    }
+    if(!conn->parked) {
+        releaseSlot(table, conn);
+    }
+    return 0;
+}
+
+/* A method that reads everything available on a connection into its input
+ * buffer and handles the requests in it. While the output queue is over
+ * OUTPUT_HIGH_WATER nothing is read, which pushes back on clients that send
+ * faster than they read. Returns 0 if the connection should stay open and -1
+ * if it is done.
+ */
+int readConnection(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    for(;;) {
+        if(conn->closing) {
+            return -1;
+        }
+        /* A connection that waits for an in-flight slot, or for a client to
+         * read what it has been sent, is not read from.
+         */
+        if(conn->parked || conn->outputQueued > OUTPUT_HIGH_WATER) {
+            return 0;
+        }
+        if(conn->inputLength == conn->inputCapacity && growInput(&table->pool, conn) == -1) {
+            handleError(conn, 431);
+            return closeWhenWritten(table, conn);
+        }
+        ssize_t n = read(conn->connfd, conn->input + conn->inputLength, conn->inputCapacity - conn->inputLength);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        /* Once everything has been read and handled the buffers go back
+         * to the pool until the client sends again.
+         */
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            releaseBuffers(&table->pool, conn);
+            return 0;
+        }
+        if(n == 0) {
+            /* Here the message size is 0 which we interpret as the persistent
+             * connection telling us it is done with sending us messages.
+             * What we still owe it is written before we close.
+             */
+            return closeWhenWritten(table, conn);
+        }
+        if(n < 0) {
+            closeConnection(table, conn);
+            return -1;
+        }
+        conn->inputLength += (size_t) n;
+        addStat(&worker->stats.bytesIn, (size_t) n);
+        if(handleInput(worker, conn) == -1) {
+            return -1;
+        }
+    }
+}
+
+/* A method that is called when a connection has become writable. It writes
+ * out the output queue and, once that is empty, either closes the connection
+ * if it is closing or goes on with the input that was held back.
+ * Returns 0 if the connection should stay open and -1 if it is done.
+ */
+int writeConnection(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    int result = flushOutput(conn);
+    if(result == -1) {
+        closeConnection(table, conn);
+        return -1;
+    }
+    if(result == 0 && conn->closing) {
+        lingerConnection(table, conn);
+        return -1;
+    }
+    releaseSlot(table, conn);
+    if(conn->outputQueued > OUTPUT_HIGH_WATER) {
+        return 0;
+    }
+    if(conn->inputStart < conn->inputLength && handleInput(worker, conn) == -1) {
+        return -1;
+    }
+    return readConnection(worker, conn);
+}
+
+/* A method that lets the connections in the pending queue go on, in the order
+ * they came in, as long as there are in-flight slots for them. It is called
+ * after each batch of events rather than when a slot is given back, so one
+ * connection's request never runs inside another's.
+ */
+void admitPending(struct worker *worker) {
+    struct connectionTable *table = &worker->connections;
+    int maxInFlight = worker->settings->maxInFlight;
+    while(table->pendingHead != NULL && (maxInFlight == 0 || table->inFlight < maxInFlight)) {
+        struct connection *conn = table->pendingHead;
+        int connfd = conn->connfd;
+        unparkConnection(table, conn);
+        takeSlot(table, conn);
+        handleInput(worker, conn);
+        if(table->slots[connfd] == conn) {
+            worker->engine->resume(worker, conn);
+        }
+        if(table->slots[connfd] == conn) {
+            updateTimeout(table, conn);
+        }
+    }
+}
+
+/* A method that sets up the epoll engine of a worker: an epoll instance with
+ * the listening socket registered in it.
+ * Returns 0 on success and -1 on failure.
+ */
+int epollStart(struct worker *worker) {
+    worker->epfd = epoll_create1(0);
+    if(worker->epfd == -1) {
+        return -1;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = worker->sockfd;
+    return epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->sockfd, &event);
+}
+
+/* A method that waits for the sockets of a worker to become ready. */
+int epollWait(struct worker *worker, int timeout) {
+    return epoll_wait(worker->epfd, worker->events, MAX_EVENTS, timeout);
+}
+
+/* A method that handles the sockets epoll reported as ready, and only those. */
+void epollDispatch(struct worker *worker, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        int fd = worker->events[i].data.fd;
+        unsigned events = worker->events[i].events;
+        if(fd == worker->sockfd) {
+            acceptConnections(worker);
+            continue;
+        }
+
+        struct connection *conn = fd < worker->connections.capacity ? worker->connections.slots[fd] : NULL;
+        if(conn == NULL) {
+            continue;
+        }
+        if(events & EPOLLERR) {
+            closeConnection(&worker->connections, conn);
+            continue;
+        }
+        /* Write what is queued for the connection first, this also
+         * goes on with input that waited for the queue to drain.
+         */
+        if((events & EPOLLOUT) && conn->outputHead != NULL) {
+            writeConnection(worker, conn);
+        }
+        /* Read/handle the connection, this also picks up EPOLLRDHUP
+         * and EPOLLHUP since read() then returns 0 once the data is drained.
+         */
+        if(worker->connections.slots[fd] == conn && !conn->closing && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+            readConnection(worker, conn);
+        }
+        /* The connection made progress, so its timeout starts over. */
+        if(worker->connections.slots[fd] == conn) {
+            updateTimeout(&worker->connections, conn);
+        }
+    }
+}
+
+/* A method that registers a new connection with epoll, edge-triggered for
+ * both input and output, so it is reported once each time it becomes ready.
+ * Returns 0 on success and -1 on failure.
+ */
+int epollWatch(struct worker *worker, struct connection *conn) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = conn->connfd;
+    if(epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->connfd, &event) == -1) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+/* A method that goes on with a connection that had to wait. Since epoll is
+ * edge-triggered, what arrived in the meantime is read right away.
+ */
+void epollResume(struct worker *worker, struct connection *conn) {
+    readConnection(worker, conn);
+}
+
+/* A method that takes the listening socket out of the epoll set. It has to be
+ * taken out before it is closed, as the server that takes over from us keeps
+ * it open and it would stay in the set.
+ */
+void epollStopAccepting(struct worker *worker) {
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, worker->sockfd, NULL);
+}
+
+/* A method that takes a connection out of the epoll set, for the same reason.
+ * Returns 0, as epoll has nothing in progress for a connection.
+ */
+int epollRelease(struct worker *worker, struct connection *conn) {
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->connfd, NULL);
+    return 0;
+}
+
+/* A method that tears down the io_uring of a worker, as far as it was set up. */
+void uringStop(struct uring *ring) {
+    int error = errno;
+    if(ring->bufferData != NULL) {
+        free(ring->bufferData);
+    }
+    if(ring->buffers != NULL) {
+        munmap(ring->buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if(ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqEntries * sizeof(struct io_uring_sqe));
+    }
+    if(ring->cqRing != NULL && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if(ring->sqRing != NULL) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if(ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    errno = error;
+}
+
+/* A method that hands the submissions that have been queued to the kernel.
+ * Returns 0 on success and -1 on failure.
+ */
+int uringSubmit(struct uring *ring) {
+    __atomic_store_n(ring->sqTailShared, ring->sqTail, __ATOMIC_RELEASE);
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->sqTail - ring->submitted, 0, 0, NULL, 0);
+    if(n == -1) {
+        return -1;
+    }
+    ring->submitted += (unsigned) n;
+    return 0;
+}
+
+/* A method that makes sure there is room for count more submissions, by
+ * handing those that are queued to the kernel if there is not.
+ * Returns 0 on success and -1 if there is no room.
+ */
+int uringReserve(struct uring *ring, unsigned count) {
+    if(ring->sqEntries - (ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) >= count) {
+        return 0;
+    }
+    if(uringSubmit(ring) == -1) {
+        return -1;
+    }
+    return ring->sqEntries - (ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) >= count ? 0 : -1;
+}
+
+/* A method that takes the next free submission from the ring, cleared.
+ * Returns NULL if the ring is full and can not be handed to the kernel.
+ */
+struct io_uring_sqe *uringSqe(struct uring *ring) {
+    if(uringReserve(ring, 1) == -1) {
+        return NULL;
+    }
+    unsigned index = ring->sqTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqTail++;
+    return sqe;
+}
+
+/* A method that makes the user data of a completion for a connection. The
+ * generation tells it apart from a later connection with the same fd.
+ */
+uint64_t uringData(enum uringKind kind, struct connection *conn) {
+    return (uint64_t) kind | (uint64_t) conn->connfd << URING_KIND_BITS | (uint64_t) conn->generation << 32;
+}
+
+/* A method that gives a buffer back to the ring the kernel receives into. */
+void uringRecycle(struct uring *ring, unsigned id) {
+    struct io_uring_buf *buffer = &ring->buffers->bufs[ring->bufferTail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->bufferData + (size_t) id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = (unsigned short) id;
+    ring->bufferTail++;
+    __atomic_store_n(&ring->buffers->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+/* A method that has the kernel accept connections on the listening socket of
+ * a worker until it is told otherwise, with a single multishot accept.
+ * Returns 0 on success and -1 on failure.
+ */
+int uringAccept(struct worker *worker) {
+    struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+    if(sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+    return 0;
+}
+
+/* A method that sets up the io_uring engine of a worker: the rings it shares
+ * with the kernel, a ring of buffers to receive into and the accept on the
+ * listening socket. The rings are set up for a single thread whose
+ * completions are only run when it waits for them, if the kernel knows how.
+ * Returns -1 if the kernel can not run the engine: io_uring is missing or
+ * turned off, or is older than 5.19, which brought both the buffer rings and
+ * multishot accept.
+ */
+int uringStart(struct worker *worker) {
+    struct uring *ring = &worker->ring;
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(ring->fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if(ring->fd == -1) {
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        uringStop(ring);
+        return -1;
+    }
+
+    /* Map the rings, which are one mapping on kernels that allow it. */
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        uringStop(ring);
+        return -1;
+    }
+    ring->cqRing = ring->sqRing;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            uringStop(ring);
+            return -1;
+        }
+    }
+    ring->sqEntries = params.sq_entries;
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uringStop(ring);
+        return -1;
+    }
+    char *sq = ring->sqRing;
+    char *cq = ring->cqRing;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTailShared = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqTail = *ring->sqTailShared;
+    ring->submitted = ring->sqTail;
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* The buffers the kernel picks from when input arrives, so no memory is
+     * tied up in a receive until there is something to receive.
+     */
+    ring->buffers = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        uringStop(ring);
+        return -1;
+    }
+    ring->bufferData = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if(ring->bufferData == NULL || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        uringStop(ring);
+        return -1;
+    }
+    unsigned i;
+    for(i = 0; i < URING_BUFFERS; i++) {
+        uringRecycle(ring, i);
+    }
+
+    if(uringAccept(worker) == -1) {
+        uringStop(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/* A method that hands what has been queued to the kernel and waits until at
+ * least one operation has completed, or for at most timeout milliseconds.
+ * Returns the number of completions, or -1 on failure.
+ */
+int uringWait(struct worker *worker, int timeout) {
+    struct uring *ring = &worker->ring;
+    __atomic_store_n(ring->sqTailShared, ring->sqTail, __ATOMIC_RELEASE);
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+    unsigned ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->sqTail - ring->submitted, ready > 0 ? 0 : 1,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(n > 0) {
+        ring->submitted += (unsigned) n;
+    }
+    if(n == -1 && errno != ETIME) {
+        return -1;
+    }
+    return (int) (__atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead);
+}
+
+/* A method that asks the kernel to tell us when a connection can be written
+ * to again, for when the socket is full.
+ * Returns 0 on success and -1 if the connection has been closed.
+ */
+int uringPoll(struct worker *worker, struct connection *conn) {
+    struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+    if(sqe == NULL) {
+        closeConnection(&worker->connections, conn);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->connfd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = uringData(URING_POLL, conn);
+    conn->polling = 1;
+    return 0;
+}
+
+/* A method that goes on writing the output queue of a connection, unless the
+ * kernel is still busy with it. The pieces in memory are sent as a chain of
+ * linked sends, which the kernel runs in order and stops at the first that
+ * falls short; the rest is sent again once the whole chain has completed.
+ * io_uring can not send a file, so a queue that starts with one is written
+ * as epoll writes it, with sendfile(), and polled for when the socket is full.
+ * Once everything has been written the connection gives back its in-flight
+ * slot, or is closed if it was waiting for that.
+ * Returns 0 if the connection is open and -1 if it has been closed.
+ */
+int uringWrite(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    if(conn->sending > 0 || conn->polling) {
+        return 0;
+    }
+    while(conn->outputHead != NULL && conn->outputHead->fd == -1 && conn->outputHead->offset == conn->outputHead->length) {
+        struct outputBuffer *next = conn->outputHead->next;
+        freeOutputBuffer(conn->outputHead);
+        conn->outputHead = next;
+    }
+    if(conn->outputHead == NULL) {
+        conn->outputTail = NULL;
+    }
+    if(conn->writeError) {
+        closeConnection(table, conn);
+        return -1;
+    }
+    if(conn->sendBlocked) {
+        conn->sendBlocked = 0;
+        return uringPoll(worker, conn);
+    }
+    if(conn->outputHead != NULL && conn->outputHead->fd != -1) {
+        int result = flushOutput(conn);
+        if(result == -1) {
+            closeConnection(table, conn);
+            return -1;
+        }
+        if(result == 1) {
+            return uringPoll(worker, conn);
+        }
+    }
+
+    if(conn->outputHead != NULL) {
+        unsigned count = 0;
+        struct outputBuffer *buffer;
+        for(buffer = conn->outputHead; buffer != NULL && buffer->fd == -1 && count < IOV_BATCH; buffer = buffer->next) {
+            count++;
+        }
+        /* The whole chain goes to the kernel at once, or it would not be linked. */
+        if(uringReserve(&worker->ring, count) == -1) {
+            closeConnection(table, conn);
+            return -1;
+        }
+        struct io_uring_sqe *previous = NULL;
+        for(buffer = conn->outputHead; count > 0; buffer = buffer->next, count--) {
+            struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->connfd;
+            sqe->addr = (uint64_t) (uintptr_t) (buffer->data + buffer->offset);
+            sqe->len = (unsigned) (buffer->length - buffer->offset);
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = (uint64_t) (uintptr_t) buffer | URING_SEND;
+            if(previous != NULL) {
+                previous->flags |= IOSQE_IO_LINK;
+            }
+            previous = sqe;
+            buffer->owner = conn;
+            buffer->inFlight = 1;
+            conn->sending++;
+        }
+        return 0;
+    }
+    if(conn->closing) {
+        lingerConnection(table, conn);
+        return -1;
+    }
+    releaseSlot(table, conn);
+    return 0;
+}
+
+/* A method that asks the kernel for the next input of a connection, which
+ * goes into a buffer from the ring and is then copied to the end of its input
+ * buffer. So a connection that waits for input needs no input buffer of its
+ * own until the input is there. As with epoll nothing is read while the
+ * connection waits for an in-flight slot or for the client to read what it
+ * has been sent. Returns 0 if the connection is open and -1 if it has been closed.
+ */
+int uringReceive(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    if(conn->receiving || conn->closing || conn->parked || conn->outputQueued > OUTPUT_HIGH_WATER) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+    if(sqe == NULL) {
+        closeConnection(table, conn);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->connfd;
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uringData(URING_RECEIVE, conn);
+    conn->receiving = 1;
+    return 0;
+}
+
+/* A method that goes on with a connection: it handles the input that has
+ * arrived, sends what that queued and asks for more input. Input that was
+ * held back because too much output was queued is handled once the output
+ * that could be written right away has brought the queue down.
+ */
+void uringResume(struct worker *worker, struct connection *conn) {
+    struct connectionTable *table = &worker->connections;
+    int fd = conn->connfd;
+    int held;
+    do {
+        if(!conn->parked && !conn->closing && conn->outputQueued <= OUTPUT_HIGH_WATER && conn->inputStart < conn->inputLength) {
+            handleInput(worker, conn);
+            if(table->slots[fd] != conn) {
+                return;
+            }
+        }
+        held = conn->outputQueued > OUTPUT_HIGH_WATER;
+        if(uringWrite(worker, conn) == -1) {
+            return;
+        }
+    } while(held && conn->outputQueued <= OUTPUT_HIGH_WATER && conn->inputStart < conn->inputLength);
+    releaseBuffers(&table->pool, conn);
+    uringReceive(worker, conn);
+}
+
+/* A method that starts on a new connection with io_uring: its output is only
+ * queued from now on, and the first receive is asked for. A connection the
+ * kernel can not be asked about is closed right away.
+ */
+int uringWatch(struct worker *worker, struct connection *conn) {
+    conn->queueOutput = 1;
+    uringReceive(worker, conn);
+    return 0;
+}
+
+/* A method that asks the kernel to stop the multishot accept. The connections
+ * it accepts before it stops are taken on as usual.
+ */
+void uringStopAccepting(struct worker *worker) {
+    struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_ACCEPT;
+        sqe->user_data = URING_CANCEL;
+    }
+}
+
+/* A method that asks the kernel to stop receiving for an idle connection.
+ * Returns 0 once it has stopped and -1 until then.
+ */
+int uringRelease(struct worker *worker, struct connection *conn) {
+    if(!conn->receiving) {
+        return 0;
+    }
+    if(!conn->cancelling) {
+        struct io_uring_sqe *sqe = uringSqe(&worker->ring);
+        if(sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uringData(URING_RECEIVE, conn);
+            sqe->user_data = URING_CANCEL;
+            conn->cancelling = 1;
+        }
+    }
+    return -1;
+}
+
+/* A method that handles a connection the multishot accept has accepted. Its
+ * address is looked up afterwards, as there is nowhere to put the address of
+ * each connection. The accept is asked for again if the kernel has stopped it,
+ * unless we have stopped it ourselves and closed the listening socket.
+ */
+void uringAccepted(struct worker *worker, int res, unsigned flags) {
+    if(!(flags & IORING_CQE_F_MORE) && worker->sockfd != -1 && uringAccept(worker) == -1) {
+        perror("io_uring accept");
+    }
+    if(res < 0) {
+        if(res == -EMFILE || res == -ENFILE) {
+            shedWithSpare(worker);
+        }
+        else if(res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+            fprintf(stderr, "accept(): %s\n", strerror(-res));
+        }
+        return;
+    }
+    struct sockaddr_in client;
+    socklen_t len = (socklen_t) sizeof(client);
+    if(getpeername(res, (struct sockaddr *) &client, &len) == -1) {
+        close(res);
+        return;
+    }
+    openConnection(worker, res, &client);
+}
+
+/* A method that handles input the kernel has received for a connection, which
+ * may have been closed since, in which case only the buffer is given back.
+ * The input buffer of the connection is made large enough for it first.
+ */
+void uringReceived(struct worker *worker, struct connection *conn, int res, unsigned flags) {
+    struct uring *ring = &worker->ring;
+    struct connectionTable *table = &worker->connections;
+    int tooLarge = 0;
+    if(flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(conn != NULL && res > 0) {
+            if(reserveInput(&table->pool, conn, (size_t) res) == -1) {
+                tooLarge = 1;
+            }
+            else {
+                memcpy(conn->input + conn->inputLength, ring->bufferData + (size_t) id * URING_BUFFER_SIZE, (size_t) res);
+                conn->inputLength += (unsigned) res;
+                addStat(&worker->stats.bytesIn, (size_t) res);
+            }
+        }
+        uringRecycle(ring, id);
+    }
+    if(conn == NULL) {
+        return;
+    }
+    conn->receiving = 0;
+    conn->cancelling = 0;
+    if(tooLarge) {
+        int fd = conn->connfd;
+        handleError(conn, 431);
+        closeWhenWritten(table, conn);
+        if(table->slots[fd] == conn) {
+            uringWrite(worker, conn);
+        }
+        return;
+    }
+    /* The ring ran out of buffers, which are given back within a batch, so
+     * the receive is simply asked for again. One that we stopped is left as
+     * it is, the connection is about to be handed over.
+     */
+    if(res == -ECANCELED) {
+        return;
+    }
+    if(res > 0 || res == -ENOBUFS) {
+        uringResume(worker, conn);
+    }
+    /* The client is done sending, what we still owe it is written before we close. */
+    else if(res == 0) {
+        int fd = conn->connfd;
+        closeWhenWritten(table, conn);
+        if(table->slots[fd] == conn) {
+            uringWrite(worker, conn);
+        }
+    }
+    else {
+        closeConnection(table, conn);
+    }
+}
+
+/* A method that handles a send that has completed. The connection goes on
+ * once the whole chain the send was part of has completed. A send whose
+ * connection has been closed in the meantime only has its piece freed.
+ */
+void uringSent(struct worker *worker, struct outputBuffer *buffer, int res) {
+    struct connection *conn = buffer->owner;
+    buffer->inFlight = 0;
+    if(conn == NULL) {
+        freeOutputBuffer(buffer);
+        return;
+    }
+    conn->sending -= 1;
+    if(res > 0) {
+        buffer->offset += (size_t) res;
+        conn->outputQueued -= (size_t) res;
+        addStat(&conn->stats->bytesOut, (size_t) res);
     }
-    /* Error. */
-    else {
+    else if(res == -EAGAIN) {
+        conn->sendBlocked = 1;
+    }
+    else if(res != -ECANCELED) {
+        conn->writeError = 1;
+    }
+    if(conn->sending == 0) {
+        uringResume(worker, conn);
     }
+}
 
-    /* Write info to screen. */
-    fprintf(stdout, "%s : %s:%d %s\n%s : %d\n", buf, inet_ntoa(client.sin_addr), client.sin_port, requestMethod, requestURL, 200);
-    fflush(stdout);
-    /* Write info to file. */
-    fprintf(fp, "%s : %s:%d %s\n%s : %d\n", buf, inet_ntoa(client.sin_addr), client.sin_port, requestMethod, requestURL, 200);
-    fflush(fp);
+/* A method that handles the completions that have arrived, in order. Each one
+ * is taken off the ring before it is handled, so the kernel can reuse its
+ * place while we work.
+ */
+void uringDispatch(struct worker *worker, int count) {
+    struct uring *ring = &worker->ring;
+    struct connectionTable *table = &worker->connections;
+    unsigned head = *ring->cqHead;
+    int i;
+    for(i = 0; i < count; i++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+        enum uringKind kind = (enum uringKind) (data & ((1 << URING_KIND_BITS) - 1));
+        if(kind == URING_ACCEPT) {
+            uringAccepted(worker, res, flags);
+            continue;
+        }
+        if(kind == URING_CANCEL) {
+            continue;
+        }
+        struct connection *conn;
+        int fd;
+        if(kind == URING_SEND) {
+            struct outputBuffer *buffer = (struct outputBuffer *) (uintptr_t) (data & ~(uint64_t) ((1 << URING_KIND_BITS) - 1));
+            conn = buffer->owner;
+            fd = conn != NULL ? conn->connfd : -1;
+            uringSent(worker, buffer, res);
+        }
+        else {
+            fd = (int) ((uint32_t) data >> URING_KIND_BITS);
+            conn = fd < table->capacity ? table->slots[fd] : NULL;
+            if(conn != NULL && conn->generation != (unsigned) (data >> 32)) {
+                conn = NULL;
+            }
+            if(kind == URING_RECEIVE) {
+                uringReceived(worker, conn, res, flags);
+            }
+            else if(conn != NULL) {
+                conn->polling = 0;
+                uringResume(worker, conn);
+            }
+        }
+        /* The connection made progress, so its timeout starts over. */
+        if(conn != NULL && table->slots[fd] == conn) {
+            updateTimeout(table, conn);
+        }
+    }
 }
 
-int main(int argc, char **argv) {
-    /* Create filepointer for log file */
-    FILE *fp;
-    fprintf(stdout, "SERVER INITIALIZING -- %d C00L 4 SCH00L!\n", argc);
-    fflush(stdout);
-    /* Create sockfd */
-    int sockfd;
-    /* Create a sockaddress for server and client */
-    struct sockaddr_in server, client;
-    /* Create a message of size MESSAGE_LENGTH to store message from client */
-    char message[MESSAGE_LENGTH];
-    /* Create and get current time for use with persistence */
-    time_t currTime;
-    time(&currTime);
-    /* Struct an array of connections where we will store connections for parallel */
-    struct connection connections[NUMBER_OF_CONNECTIONS];
-    
-    /* Initialize connections fd's as -1 to know they're not set later, also 
-     * initialize their persistence setting to false (keepalive = false).
-     */
-    int i = 0;
-    for(i; i < NUMBER_OF_CONNECTIONS; i++){
-        connections[i].connfd = -1;
-        connections[i].keepAlive = 0;
+/* A method that finds an event engine by name. Returns NULL if there is none. */
+const struct eventEngine *findEngine(const char *name) {
+    static const struct eventEngine engines[] = {
+        { "epoll", epollStart, epollWait, epollDispatch, epollWatch, epollResume, epollStopAccepting, epollRelease },
+        { "io_uring", uringStart, uringWait, uringDispatch, uringWatch, uringResume, uringStopAccepting, uringRelease },
+    };
+    size_t i;
+    for(i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if(strcmp(engines[i].name, name) == 0) {
+            return &engines[i];
+        }
+    }
+    return NULL;
+}
+
+/* A method that writes a whole buffer to a file descriptor. */
+void writeAll(int fd, const char *data, size_t length) {
+    while(length > 0) {
+        ssize_t n = write(fd, data, length);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return;
+        }
+        data += n;
+        length -= (size_t) n;
+    }
+}
+
+/* A method that opens the log file for appending and finds how large it is. */
+void openLog(struct logger *logger) {
+    logger->fd = open(logger->path, O_WRONLY | O_APPEND | O_CREAT | (logger->tracing ? O_TRUNC : 0), 0644);
+    struct stat st;
+    logger->size = (logger->fd != -1 && fstat(logger->fd, &st) == 0) ? (long) st.st_size : 0;
+}
+
+/* A method that rotates the log file once it has grown past maxSize:
+ * httpd.log becomes httpd.log.1, httpd.log.1 becomes httpd.log.2 and so on,
+ * up to LOG_ROTATIONS old files, and a new httpd.log is started.
+ */
+void rotateLog(struct logger *logger) {
+    if(logger->maxSize <= 0 || logger->size < logger->maxSize) {
+        return;
+    }
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    int i;
+    for(i = LOG_ROTATIONS - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), "%s.%d", logger->path, i);
+        snprintf(to, sizeof(to), "%s.%d", logger->path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", logger->path);
+    rename(logger->path, to);
+    close(logger->fd);
+    openLog(logger);
+}
+
+/* A method that moves as much as fits of a worker's log ring into the batch
+ * and returns the new length of the batch. Since the worker only publishes
+ * whole lines, the batch always ends with a whole line.
+ */
+size_t drainLogRing(struct logRing *ring, char batch[], size_t length) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t available = tail - head;
+    if(available > LOG_BATCH_SIZE - length) {
+        /* Take only whole lines so a line is never split between batches. */
+        available = LOG_BATCH_SIZE - length;
+        while(available > 0 && ring->data[(head + available - 1) & (LOG_RING_SIZE - 1)] != '\n') {
+            available--;
+        }
+    }
+    size_t offset = head & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset < available ? LOG_RING_SIZE - offset : available;
+    memcpy(batch + length, ring->data + offset, first);
+    memcpy(batch + length + first, ring->data, available - first);
+    /* Hand the space back to the worker only once it has been copied. */
+    atomic_store_explicit(&ring->head, head + available, memory_order_release);
+    return length + available;
+}
+
+/* The log writer thread. Every LOG_FLUSH_INTERVAL milliseconds it collects
+ * the lines from all the workers' rings into one batch and writes it with a
+ * single write() to the log file, and to stdout unless that is turned off. If
+ * lines were dropped since the last round, a line saying how many is added.
+ * When the server stops, one last round writes out what is left.
+ */
+void *runLogger(void *arg) {
+    struct logger *logger = (struct logger *) arg;
+    char *batch = logger->batch;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+    for(;;) {
+        int stopping = atomic_load(&logger->stopping);
+        size_t length = 0;
+        unsigned long dropped = 0;
+        int i;
+        for(i = 0; i < logger->numberOfRings; i++) {
+            length = drainLogRing(&logger->rings[i], batch, length);
+            dropped += atomic_load_explicit(&logger->rings[i].dropped, memory_order_relaxed);
+        }
+        if(dropped > logger->reportedDrops && length + LOG_LINE_LENGTH <= LOG_BATCH_SIZE) {
+            if(logger->tracing) {
+                length += (size_t) snprintf(batch + length, LOG_LINE_LENGTH, "{\"dropped\":%lu}\n", dropped - logger->reportedDrops);
+            }
+            else {
+                length += (size_t) snprintf(batch + length, LOG_LINE_LENGTH, "log ring full : %lu lines dropped\n", dropped - logger->reportedDrops);
+            }
+            logger->reportedDrops = dropped;
+        }
+        if(length > 0) {
+            if(logger->toStdout) {
+                writeAll(STDOUT_FILENO, batch, length);
+            }
+            writeAll(logger->fd, batch, length);
+            logger->size += (long) length;
+            rotateLog(logger);
+        }
+        if(stopping && length < LOG_BATCH_SIZE / 2) {
+            break;
+        }
+        /* Go again right away if the batch was full, otherwise sleep. */
+        if(length < LOG_BATCH_SIZE / 2) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+/* A method that creates a ring for each worker and the batch they are
+ * collected into, and starts a writer thread for them, once the file it
+ * writes to has been opened. The thread frees the batch when it is done.
+ * Returns 0 on success and an error number on failure.
+ */
+int startWriter(struct logger *logger, int numberOfRings) {
+    logger->numberOfRings = numberOfRings;
+    logger->rings = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct logRing) * numberOfRings);
+    logger->batch = malloc(LOG_BATCH_SIZE);
+    if(logger->rings == NULL || logger->batch == NULL) {
+        free(logger->rings);
+        free(logger->batch);
+        return ENOMEM;
+    }
+    memset(logger->rings, 0, sizeof(struct logRing) * numberOfRings);
+    return pthread_create(&logger->thread, NULL, runLogger, logger);
+}
+
+/* A method that creates the log rings and starts the log writer thread. */
+int startLogger(struct logger *logger, struct settings *settings) {
+    memset(logger, 0, sizeof(struct logger));
+    logger->path = LOG_PATH;
+    logger->toStdout = settings->logToStdout;
+    logger->maxSize = settings->maxLogSize;
+    openLog(logger);
+    return startWriter(logger, settings->numberOfWorkers);
+}
+
+/* A method that creates the trace rings and starts the thread that writes the
+ * trace. A trace starts out empty, as its times only make sense within one run.
+ * The line that reports dropped records is a record of its own.
+ */
+int startTracer(struct logger *tracer, struct settings *settings) {
+    memset(tracer, 0, sizeof(struct logger));
+    tracer->path = settings->tracePath;
+    tracer->tracing = 1;
+    openLog(tracer);
+    if(tracer->fd == -1) {
+        return errno;
     }
+    return startWriter(tracer, settings->numberOfWorkers);
+}
 
-    /* Create and bind a UDP socket */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    /* Clear anything that might have left in server */
+/* A method that creates a listening socket for the port of the server. Every
+ * worker calls this for itself; SO_REUSEPORT lets the kernel spread new
+ * connections over all the workers' sockets without any shared accept lock.
+ * With deferAccept a connection is only accepted once the client has sent
+ * something, or deferAccept seconds have passed, so a worker is not woken up
+ * for a connection it can not do anything with yet. With fastOpen a client
+ * that has been here before may send its request along with the SYN, and up
+ * to fastOpen such connections wait for their handshake to finish.
+ * Returns the socket, or -1 on failure.
+ */
+int createListener(struct settings *settings) {
+    /* Create and bind a TCP socket */
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1) {
+        return -1;
+    }
+    int on = 1;
+    /* Create a sockaddress for the server and clear anything that might have left in it */
+    struct sockaddr_in server;
     memset(&server, 0, sizeof(server));
     server.sin_family = AF_INET;
     /* Network functions need arguments in network byte order instead of
      * host byte order. The macros htonl, htons convert the values, 
      */
     server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(atoi(argv[1]));
-    bind(sockfd, (struct sockaddr *) &server, (socklen_t) sizeof(server));
+    server.sin_port = htons(atoi(settings->port));
+
+    /* Before we can accept messages, we have to listen to the port. */
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+       || setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+       || bind(sockfd, (struct sockaddr *) &server, (socklen_t) sizeof(server)) == -1
+       || listen(sockfd, settings->backlog) == -1
+       || (settings->deferAccept > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &settings->deferAccept, sizeof(settings->deferAccept)) == -1)
+       || (settings->fastOpen > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &settings->fastOpen, sizeof(settings->fastOpen)) == -1)) {
+        int error = errno;
+        close(sockfd);
+        errno = error;
+        return -1;
+    }
+    return sockfd;
+}
+
+/* A method that sets up a queue of file descriptors. */
+void initDescriptorQueue(struct descriptorQueue *queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->fds = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+/* A method that adds a file descriptor to a queue, and wakes the thread that
+ * waits for it, if any. Returns 0 on success and -1 if we are out of memory.
+ */
+int pushDescriptor(struct descriptorQueue *queue, int fd) {
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count == queue->capacity) {
+        int capacity = queue->capacity > 0 ? queue->capacity * 2 : HANDOFF_BATCH;
+        int *fds = realloc(queue->fds, sizeof(int) * (size_t) capacity);
+        if(fds == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        queue->fds = fds;
+        queue->capacity = capacity;
+    }
+    queue->fds[queue->count] = fd;
+    queue->count += 1;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/* A method that takes up to max file descriptors from a queue, the oldest
+ * first, without waiting. The lock must be held.
+ * Returns the number taken.
+ */
+int takeDescriptors(struct descriptorQueue *queue, int *fds, int max) {
+    int count = queue->count < max ? queue->count : max;
+    memcpy(fds, queue->fds, sizeof(int) * (size_t) count);
+    memmove(queue->fds, queue->fds + count, sizeof(int) * (size_t) (queue->count - count));
+    queue->count -= count;
+    return count;
+}
+
+/* A method that sends file descriptors to another process over a Unix socket,
+ * with SCM_RIGHTS, so it gets its own copies of them.
+ * Returns 0 on success and -1 on failure.
+ */
+int sendDescriptors(int sock, enum handoffKind kind, int total, const int *fds, int count) {
+    struct handoffMessage message = { kind, total };
+    struct iovec iov = { &message, sizeof(message) };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    memset(control, 0, sizeof(control));
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if(count > 0) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t) count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t) count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t) count);
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &header, MSG_NOSIGNAL);
+    } while(n == -1 && errno == EINTR);
+    return n == (ssize_t) sizeof(message) ? 0 : -1;
+}
+
+/* A method that receives a message with file descriptors sent by
+ * sendDescriptors(), at most HANDOFF_BATCH of them.
+ * Returns the number of file descriptors, 0 if the other process is done and
+ * -1 on failure.
+ */
+int receiveDescriptors(int sock, struct handoffMessage *message, int *fds) {
+    struct iovec iov = { message, sizeof(*message) };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+    } while(n == -1 && errno == EINTR);
+    if(n <= 0) {
+        return (int) n;
+    }
+    int count = 0;
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (size_t) count);
+        }
+    }
+    if(n != (ssize_t) sizeof(*message) || (header.msg_flags & MSG_CTRUNC) || count == 0) {
+        while(count > 0) {
+            close(fds[--count]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return count;
+}
+
+/* A method that creates the Unix socket at path that the next server connects
+ * to in order to take over from us. A socket left there by a server that is
+ * gone, or that has handed over to us, is replaced.
+ * Returns the socket, or -1 on failure.
+ */
+int createHandoffSocket(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return -1;
+    }
+    unlink(path);
+    if(bind(sock, (struct sockaddr *) &address, (socklen_t) sizeof(address)) == -1 || listen(sock, 1) == -1) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
+}
+
+/* A method that takes over from a server running with the same handoff socket,
+ * if there is one: it connects to it and receives its listening sockets.
+ * Returns the number of listening sockets, which are put in a new array in
+ * listeners, 0 if there is no server to take over from and -1 on failure.
+ */
+int takeOver(struct handoff *handoff, int **listeners) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", handoff->path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return -1;
+    }
+    if(connect(sock, (struct sockaddr *) &address, (socklen_t) sizeof(address)) == -1) {
+        close(sock);
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+    int *fds = NULL;
+    int count = 0;
+    int total = 1;
+    while(count < total) {
+        struct handoffMessage message;
+        int batch[HANDOFF_BATCH];
+        int n = receiveDescriptors(sock, &message, batch);
+        int *grown = n > 0 && message.kind == HANDOFF_LISTENERS && message.total >= count + n ? realloc(fds, sizeof(int) * (size_t) message.total) : NULL;
+        if(grown == NULL) {
+            while(n > 0) {
+                close(batch[--n]);
+            }
+            while(count > 0) {
+                close(fds[--count]);
+            }
+            free(fds);
+            close(sock);
+            errno = EPROTO;
+            return -1;
+        }
+        fds = grown;
+        memcpy(fds + count, batch, sizeof(int) * (size_t) n);
+        count += n;
+        total = message.total;
+    }
+    handoff->peerfd = sock;
+    *listeners = fds;
+    return count;
+}
+
+/* A method that hands the idle connections that the server we took over from
+ * sends us to the workers, in turn, until it is done and closes the socket.
+ */
+void adoptFromPeer(struct settings *settings) {
+    struct handoff *handoff = settings->handoff;
+    int next = 0;
+    for(;;) {
+        struct handoffMessage message;
+        int fds[HANDOFF_BATCH];
+        int n = receiveDescriptors(handoff->peerfd, &message, fds);
+        if(n <= 0) {
+            break;
+        }
+        int i;
+        for(i = 0; i < n; i++) {
+            struct worker *worker = &settings->workers[next];
+            next = (next + 1) % settings->numberOfWorkers;
+            if(message.kind != HANDOFF_CONNECTIONS || pushDescriptor(&worker->adopted, fds[i]) == -1) {
+                close(fds[i]);
+                continue;
+            }
+            /* The worker may be waiting for events, this wakes it up. */
+            pthread_kill(worker->thread, SIGUSR1);
+        }
+    }
+    close(handoff->peerfd);
+    handoff->peerfd = -1;
+}
+
+/* A method that takes on the connections that were handed over to a worker,
+ * as if it had accepted them.
+ */
+void adoptConnections(struct worker *worker) {
+    struct descriptorQueue *queue = &worker->adopted;
+    for(;;) {
+        int fds[HANDOFF_BATCH];
+        pthread_mutex_lock(&queue->lock);
+        int count = takeDescriptors(queue, fds, HANDOFF_BATCH);
+        pthread_mutex_unlock(&queue->lock);
+        if(count == 0) {
+            return;
+        }
+        int i;
+        for(i = 0; i < count; i++) {
+            struct sockaddr_in client;
+            socklen_t len = (socklen_t) sizeof(client);
+            if(getpeername(fds[i], (struct sockaddr *) &client, &len) == -1) {
+                close(fds[i]);
+                continue;
+            }
+            openConnection(worker, fds[i], &client);
+        }
+    }
+}
+
+/* A method that tells if a connection is idle: it waits for its next request
+ * and has nothing of one read or queued.
+ */
+int isIdle(struct connection *conn) {
+    return !conn->closing && !conn->parked && !conn->inFlight && conn->inputLength == 0
+           && conn->bodyState == BODY_NONE && conn->outputHead == NULL;
+}
+
+/* A method that lets a worker wind down once the server is handed over. The
+ * first time it stops accepting and closes its listening socket, which the
+ * next server has by now. Then, and each time it is called again, the idle
+ * connections are taken out of the engine and the table and put in the idle
+ * queue, to be sent to the next server. The others are served as usual and go
+ * the same way once they are idle, or are closed.
+ * Returns the number of connections the worker still has.
+ */
+int drainWorker(struct worker *worker) {
+    struct connectionTable *table = &worker->connections;
+    struct handoff *handoff = worker->settings->handoff;
+    if(worker->sockfd != -1) {
+        worker->engine->stopAccepting(worker);
+        close(worker->sockfd);
+        worker->sockfd = -1;
+    }
+    int fd;
+    for(fd = 0; fd < table->capacity && table->count > 0; fd++) {
+        struct connection *conn = table->slots[fd];
+        if(conn == NULL || !isIdle(conn) || worker->engine->release(worker, conn) == -1) {
+            continue;
+        }
+        forgetConnection(table, conn);
+        if(pushDescriptor(&handoff->idle, fd) == -1) {
+            close(fd);
+        }
+    }
+    return table->count;
+}
+
+/* A method that hands the server over to the one that has connected to the
+ * handoff socket. It is sent the listening sockets first, so it accepts the
+ * connections from then on, including those in the backlog. Then the workers
+ * are told to drain and the idle connections they let go of are sent on as
+ * they come, until every worker has stopped.
+ * Returns 0 once the server has been handed over and -1 if the other server
+ * went away before it got the listening sockets.
+ */
+int handOver(struct settings *settings, int peer) {
+    struct handoff *handoff = settings->handoff;
+    struct descriptorQueue *queue = &handoff->idle;
+    int total = settings->numberOfWorkers;
+    int i;
+    for(i = 0; i < total; i += HANDOFF_BATCH) {
+        int fds[HANDOFF_BATCH];
+        int n = total - i < HANDOFF_BATCH ? total - i : HANDOFF_BATCH;
+        int j;
+        for(j = 0; j < n; j++) {
+            fds[j] = settings->workers[i + j].sockfd;
+        }
+        if(sendDescriptors(peer, HANDOFF_LISTENERS, total, fds, n) == -1) {
+            perror("handoff");
+            close(peer);
+            return -1;
+        }
+    }
+
+    atomic_store(&handoff->draining, 1);
+    for(i = 0; i < settings->numberOfWorkers; i++) {
+        pthread_kill(settings->workers[i].thread, SIGUSR1);
+    }
+    pthread_mutex_lock(&queue->lock);
+    for(;;) {
+        while(queue->count == 0 && handoff->workersLeft > 0) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        int fds[HANDOFF_BATCH];
+        int n = takeDescriptors(queue, fds, HANDOFF_BATCH);
+        if(n == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        /* If the other server is gone the connections are only closed. */
+        if(peer != -1 && sendDescriptors(peer, HANDOFF_CONNECTIONS, n, fds, n) == -1) {
+            perror("handoff");
+            close(peer);
+            peer = -1;
+        }
+        while(n > 0) {
+            close(fds[--n]);
+        }
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(peer != -1) {
+        close(peer);
+    }
+    return 0;
+}
+
+/* A method that is called by a worker that has stopped after the server was
+ * handed over.
+ */
+void leaveHandoff(struct handoff *handoff) {
+    pthread_mutex_lock(&handoff->idle.lock);
+    handoff->workersLeft -= 1;
+    pthread_cond_signal(&handoff->idle.changed);
+    pthread_mutex_unlock(&handoff->idle.lock);
+}
+
+/* The thread that hands the server over: it takes on the idle connections
+ * of the server we took over from, if any, and then waits for the next server
+ * to connect to the handoff socket. Once the server has been handed over the
+ * process is told to stop, as it would be with SIGTERM.
+ */
+void *runHandoff(void *arg) {
+    struct settings *settings = (struct settings *) arg;
+    struct handoff *handoff = settings->handoff;
+    if(handoff->peerfd != -1) {
+        adoptFromPeer(settings);
+    }
+    for(;;) {
+        int peer = accept4(handoff->listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if(peer == -1) {
+            if(errno != EINTR) {
+                perror("accept() on the handoff socket");
+            }
+            continue;
+        }
+        if(handOver(settings, peer) == 0) {
+            break;
+        }
+    }
+    close(handoff->listenfd);
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+/* A method that does nothing. It handles the signal that wakes a worker up
+ * to look at its adopted queue or at draining, which interrupts the wait for
+ * events.
+ */
+void wakeUp(int signal) {
+    (void) signal;
+}
+
+/* The event loop of a single worker. Each worker owns its listening socket,
+ * its epoll instance, its connection table, its log file and its counters,
+ * so nothing on the request path is shared with the other workers. Once the
+ * server has been handed over the loop ends when the last connection is gone.
+ */
+void *runWorker(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    struct handoff *handoff = worker->settings->handoff;
+
+    /* Only the workers are woken up with SIGUSR1. */
+    sigset_t wakeSignals;
+    sigemptyset(&wakeSignals);
+    sigaddset(&wakeSignals, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &wakeSignals, NULL);
 
-    /* Before we can accept messages, we have to listen to the port. We allow five
-     * ("NUMBER_OF_CONNECTIONS") connection to queue parallel.
+    /* Pin the worker to its own core so its connections stay cache-hot. */
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->id % cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    initHeadTemplate(worker);
+    initTimerWheel(&worker->connections.timers, worker->nowTick);
+    worker->connections.stats = &worker->stats;
+    worker->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* The text of a page that comes from a request is compressed in short
+     * runs, each with the stream reset, so it gets a small hash table that
+     * is quick to clear.
      */
-    listen(sockfd, NUMBER_OF_CONNECTIONS);
-    
-    for (;;) {
-        /* Create fd_set to store fd's */
-        fd_set rfds;
-        /* TimeVal for select timeout */
-        struct timeval tv;
-        /* Retval for return value from select */
-        int retval;
-        /* Clear the message of unwanted old bytes */
-        memset(message, 0, MESSAGE_LENGTH);
-
-        /* Check whether there is data on the socket fd. */
-        FD_ZERO(&rfds);
-        FD_SET(sockfd, &rfds);
-
-        /* Wait for five seconds in select() timeout. */
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-        /* Update current time for use with 30 second timeout for persistence */
-        time(&currTime);
-        /* Store the highest fd to know how far to check in select */
-        int highestFD = sockfd;
-        
-        /* Loop through all connections in list, check if they're connected
-         * and if they are check if their 30 second keep-alive time is up,
-         * if it is up: close the connection and reset the fd to -1 to know
-         * that now it's not in use.
-         * if 30 seconds from connection message: put it in the fd_set to
-         * so that select will cover it. Also put it as the highest fd if
-         * it is higher than the last connection or sockfd so that select
-         * will cover that far.
-         */
-        for(i = 0; i < NUMBER_OF_CONNECTIONS; i++){
-            if(connections[i].connfd != -1){
-                if((currTime - connections[i].startTime) > CONNECTION_TIME){
-                    shutdown(connections[i].connfd, SHUT_RDWR);
-                    close(connections[i].connfd);
-                    connections[i].connfd = -1;
-                }
+    int level = worker->settings->compressionLevel;
+    worker->deflaterReady = level > 0 && deflateInit2(&worker->deflater, level, Z_DEFLATED, -MAX_WBITS, RUN_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    /* Start the engine that was asked for, or epoll if the kernel can not run it. */
+    worker->engine = findEngine(worker->settings->engine);
+    if(worker->engine->start(worker) == -1) {
+        if(worker->id == 0) {
+            fprintf(stderr, "The %s engine is not available (%s), using epoll\n", worker->engine->name, strerror(errno));
+        }
+        worker->engine = findEngine("epoll");
+        if(worker->engine->start(worker) == -1) {
+            perror("epoll");
+            /* The server being handed over must not wait for us. */
+            if(handoff != NULL) {
+                leaveHandoff(handoff);
             }
-            if(connections[i].connfd != -1){
-                FD_SET(connections[i].connfd, &rfds);
-                if(highestFD < connections[i].connfd){
-                    highestFD = connections[i].connfd;
-                }
-            }        
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        /* Sleep until the next timer is due, or for IDLE_TIMEOUT if there are no timers. */
+        int timeout = IDLE_TIMEOUT;
+        unsigned long nextTick = nextTimerTick(&worker->connections.timers);
+        struct lingerQueue *lingering = &worker->connections.lingering;
+        if(lingering->count > 0) {
+            unsigned long lingerTick = lingering->expires[lingering->head];
+            nextTick = nextTick == 0 || lingerTick < nextTick ? lingerTick : nextTick;
+        }
+        if(nextTick != 0) {
+            timeout = nextTick > worker->nowTick ? (int) ((nextTick - worker->nowTick) * TIMER_TICK) : 0;
         }
-        
-        /* Scan all connections for data to be read, scan for 5 seconds */
-        retval = select(highestFD + 1, &rfds, NULL, NULL, &tv);
+        MARK_LOOP(worker->connections.phases, PHASE_WAIT);
+        int retval = worker->engine->wait(worker, timeout);
+        MARK_LOOP(worker->connections.phases, PHASE_WORK);
+
+        /* Refresh the cached time and close the connections whose timeout is up. */
+        updateTime(worker);
+        expireConnections(&worker->connections, worker->nowTick);
+        expireLingering(&worker->connections, 0);
 
         if (retval == -1) {
-            perror("select()");
+            if(errno != EINTR) {
+                perror(worker->engine->name);
+            }
         } else if (retval > 0) {
-            /* When retval is > 0 there is something to be read for any of 
-             * the connections or socfd. 
-             */
-            /* Open file. */
-            fp = fopen("src/httpd.log", "a+");
+            worker->engine->dispatch(worker, retval);
+            admitPending(worker);
+        } else if (nextTick == 0 && worker->id == 0 && worker->settings->logToStdout) {
+            /* There are no connections to be read from. */
+            char idle[] = "No message in five seconds\n";
+            write(STDOUT_FILENO, idle, sizeof(idle) - 1);
+        }
 
-            /* Copy to len, since recvfrom may change it. */
-            socklen_t len = (socklen_t) sizeof(client);
-            
-            /* Check if sockfd had data at select() */
-            if(FD_ISSET(sockfd, &rfds)) {
-                /* This means there is a new, unhandled connection ready 
-                 * to be dealt with so we accept it and store it in a temp
-                 * variable to be sure we can add it to our list later.
-                 */
-                int newconnfd = accept(sockfd, (struct sockaddr *) &client, &len);
-                
-                /* Loop through all connections and see if any one of them
-                 * can store our new connection.
-                 * If it there is room free in our list, store the connections
-                 * fd and give it a start time for persistence checking.
-                 * Also, give the temp variable for the new connection a
-                 * value of -1 to know later that the connection is being stored.
-                 * Break when we find an empty slot.
-                 */ 
-                for(i=0; i < NUMBER_OF_CONNECTIONS; i++){
-                    if(connections[i].connfd == -1){
-                        connections[i].connfd =  newconnfd;
-                        time(&connections[i].startTime);
-                        newconnfd = -1;
-                        break;
-                    }
-                }
-                /* Check if the temp connection was stored and if there was
-                 * no room: close the connection.
-                 */
-                if(newconnfd != -1) {
-                    shutdown(newconnfd, SHUT_RDWR);
-                    close(newconnfd);
-                }
-            }
-            
-            /*  Read/handle loop for connections */ 
-            for(i=0; i < NUMBER_OF_CONNECTIONS; i++){
-                /* Check if the connection is active */
-                if(connections[i].connfd != -1){
-                    /* Check if the connection has data ready to be read */
-                    if(FD_ISSET(connections[i].connfd, &rfds)){
-                        /* Clear old message contents */
-                        memset(message, 0, MESSAGE_LENGTH);
-                        /* Read from the connection */
-                        ssize_t n = read(connections[i].connfd, message, sizeof(message) - 1);
-                        message[n] = '\0';        
-                        /* If the message gotten from the connection has a size
-                         * larger than 0, check if it supposed to be persistent,
-                         * reset the start time of the connection so it can go 
-                         * another 30 seconds and send the message to our handler.
-                         */
-                        if(strlen(message) > 0) {
-                            connections[i].keepAlive = getPersistence(message);
-                            time(&connections[i].startTime);
-                            /* Handle the message's content, also send the
-                             * connections' fd, client, logfile and port of server.
-                             */
-                            handler(connections[i].connfd, client, fp, message, argv[1]);
-                        }
-                        else {
-                            /* Here the message size is 0 (or less) which we interpret
-                             * as the persistent connection telling us it is done with
-                             * sending us messages. Close the connection and reset its
-                             * slot in the connection list.
-                             */
-                            shutdown(connections[i].connfd, SHUT_RDWR);
-                            close(connections[i].connfd);
-                            connections[i].connfd = -1;
-                        }
+        if(atomic_load(&worker->adopted.count) > 0) {
+            adoptConnections(worker);
+        }
+        if(handoff != NULL && atomic_load(&handoff->draining) && drainWorker(worker) == 0) {
+            break;
+        }
+    }
+    expireLingering(&worker->connections, 1);
+    leaveHandoff(handoff);
+    return NULL;
+}
 
-                        /* Check if the connection should be kept alive and close it
-                         * if it isn't. 
-                         */
-                        if(connections[i].keepAlive == 0) {
-                            shutdown(connections[i].connfd, SHUT_RDWR);
-                            close(connections[i].connfd);
-                            connections[i].connfd = -1;
-                        }
+/* A method that prints how the server is meant to be started. */
+void usage(char *program) {
+    fprintf(stderr, "Usage: %s [-w workers] [-m max-body-size] [-q] [-r max-log-size] [-d document-root] [-b backlog] [-D seconds] [-F queue-length]\n"
+                    "       [-c max-connections] [-i max-in-flight] [-p max-pending] [-e engine] [-z level] [-Z min-size] [-C cache-size]\n"
+                    "       [-u handoff-socket] [-t trace-file] [-l rate] [-L connections] port\n", program);
+    fprintf(stderr, "  -w workers        number of worker threads, 0 means one per core (default 1)\n");
+    fprintf(stderr, "  -m max-body-size  largest request body in bytes that is accepted (default %ld)\n", MAX_BODY_SIZE);
+    fprintf(stderr, "  -q                do not write the access log to stdout\n");
+    fprintf(stderr, "  -r max-log-size   rotate the log file when it grows past this many bytes (default 0, never)\n");
+    fprintf(stderr, "  -d document-root  serve the files in this directory, other paths get the color page\n");
+    fprintf(stderr, "  -b backlog        length of the listen queue of each worker (default %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  -D seconds        accept a connection only once the client has sent something, or after this long (default 0, off)\n");
+    fprintf(stderr, "  -F queue-length   accept requests sent with the SYN from clients with a TCP Fast Open cookie (default 0, off)\n");
+    fprintf(stderr, "  -c max-connections connections per worker, more get a 503 (default 0, no limit)\n");
+    fprintf(stderr, "  -i max-in-flight  requests in progress per worker, more wait in the pending queue (default 0, no limit)\n");
+    fprintf(stderr, "  -p max-pending    requests per worker that may wait, more get a 503 (default %d)\n", MAX_PENDING);
+    fprintf(stderr, "  -e engine         event engine, epoll or io_uring, which falls back to epoll (default epoll)\n");
+    fprintf(stderr, "  -z level          gzip/deflate compression level, 0 means never compress (default %d)\n", COMPRESS_LEVEL);
+    fprintf(stderr, "  -Z min-size       smallest response in bytes that is compressed (default %d)\n", COMPRESS_MIN_SIZE);
+    fprintf(stderr, "  -C cache-size     bytes of compressed files each worker keeps (default %ld)\n", COMPRESS_CACHE_SIZE);
+    fprintf(stderr, "  -u handoff-socket Unix socket to take over the server running with it, and to hand over on\n");
+    fprintf(stderr, "  -t trace-file     capture every request to this file, for replay to send again\n");
+    fprintf(stderr, "  -l rate           requests per second each client address may make, in bursts of as many, more get a 429 (default 0, no limit)\n");
+    fprintf(stderr, "  -L connections    connections each client address may have open, more get a 429 (default 0, no limit)\n");
+}
 
-                    }
-                }
-            }
-            /* Close the logfile */
-            fclose(fp);
-        } else {
-            /* Select has no connections to be read from. */
-            fprintf(stdout, "No message in five seconds\n");
+int main(int argc, char **argv) {
+    fprintf(stdout, "SERVER INITIALIZING -- %d C00L 4 SCH00L!\n", argc);
+    fflush(stdout);
+
+    /* A client that goes away while we write to it must not kill the server,
+     * the failed write is handled where it happens instead.
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* SIGINT and SIGTERM are only taken by the main thread, with sigwait()
+     * below, so the threads started from here on must block them. So is
+     * SIGUSR2, which writes out the phases when they are traced.
+     */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+#ifdef PHASE_TRACING
+    sigaddset(&stopSignals, SIGUSR2);
+#endif
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    /* SIGUSR1 wakes a worker up from waiting for events. Only the workers
+     * unblock it, and its handler is installed without SA_RESTART, so the
+     * wait is interrupted.
+     */
+    sigset_t wakeSignals;
+    sigemptyset(&wakeSignals);
+    sigaddset(&wakeSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &wakeSignals, NULL);
+    struct sigaction wake;
+    memset(&wake, 0, sizeof(wake));
+    wake.sa_handler = wakeUp;
+    sigaction(SIGUSR1, &wake, NULL);
+
+    /* Parse the command line. */
+    struct settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.numberOfWorkers = 1;
+    settings.maxBodySize = MAX_BODY_SIZE;
+    settings.logToStdout = 1;
+    settings.backlog = LISTEN_BACKLOG;
+    settings.maxPending = MAX_PENDING;
+    settings.engine = "epoll";
+    settings.compressionLevel = COMPRESS_LEVEL;
+    settings.minCompressSize = COMPRESS_MIN_SIZE;
+    settings.compressCacheSize = COMPRESS_CACHE_SIZE;
+    struct handoff handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.listenfd = -1;
+    handoff.peerfd = -1;
+    initDescriptorQueue(&handoff.idle);
+    int opt;
+    while((opt = getopt(argc, argv, "w:m:qr:d:b:D:F:c:i:p:e:z:Z:C:u:t:l:L:")) != -1) {
+        switch(opt) {
+            case 'w':
+                settings.numberOfWorkers = atoi(optarg);
+                break;
+            case 'm':
+                settings.maxBodySize = atol(optarg);
+                break;
+            case 'q':
+                settings.logToStdout = 0;
+                break;
+            case 'r':
+                settings.maxLogSize = atol(optarg);
+                break;
+            case 'd':
+                settings.docRoot = optarg;
+                break;
+            case 'b':
+                settings.backlog = atoi(optarg);
+                break;
+            case 'D':
+                settings.deferAccept = atoi(optarg);
+                break;
+            case 'F':
+                settings.fastOpen = atoi(optarg);
+                break;
+            case 'c':
+                settings.maxConnections = atoi(optarg);
+                break;
+            case 'i':
+                settings.maxInFlight = atoi(optarg);
+                break;
+            case 'p':
+                settings.maxPending = atoi(optarg);
+                break;
+            case 'e':
+                settings.engine = optarg;
+                break;
+            case 'z':
+                settings.compressionLevel = atoi(optarg);
+                break;
+            case 'Z':
+                settings.minCompressSize = atol(optarg);
+                break;
+            case 'C':
+                settings.compressCacheSize = atol(optarg);
+                break;
+            case 'u':
+                handoff.path = optarg;
+                settings.handoff = &handoff;
+                break;
+            case 't':
+                settings.tracePath = optarg;
+                break;
+            case 'l':
+                settings.clientRate = atoi(optarg);
+                break;
+            case 'L':
+                settings.maxClientConnections = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    settings.port = argv[optind];
+    if(compilePageTemplate(&settings.getPage, GET_PAGE_TEMPLATE) != 0 || compilePageTemplate(&settings.postPage, POST_PAGE_TEMPLATE) != 0) {
+        fprintf(stderr, "Invalid page template\n");
+        return 1;
+    }
+    if(findEngine(settings.engine) == NULL || settings.compressionLevel < 0 || settings.compressionLevel > 9
+       || settings.clientRate < 0 || settings.maxClientConnections < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    initParser();
+    if(settings.clientRate > 0 || settings.maxClientConnections > 0) {
+        settings.clients = createClientTable(settings.clientRate, settings.maxClientConnections);
+        if(settings.clients == NULL) {
+            perror("createClientTable()");
+            return 1;
+        }
+    }
+    if(settings.compressionLevel > 0 && compressPageTemplate(&settings.getPage, settings.compressionLevel) != 0) {
+        fprintf(stderr, "Could not compress the page template\n");
+        return 1;
+    }
+    if(settings.docRoot != NULL) {
+        settings.docRootfd = open(settings.docRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(settings.docRootfd == -1) {
+            perror(settings.docRoot);
+            return 1;
+        }
+    }
+    if(settings.numberOfWorkers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        settings.numberOfWorkers = cores > 0 ? (int) cores : 1;
+    }
+
+    /* Take over the listening sockets of the server running with the same
+     * handoff socket, if there is one. Each of them needs a worker, or the
+     * connections in its backlog would be lost.
+     */
+    int *listeners = NULL;
+    int numberOfListeners = 0;
+    if(settings.handoff != NULL) {
+        numberOfListeners = takeOver(&handoff, &listeners);
+        if(numberOfListeners == -1) {
+            perror(handoff.path);
+            return 1;
+        }
+        if(numberOfListeners > 0) {
+            fprintf(stdout, "Taking over %d listening sockets\n", numberOfListeners);
             fflush(stdout);
         }
+        if(settings.numberOfWorkers < numberOfListeners) {
+            settings.numberOfWorkers = numberOfListeners;
+        }
+        handoff.listenfd = createHandoffSocket(handoff.path);
+        if(handoff.listenfd == -1) {
+            perror(handoff.path);
+            return 1;
+        }
+        handoff.workersLeft = settings.numberOfWorkers;
+    }
+    int numberOfWorkers = settings.numberOfWorkers;
+    settings.started = time(NULL);
+
+    /* Start the log writer, it owns the log file from here on. */
+    struct logger logger;
+    int error = startLogger(&logger, &settings);
+    if(error != 0) {
+        fprintf(stderr, "startLogger(): %s\n", strerror(error));
+        return 1;
+    }
+
+    /* Start the trace writer, if the requests are to be captured. */
+    struct logger tracer;
+    if(settings.tracePath != NULL) {
+        settings.traceStart = monotonicMicroseconds();
+        error = startTracer(&tracer, &settings);
+        if(error != 0) {
+            fprintf(stderr, "%s: %s\n", settings.tracePath, strerror(error));
+            return 1;
+        }
     }
+
+    /* Create the workers. Each one gets its own SO_REUSEPORT listening
+     * socket and log ring before any thread starts, so a port that cannot
+     * be bound shows up right away.
+     */
+    struct worker *workers = calloc(numberOfWorkers, sizeof(struct worker));
+    if(workers == NULL) {
+        perror("calloc()");
+        return 1;
+    }
+    settings.workers = workers;
+    int i;
+    for(i = 0; i < numberOfWorkers; i++) {
+        workers[i].id = i;
+        workers[i].settings = &settings;
+        workers[i].sockfd = i < numberOfListeners ? listeners[i] : createListener(&settings);
+        if(workers[i].sockfd == -1) {
+            fprintf(stderr, "Can not listen on port %s: %s\n", settings.port, strerror(errno));
+            return 1;
+        }
+        workers[i].log = &logger.rings[i];
+        workers[i].trace = settings.tracePath != NULL ? &tracer.rings[i] : NULL;
+#ifdef PHASE_TRACING
+        workers[i].connections.phases = calloc(1, sizeof(struct phaseRing));
+        if(workers[i].connections.phases == NULL) {
+            perror("calloc()");
+            return 1;
+        }
+#endif
+        initDescriptorQueue(&workers[i].adopted);
+    }
+    free(listeners);
+    for(i = 0; i < numberOfWorkers; i++) {
+        error = pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+        if(error != 0) {
+            /* Returning ends the process, and the workers that did start. */
+            fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+            return 1;
+        }
+    }
+    /* Without its thread the server still runs, but can not be handed over. */
+    if(settings.handoff != NULL) {
+        error = pthread_create(&handoff.thread, NULL, runHandoff, &settings);
+        if(error != 0) {
+            fprintf(stderr, "Can not hand over on %s: %s\n", handoff.path, strerror(error));
+        }
+    }
+
+    /* Wait until we are told to stop, then let the log writer write out the
+     * last lines, and the trace writer the last records, before the process exits.
+     */
+    int received;
+    sigwait(&stopSignals, &received);
+#ifdef PHASE_TRACING
+    while(received == SIGUSR2) {
+        dumpPhases(&settings);
+        sigwait(&stopSignals, &received);
+    }
+#endif
+    atomic_store(&logger.stopping, 1);
+    pthread_join(logger.thread, NULL);
+    if(settings.tracePath != NULL) {
+        atomic_store(&tracer.stopping, 1);
+        pthread_join(tracer.thread, NULL);
+    }
+    return 0;
 }
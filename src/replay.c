@@ -0,0 +1,741 @@
+/* A replay tool for traces captured with httpd -t.
+ *
+ * A trace has a JSON line for each piece of a request as httpd received it:
+ * when it arrived in microseconds, the worker and connection it arrived on,
+ * how many requests start in it and the bytes themselves. The pieces of each
+ * connection are sent again on a connection of their own, either at the speed
+ * they were recorded at, a multiple of it (-x 2 is twice as fast) or flat out
+ * (-x 0), in which case a connection sends its next request as soon as the
+ * responses to the ones before have arrived. At a given speed the latency of
+ * a response is measured from when its request was due, so a server that falls
+ * behind is not hidden by the tool waiting for it, and how late the tool
+ * itself was in sending is reported too.
+ *
+ * With -o the result is appended to a file as one JSON line, and with -b it
+ * is compared with the last line of such a file, i.e. one written by replaying
+ * the same trace against an earlier build.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "client.h"
+
+/* Macros */
+#define MAX_EVENTS 256
+#define REPLAY_TIMEOUT 10
+#define RESULT_LINE_LENGTH 4096
+
+/* A struct containing a piece of a request from the trace. time is in
+ * microseconds from the start of the trace, and headRequest tells if the
+ * first request that starts in the piece is a HEAD request, whose response
+ * has no body.
+ */
+struct traceRecord {
+    long time;
+    int worker;
+    unsigned connection;
+    long line;
+    int requests;
+    int headRequest;
+    char *data;
+    size_t length;
+};
+
+/* A struct containing a response that is waited for: when its request was
+ * sent, or was due, and whether the request was a HEAD request.
+ */
+struct pendingResponse {
+    long sentAt;
+    int headRequest;
+};
+
+/* A struct containing a connection of the trace that is replayed. Its records
+ * are sent in order, the next one up to offset so far. The responses it
+ * waits for are those from answered up to sent, out of the requests it sends
+ * in all. The reader only exists while the connection is open.
+ */
+struct replayConnection {
+    struct traceRecord *records;
+    int count;
+    int next;
+    size_t offset;
+    int fd;
+    int connecting;
+    struct pendingResponse *responses;
+    int requests;
+    int sent;
+    int answered;
+    struct responseReader *reader;
+};
+
+/* A struct containing the settings of a replay, shared read-only by the threads. */
+struct replaySettings {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    char *trace;
+    char *host;
+    char *port;
+    double speed;
+    int threads;
+    int maxConnections;
+    long start;
+};
+
+/* A struct containing a thread of the replay with its share of the
+ * connections, in the order they start, and what it has measured. nextOpen is
+ * the next connection to be opened and nextWake when the next record is due.
+ */
+struct replayThread {
+    pthread_t thread;
+    struct replaySettings *settings;
+    int epfd;
+    struct replayConnection **connections;
+    int numberOfConnections;
+    int nextOpen;
+    int open;
+    int done;
+    long nextWake;
+    long lastProgress;
+    unsigned long completed;
+    unsigned long errors;
+    unsigned long non2xx;
+    unsigned long bytesRead;
+    long maxLag;
+    struct histogram latency;
+};
+
+/* A method that finds the value of a key in a JSON line.
+ * Returns where the value starts, or NULL if the key is not there.
+ */
+char *findValue(char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    char *found = strstr(line, pattern);
+    return found != NULL ? found + strlen(pattern) : NULL;
+}
+
+/* A method that decodes a JSON string in place, with the escapes httpd writes
+ * and the others JSON has. Only characters up to \u00ff can be in a trace,
+ * as each stands for a byte. Returns the length of the bytes, or -1 if it is not
+ * a string of bytes.
+ */
+long decodeString(char *p) {
+    if(*p++ != '"') {
+        return -1;
+    }
+    char *out = p - 1;
+    char *start = out;
+    while(*p != '"') {
+        if(*p == '\0') {
+            return -1;
+        }
+        if(*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        p++;
+        switch(*p) {
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case '"': case '\\': case '/': *out++ = *p; break;
+            case 'u': {
+                char digits[5] = { 0 };
+                memcpy(digits, p + 1, 4);
+                char *end;
+                unsigned long value = strtoul(digits, &end, 16);
+                if(end != digits + 4 || value > 0xff) {
+                    return -1;
+                }
+                *out++ = (char) value;
+                p += 4;
+                break;
+            }
+            default:
+                return -1;
+        }
+        p++;
+    }
+    return (long) (out - start);
+}
+
+/* A method that orders records by the connection they belong to, and within
+ * a connection in the order they were written.
+ */
+int compareRecords(const void *a, const void *b) {
+    const struct traceRecord *x = a;
+    const struct traceRecord *y = b;
+    if(x->worker != y->worker) {
+        return x->worker < y->worker ? -1 : 1;
+    }
+    if(x->connection != y->connection) {
+        return x->connection < y->connection ? -1 : 1;
+    }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* A method that orders connections by when their first record arrived. */
+int compareConnections(const void *a, const void *b) {
+    const struct replayConnection *x = a;
+    const struct replayConnection *y = b;
+    return x->records[0].time < y->records[0].time ? -1 : x->records[0].time > y->records[0].time;
+}
+
+/* A method that reads a trace and splits it into its connections, which are
+ * ordered by when they start. Times are made to count from the first record.
+ * Returns the number of connections, or -1 if the trace can not be read.
+ */
+int loadTrace(const char *path, struct replayConnection **connections, unsigned long *dropped) {
+    FILE *in = fopen(path, "r");
+    if(in == NULL) {
+        perror(path);
+        return -1;
+    }
+    struct traceRecord *records = NULL;
+    long count = 0;
+    long capacity = 0;
+    long firstTime = LONG_MAX;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    long number = 0;
+    while(getline(&line, &lineCapacity, in) != -1) {
+        number++;
+        /* The keys are found by their first match, which is before the data. */
+        if(strncmp(line, "{\"dropped\":", 11) == 0) {
+            *dropped += strtoul(line + 11, NULL, 10);
+            continue;
+        }
+        char *time = findValue(line, "time");
+        char *worker = findValue(line, "worker");
+        char *connection = findValue(line, "connection");
+        char *requests = findValue(line, "requests");
+        char *data = findValue(line, "data");
+        long length = data != NULL ? decodeString(data) : -1;
+        if(time == NULL || worker == NULL || connection == NULL || requests == NULL || length == -1) {
+            fprintf(stderr, "%s:%ld: not a trace record\n", path, number);
+            fclose(in);
+            free(line);
+            return -1;
+        }
+        if(count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            records = realloc(records, sizeof(struct traceRecord) * (size_t) capacity);
+        }
+        struct traceRecord *record = &records[count++];
+        record->time = atol(time);
+        record->worker = atoi(worker);
+        record->connection = (unsigned) strtoul(connection, NULL, 10);
+        record->line = number;
+        record->requests = atoi(requests);
+        record->headRequest = record->requests > 0 && length >= 5 && memcmp(data, "HEAD ", 5) == 0;
+        record->data = malloc((size_t) length);
+        memcpy(record->data, data, (size_t) length);
+        record->length = (size_t) length;
+        if(record->time < firstTime) {
+            firstTime = record->time;
+        }
+    }
+    free(line);
+    fclose(in);
+
+    /* The records of a connection end up next to each other, in order. */
+    qsort(records, (size_t) count, sizeof(struct traceRecord), compareRecords);
+    int numberOfConnections = 0;
+    long i;
+    for(i = 0; i < count; i++) {
+        records[i].time -= firstTime;
+        if(i == 0 || records[i].worker != records[i - 1].worker || records[i].connection != records[i - 1].connection) {
+            numberOfConnections++;
+        }
+    }
+    struct replayConnection *list = calloc((size_t) numberOfConnections + 1, sizeof(struct replayConnection));
+    int n = -1;
+    for(i = 0; i < count; i++) {
+        if(n == -1 || records[i].worker != list[n].records[0].worker || records[i].connection != list[n].records[0].connection) {
+            n++;
+            list[n].records = &records[i];
+            list[n].fd = -1;
+        }
+        list[n].count++;
+        list[n].requests += records[i].requests;
+    }
+    for(n = 0; n < numberOfConnections; n++) {
+        list[n].responses = calloc((size_t) list[n].requests + 1, sizeof(struct pendingResponse));
+    }
+    qsort(list, (size_t) numberOfConnections, sizeof(struct replayConnection), compareConnections);
+    *connections = list;
+    return numberOfConnections;
+}
+
+/* A method that finds when a record is due, in the monotonic time of now(). */
+long dueTime(struct replaySettings *settings, struct traceRecord *record) {
+    return settings->start + (long) ((double) record->time * 1000.0 / settings->speed);
+}
+
+/* A method that opens the connection of the trace to the server, without
+ * waiting for it to be established. Returns 0 on success and -1 on failure.
+ */
+int openConnection(struct replayThread *thread, struct replayConnection *conn) {
+    struct replaySettings *settings = thread->settings;
+    conn->fd = socket(settings->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd == -1) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(conn->fd, (struct sockaddr *) &settings->address, settings->addressLength) == -1 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    conn->connecting = 1;
+    conn->reader = malloc(sizeof(struct responseReader));
+    resetReader(conn->reader);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+    thread->open++;
+    return 0;
+}
+
+/* A method that is done with a connection. The requests of it that have not
+ * been answered, sent or not, are counted as errors.
+ */
+void closeConnection(struct replayThread *thread, struct replayConnection *conn) {
+    thread->errors += (unsigned long) (conn->requests - conn->answered);
+    if(conn->fd != -1) {
+        close(conn->fd);
+        thread->open--;
+    }
+    conn->fd = -1;
+    free(conn->reader);
+    conn->reader = NULL;
+    conn->next = conn->count;
+    thread->done++;
+}
+
+/* A method that sends the records of a connection that are due, as far as
+ * the socket takes them. Flat out, a record that starts a request waits for
+ * the responses to the requests before it.
+ * Returns when the next record is due, or LONG_MAX if the connection waits
+ * for something else.
+ */
+long sendRecords(struct replayThread *thread, struct replayConnection *conn) {
+    struct replaySettings *settings = thread->settings;
+    while(conn->next < conn->count) {
+        struct traceRecord *record = &conn->records[conn->next];
+        long time = now();
+        long due = settings->speed > 0 ? dueTime(settings, record) : time;
+        if(due > time) {
+            return due;
+        }
+        if(conn->connecting || (settings->speed == 0 && record->requests > 0 && conn->answered < conn->sent)) {
+            return LONG_MAX;
+        }
+        if(conn->offset == 0) {
+            if(time - due > thread->maxLag) {
+                thread->maxLag = time - due;
+            }
+            int i;
+            for(i = 0; i < record->requests; i++) {
+                conn->responses[conn->sent].sentAt = due;
+                conn->responses[conn->sent].headRequest = i == 0 && record->headRequest;
+                conn->sent++;
+            }
+        }
+        ssize_t n = send(conn->fd, record->data + conn->offset, record->length - conn->offset, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(thread, conn);
+            }
+            return LONG_MAX;
+        }
+        thread->lastProgress = time;
+        conn->offset += (size_t) n;
+        if(conn->offset == record->length) {
+            conn->offset = 0;
+            conn->next++;
+        }
+    }
+    if(conn->answered == conn->requests) {
+        closeConnection(thread, conn);
+    }
+    return LONG_MAX;
+}
+
+/* A method that reads everything a connection has for us and the responses
+ * in it. A connection whose records have all been sent and answered is done.
+ * Returns 0 while the connection is open and -1 once it has been closed.
+ */
+int readResponses(struct replayThread *thread, struct replayConnection *conn) {
+    struct responseReader *reader = conn->reader;
+    for(;;) {
+        ssize_t n = read(conn->fd, reader->input + reader->inputLength, INPUT_LENGTH - reader->inputLength);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if(n <= 0) {
+            closeConnection(thread, conn);
+            return -1;
+        }
+        thread->bytesRead += (unsigned long) n;
+        thread->lastProgress = now();
+        reader->inputLength += (size_t) n;
+        for(;;) {
+            if(conn->answered == conn->sent) {
+                if(hasUnreadInput(reader)) {
+                    closeConnection(thread, conn);
+                    return -1;
+                }
+                break;
+            }
+            struct pendingResponse *response = &conn->responses[conn->answered];
+            int result = readResponse(reader, response->headRequest);
+            if(result == -1) {
+                closeConnection(thread, conn);
+                return -1;
+            }
+            if(result == 0) {
+                break;
+            }
+            long time = now();
+            histogramRecord(&thread->latency, (unsigned long) (time > response->sentAt ? time - response->sentAt : 0) / 1000);
+            thread->completed++;
+            if(reader->status < 200 || reader->status > 299) {
+                thread->non2xx++;
+            }
+            conn->answered++;
+        }
+        if(conn->answered == conn->requests && conn->next == conn->count) {
+            closeConnection(thread, conn);
+            return -1;
+        }
+    }
+}
+
+/* A method that opens the connections that are due, as far as the limit on
+ * open connections allows, and sends their first records.
+ */
+void openConnections(struct replayThread *thread) {
+    struct replaySettings *settings = thread->settings;
+    int limit = settings->maxConnections > 0 ? (settings->maxConnections + settings->threads - 1) / settings->threads : INT_MAX;
+    while(thread->nextOpen < thread->numberOfConnections && thread->open < limit) {
+        struct replayConnection *conn = thread->connections[thread->nextOpen];
+        long due = settings->speed > 0 ? dueTime(settings, &conn->records[0]) : 0;
+        if(due > now()) {
+            if(due < thread->nextWake) {
+                thread->nextWake = due;
+            }
+            return;
+        }
+        thread->nextOpen++;
+        if(openConnection(thread, conn) == -1) {
+            closeConnection(thread, conn);
+        }
+    }
+}
+
+/* A method that waits for events for at most the given nanoseconds. Records
+ * are sent at the microsecond they are due, so the wait is not rounded up to
+ * milliseconds unless the kernel can only wait that long.
+ */
+int waitForEvents(int epfd, struct epoll_event *events, long wait) {
+    struct timespec timeout = { wait / NANOSECONDS, wait % NANOSECONDS };
+    int n = epoll_pwait2(epfd, events, MAX_EVENTS, &timeout, NULL);
+    if(n == -1 && errno == ENOSYS) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, (int) ((wait + 999999) / 1000000));
+    }
+    return n;
+}
+
+/* A method that runs the event loop of a thread until all of its connections
+ * are done, or until nothing has happened for REPLAY_TIMEOUT seconds while
+ * there was nothing to send.
+ */
+void *runThread(void *argument) {
+    struct replayThread *thread = argument;
+    struct epoll_event events[MAX_EVENTS];
+    int i;
+
+    thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+    thread->lastProgress = now();
+    while(thread->done < thread->numberOfConnections) {
+        /* Send what has become due since the last round. */
+        long time = now();
+        if(time >= thread->nextWake) {
+            thread->nextWake = LONG_MAX;
+            for(i = 0; i < thread->nextOpen; i++) {
+                struct replayConnection *conn = thread->connections[i];
+                if(conn->fd != -1) {
+                    long due = sendRecords(thread, conn);
+                    if(due < thread->nextWake) {
+                        thread->nextWake = due;
+                    }
+                }
+            }
+            openConnections(thread);
+        }
+        time = now();
+        if(thread->nextWake == LONG_MAX && time - thread->lastProgress > REPLAY_TIMEOUT * NANOSECONDS) {
+            break;
+        }
+        long wait = thread->nextWake == LONG_MAX ? REPLAY_TIMEOUT * NANOSECONDS : thread->nextWake - time;
+        int n = waitForEvents(thread->epfd, events, wait > 0 ? wait : 0);
+        for(i = 0; i < n; i++) {
+            struct replayConnection *conn = events[i].data.ptr;
+            if(conn->fd == -1) {
+                continue;
+            }
+            if(events[i].events & EPOLLERR) {
+                closeConnection(thread, conn);
+                continue;
+            }
+            if(conn->connecting && (events[i].events & EPOLLOUT)) {
+                conn->connecting = 0;
+            }
+            /* A hang up is only seen once the responses before it have been read. */
+            if((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && readResponses(thread, conn) == -1) {
+                continue;
+            }
+            long due = sendRecords(thread, conn);
+            if(due < thread->nextWake) {
+                thread->nextWake = due;
+            }
+        }
+        /* Flat out, or with a limit, a connection that is done makes room for the next one. */
+        openConnections(thread);
+    }
+
+    /* What is still open has timed out. */
+    for(i = 0; i < thread->numberOfConnections; i++) {
+        if(thread->connections[i]->fd != -1 || i >= thread->nextOpen) {
+            closeConnection(thread, thread->connections[i]);
+        }
+    }
+    close(thread->epfd);
+    return NULL;
+}
+
+/* A method that prints how the replay tool is meant to be started. */
+void usage(char *program) {
+    fprintf(stderr, "Usage: %s [-x speed] [-t threads] [-c max-connections] [-j] [-o file] [-b file] trace host port\n", program);
+    fprintf(stderr, "  -x speed           multiple of the recorded speed, 0 sends flat out (default 1)\n");
+    fprintf(stderr, "  -t threads         number of threads, the connections of the trace are divided among them (default 1)\n");
+    fprintf(stderr, "  -c max-connections connections open at once, the others wait their turn (default 0, no limit)\n");
+    fprintf(stderr, "  -j                 print the result as one JSON line\n");
+    fprintf(stderr, "  -o file            also append the result as one JSON line to the file\n");
+    fprintf(stderr, "  -b file            compare the result with the last JSON line in the file\n");
+}
+
+/* A method that prints the result of a replay as one JSON line. */
+void printJSON(FILE *out, struct replaySettings *settings, struct replayThread *total, int connections, double seconds) {
+    struct histogram *latency = &total->latency;
+    fprintf(out, "{\"time\":%ld,\"trace\":\"%s\",\"host\":\"%s\",\"port\":\"%s\",\"speed\":%g,\"threads\":%d,\"connections\":%d,\"seconds\":%.3f,"
+            "\"requests\":%lu,\"rps\":%.1f,\"bytes\":%lu,\"errors\":%lu,\"non2xx\":%lu,\"max_lag_us\":%ld,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+            (long) time(NULL), settings->trace, settings->host, settings->port, settings->speed, settings->threads, connections, seconds,
+            total->completed, (double) total->completed / seconds, total->bytesRead, total->errors, total->non2xx, total->maxLag / 1000,
+            latency->total > 0 ? (double) latency->sum / (double) latency->total : 0.0,
+            histogramPercentile(latency, 50.0), histogramPercentile(latency, 90.0), histogramPercentile(latency, 99.0),
+            histogramPercentile(latency, 99.9), latency->max);
+}
+
+/* A method that compares a result with the last one in a file of results,
+ * written by replay -o or bench -o. Returns 0 on success and -1 if the file
+ * has no result.
+ */
+int compareWithBaseline(const char *path, char *result) {
+    FILE *in = fopen(path, "r");
+    if(in == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[RESULT_LINE_LENGTH];
+    char baseline[RESULT_LINE_LENGTH] = "";
+    while(fgets(line, sizeof(line), in) != NULL) {
+        if(line[0] == '{') {
+            memcpy(baseline, line, sizeof(line));
+        }
+    }
+    fclose(in);
+    if(baseline[0] == '\0') {
+        fprintf(stderr, "%s: no result to compare with\n", path);
+        return -1;
+    }
+    static const char *keys[] = { "rps", "errors", "non2xx", "mean", "p50", "p90", "p99", "p999", "max" };
+    printf("compared with the last result in %s\n", path);
+    size_t i;
+    for(i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        char *before = findValue(baseline, keys[i]);
+        char *after = findValue(result, keys[i]);
+        if(before == NULL || after == NULL) {
+            continue;
+        }
+        double from = strtod(before, NULL);
+        double to = strtod(after, NULL);
+        printf("  %-10s %12.1f -> %12.1f", keys[i], from, to);
+        if(from != 0) {
+            printf("  %+6.1f%%", (to - from) / from * 100.0);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct replaySettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.speed = 1;
+    settings.threads = 1;
+    int json = 0;
+    char *outputFile = NULL;
+    char *baselineFile = NULL;
+
+    /* Parse the command line. */
+    int opt;
+    while((opt = getopt(argc, argv, "x:t:c:jo:b:")) != -1) {
+        switch(opt) {
+            case 'x':
+                settings.speed = atof(optarg);
+                break;
+            case 't':
+                settings.threads = atoi(optarg);
+                break;
+            case 'c':
+                settings.maxConnections = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'o':
+                outputFile = optarg;
+                break;
+            case 'b':
+                baselineFile = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(argc - optind != 3 || settings.speed < 0 || settings.threads <= 0 || settings.maxConnections < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    settings.trace = argv[optind];
+    settings.host = argv[optind + 1];
+    settings.port = argv[optind + 2];
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(settings.host, settings.port, &hints, &result);
+    if(error != 0) {
+        fprintf(stderr, "%s: %s\n", settings.host, gai_strerror(error));
+        return 1;
+    }
+    memcpy(&settings.address, result->ai_addr, result->ai_addrlen);
+    settings.addressLength = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    struct replayConnection *connections;
+    unsigned long dropped = 0;
+    int numberOfConnections = loadTrace(settings.trace, &connections, &dropped);
+    if(numberOfConnections == -1) {
+        return 1;
+    }
+    if(dropped > 0) {
+        fprintf(stderr, "%s: %lu records were dropped while it was captured, it is incomplete\n", settings.trace, dropped);
+    }
+    initScanning();
+
+    /* Start the threads, each with every so many connections of the trace. */
+    struct replayThread *threads = calloc((size_t) settings.threads, sizeof(struct replayThread));
+    int i;
+    for(i = 0; i < settings.threads; i++) {
+        threads[i].settings = &settings;
+        threads[i].connections = calloc((size_t) numberOfConnections / (size_t) settings.threads + 1, sizeof(struct replayConnection *));
+    }
+    for(i = 0; i < numberOfConnections; i++) {
+        struct replayThread *thread = &threads[i % settings.threads];
+        thread->connections[thread->numberOfConnections++] = &connections[i];
+    }
+    settings.start = now();
+    for(i = 0; i < settings.threads; i++) {
+        pthread_create(&threads[i].thread, NULL, runThread, &threads[i]);
+    }
+
+    struct replayThread total;
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < settings.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        total.completed += threads[i].completed;
+        total.errors += threads[i].errors;
+        total.non2xx += threads[i].non2xx;
+        total.bytesRead += threads[i].bytesRead;
+        if(threads[i].maxLag > total.maxLag) {
+            total.maxLag = threads[i].maxLag;
+        }
+        histogramMerge(&total.latency, &threads[i].latency);
+    }
+    double seconds = (double) (now() - settings.start) / NANOSECONDS;
+
+    char line[RESULT_LINE_LENGTH];
+    FILE *memory = fmemopen(line, sizeof(line), "w");
+    printJSON(memory, &settings, &total, numberOfConnections, seconds);
+    fclose(memory);
+    if(json) {
+        fputs(line, stdout);
+    }
+    else {
+        printf("%s: %d connections on %d threads, ", settings.trace, numberOfConnections, settings.threads);
+        if(settings.speed > 0) {
+            printf("%gx the recorded speed, ", settings.speed);
+        }
+        else {
+            printf("flat out, ");
+        }
+        printf("%.2f s\n", seconds);
+        printf("  requests   %lu (%.1f/s), %.2f MB read\n", total.completed, (double) total.completed / seconds, (double) total.bytesRead / 1e6);
+        printf("  errors     %lu, non-2xx %lu, sent up to %ld us late\n", total.errors, total.non2xx, total.maxLag / 1000);
+        printf("  latency    p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+               histogramPercentile(&total.latency, 50.0), histogramPercentile(&total.latency, 90.0),
+               histogramPercentile(&total.latency, 99.0), histogramPercentile(&total.latency, 99.9), total.latency.max);
+    }
+    if(baselineFile != NULL && compareWithBaseline(baselineFile, line) == -1) {
+        return 1;
+    }
+    if(outputFile != NULL) {
+        FILE *out = fopen(outputFile, "a");
+        if(out == NULL) {
+            perror(outputFile);
+            return 1;
+        }
+        fputs(line, out);
+        fclose(out);
+    }
+    return total.completed > 0 ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+/* Kernels that scan a buffer for the first of a set of delimiter bytes, which
+ * is what finding the structure of an HTTP message comes down to: the spaces
+ * of the request line, the "?", "&" and "=" of the query, the ":" of a header
+ * and the line breaks, the last of which is the empty line ending the head.
+ *
+ * There are three kernels. The scalar one looks each byte up in a table, the
+ * SSE2 one compares 16 bytes at a time against each delimiter and the AVX2 one
+ * 32 bytes at a time. initScanning() picks the widest one the CPU can run, so
+ * the program does not have to be built for a particular CPU; SSE2 is part of
+ * every x86-64 CPU and other CPUs get the scalar kernel.
+ *
+ * It is a header of static functions as both httpd and the microbenchmarks in
+ * bench use it.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define MAX_DELIMITERS 8
+
+/* A struct describing a set of delimiter bytes, as a list for the vector
+ * kernels and as a table for the scalar one.
+ */
+struct delimiterSet {
+    unsigned char bytes[MAX_DELIMITERS];
+    int count;
+    unsigned char member[256];
+};
+
+/* A struct naming a scanning kernel, with whether this CPU can run it. */
+struct scanKernel {
+    const char *name;
+    size_t (*scan)(const char *data, size_t length, const struct delimiterSet *set);
+    int supported;
+};
+
+/* A method that fills in a delimiter set from a string of at most
+ * MAX_DELIMITERS bytes.
+ */
+static inline void initDelimiterSet(struct delimiterSet *set, const char *delimiters) {
+    memset(set, 0, sizeof(struct delimiterSet));
+    for(; *delimiters != '\0' && set->count < MAX_DELIMITERS; delimiters++) {
+        set->bytes[set->count++] = (unsigned char) *delimiters;
+        set->member[(unsigned char) *delimiters] = 1;
+    }
+}
+
+/* A method that finds the first delimiter in data one byte at a time.
+ * Returns its offset, or length if there is none.
+ */
+static inline size_t scanScalar(const char *data, size_t length, const struct delimiterSet *set) {
+    const unsigned char *p = (const unsigned char *) data;
+    size_t i = 0;
+    while(i < length && !set->member[p[i]]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__)
+/* A method that finds the first delimiter in data 16 bytes at a time, with
+ * one compare per delimiter folded into a mask of the bytes that match. It is
+ * inlined for each number of delimiters, so the compares are unrolled.
+ * Returns its offset, or length if there is none.
+ */
+static inline __attribute__((always_inline)) size_t scanSSE2Count(const char *data, size_t length, const struct delimiterSet *set, const int count) {
+    __m128i needles[MAX_DELIMITERS];
+    int j;
+    for(j = 0; j < count; j++) {
+        needles[j] = _mm_set1_epi8((char) set->bytes[j]);
+    }
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i found = _mm_cmpeq_epi8(block, needles[0]);
+        for(j = 1; j < count; j++) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, needles[j]));
+        }
+        unsigned mask = (unsigned) _mm_movemask_epi8(found);
+        if(mask != 0) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    return i + scanScalar(data + i, length - i, set);
+}
+
+/* A method that finds the first delimiter in data 16 bytes at a time.
+ * Returns its offset, or length if there is none.
+ */
+static inline size_t scanSSE2(const char *data, size_t length, const struct delimiterSet *set) {
+    switch(set->count) {
+        case 1: return scanSSE2Count(data, length, set, 1);
+        case 2: return scanSSE2Count(data, length, set, 2);
+        case 3: return scanSSE2Count(data, length, set, 3);
+        case 4: return scanSSE2Count(data, length, set, 4);
+        case 5: return scanSSE2Count(data, length, set, 5);
+        case 6: return scanSSE2Count(data, length, set, 6);
+        case 7: return scanSSE2Count(data, length, set, 7);
+        case 8: return scanSSE2Count(data, length, set, 8);
+        default: return length;
+    }
+}
+
+/* A method that finds the first delimiter in data 32 bytes at a time, as
+ * scanSSE2Count() does 16. It is built for AVX2 whatever the rest of the
+ * program is built for, so it must only be called on CPUs that have it.
+ * Returns its offset, or length if there is none.
+ */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) size_t scanAVX2Count(const char *data, size_t length, const struct delimiterSet *set, const int count) {
+    __m256i needles[MAX_DELIMITERS];
+    int j;
+    for(j = 0; j < count; j++) {
+        needles[j] = _mm256_set1_epi8((char) set->bytes[j]);
+    }
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i found = _mm256_cmpeq_epi8(block, needles[0]);
+        for(j = 1; j < count; j++) {
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi8(block, needles[j]));
+        }
+        unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+        if(mask != 0) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    /* The rest is done here too, as calling the SSE2 kernel from AVX2 code
+     * costs more than it saves.
+     */
+    if(i + 16 <= length) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i found = _mm_cmpeq_epi8(block, _mm256_castsi256_si128(needles[0]));
+        for(j = 1; j < count; j++) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm256_castsi256_si128(needles[j])));
+        }
+        unsigned mask = (unsigned) _mm_movemask_epi8(found);
+        if(mask != 0) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + scanScalar(data + i, length - i, set);
+}
+
+/* A method that finds the first delimiter in data 32 bytes at a time.
+ * Returns its offset, or length if there is none.
+ */
+__attribute__((target("avx2")))
+static inline size_t scanAVX2(const char *data, size_t length, const struct delimiterSet *set) {
+    switch(set->count) {
+        case 1: return scanAVX2Count(data, length, set, 1);
+        case 2: return scanAVX2Count(data, length, set, 2);
+        case 3: return scanAVX2Count(data, length, set, 3);
+        case 4: return scanAVX2Count(data, length, set, 4);
+        case 5: return scanAVX2Count(data, length, set, 5);
+        case 6: return scanAVX2Count(data, length, set, 6);
+        case 7: return scanAVX2Count(data, length, set, 7);
+        case 8: return scanAVX2Count(data, length, set, 8);
+        default: return length;
+    }
+}
+#endif
+
+/* A method that lists the kernels this program has, the scalar one first. */
+static inline const struct scanKernel *scanKernels(int *count) {
+    static struct scanKernel kernels[3];
+    int n = 0;
+    kernels[n++] = (struct scanKernel) { "scalar", scanScalar, 1 };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernels[n++] = (struct scanKernel) { "sse2", scanSSE2, 1 };
+    kernels[n++] = (struct scanKernel) { "avx2", scanAVX2, __builtin_cpu_supports("avx2") };
+#endif
+    *count = n;
+    return kernels;
+}
+
+/* The kernel scanDelimiters() calls, the scalar one until initScanning() has run. */
+static size_t (*scanKernel)(const char *data, size_t length, const struct delimiterSet *set) = scanScalar;
+
+/* A method that picks the widest kernel this CPU can run. It is called once,
+ * before any threads are started.
+ */
+static inline const char *initScanning(void) {
+    int count;
+    const struct scanKernel *kernels = scanKernels(&count);
+    const char *name = kernels[0].name;
+    int i;
+    for(i = 0; i < count; i++) {
+        if(kernels[i].supported) {
+            scanKernel = kernels[i].scan;
+            name = kernels[i].name;
+        }
+    }
+    return name;
+}
+
+/* A method that finds the first delimiter of a set in data.
+ * Returns its offset, or length if there is none.
+ */
+static inline size_t scanDelimiters(const char *data, size_t length, const struct delimiterSet *set) {
+    return scanKernel(data, length, set);
+}
+
+/* A method that finds the end of the head of a message, the empty line after
+ * the header lines, ended by "\r\n" or by a bare "\n" as well. Only the line
+ * breaks are looked at, the rest of each line is skipped by the kernel.
+ * Returns the length of the head including the empty line, or 0 if the head
+ * does not end within data.
+ */
+static inline size_t findHeadEnd(const char *data, size_t length, const struct delimiterSet *lineBreaks) {
+    size_t i = 0;
+    for(;;) {
+        i += scanDelimiters(data + i, length - i, lineBreaks);
+        if(i == length) {
+            return 0;
+        }
+        /* A bare "\r" is looked past, it only ends a line before a "\n". */
+        if(data[i] == '\n') {
+            if(i + 1 < length && data[i + 1] == '\n') {
+                return i + 2;
+            }
+            if(i + 2 < length && data[i + 1] == '\r' && data[i + 2] == '\n') {
+                return i + 3;
+            }
+        }
+        i++;
+    }
+}
+
+#endif
@@ -0,0 +1,7 @@
+#/bin/bash
+# Paths that would leave the document root are never served from outside it,
+# whether they climb out with ".." or name an absolute path with a second
+# leading slash. Each line counts the lines of /etc/passwd sent back: 0.
+PORT=${1:-$(/labs/tsam15/my_port)}
+curl -s --path-as-is localhost:$PORT/../../etc/passwd | grep -c "^root:"
+curl -s --path-as-is localhost:$PORT//etc/passwd | grep -c "^root:"